@@ -0,0 +1,328 @@
+/*
+blockreader_portable.c - Block buffered reader handing out lines without
+copying them.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <poll.h>
+#endif
+#include "blockreader_portable.h"
+
+// How often a read waiting for input checks the stop flag, in ms.
+#define STOP_POLL_MS 100
+
+struct blockreader
+{
+    int fd;
+    // Holds size bytes of data plus room for one NUL terminator.
+    char *buf;
+    size_t size;
+    // Unconsumed data lives in buf[start, end).
+    size_t start;
+    size_t end;
+    bool eof;
+    bool error;
+    volatile int *stop;
+    // Byte overwritten by the NUL terminating the last line handed out.
+    char *terminator_pos;
+    char terminator_saved;
+};
+
+
+// A read interrupted by a signal counts as an error so callers get a chance
+// to notice whatever the signal was for.
+static ssize_t read_fd(int fd, void *buf, size_t len)
+{
+#ifdef _WIN32
+    return _read(fd, buf, len > 0x7fffffff ? 0x7fffffff : (unsigned int)len);
+#else
+    return read(fd, buf, len);
+#endif
+}
+
+
+/*
+Waits until fd has input (or EOF) or *stop is set. Returns false if stopped.
+*/
+static bool wait_readable(struct blockreader *br)
+{
+#ifdef _WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle(br->fd);
+    DWORD avail;
+
+    // Only pipes can be waited on this way, anything else is read as is.
+    if (GetFileType(handle) != FILE_TYPE_PIPE) {
+        return !*br->stop;
+    }
+    while (!*br->stop) {
+        if (!PeekNamedPipe(handle, NULL, 0, NULL, &avail, NULL) || avail > 0) {
+            // A broken pipe is EOF, which the read reports.
+            return true;
+        }
+        Sleep(STOP_POLL_MS / 10);
+    }
+    return false;
+#else
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = br->fd;
+    pfd.events = POLLIN;
+    while (!*br->stop) {
+        // Signals land here as EINTR, and the flag is checked again. Other
+        // errors are left for the read to report.
+        rc = poll(&pfd, 1, STOP_POLL_MS);
+        if (rc > 0 || (rc < 0 && errno != EINTR)) {
+            return true;
+        }
+    }
+    return false;
+#endif
+}
+
+
+/*
+Puts back the byte clobbered by the last line's NUL terminator.
+*/
+static inline void restore_terminator(struct blockreader *br)
+{
+    if (br->terminator_pos) {
+        *br->terminator_pos = br->terminator_saved;
+        br->terminator_pos = NULL;
+    }
+}
+
+
+/*
+Reads another block after the data already buffered, moving that data to the
+front of the buffer or growing the buffer if there is no room left.
+Returns the number of bytes read, 0 on EOF, -1 on error.
+*/
+static ssize_t fill(struct blockreader *br)
+{
+    ssize_t rc;
+
+    if (br->eof) {
+        return 0;
+    }
+    if (br->error) {
+        return -1;
+    }
+
+    if (br->start == br->end) {
+        br->start = br->end = 0;
+    } else if (br->end == br->size && br->start > 0) {
+        memmove(br->buf, br->buf + br->start, br->end - br->start);
+        br->end -= br->start;
+        br->start = 0;
+    }
+
+    if (br->end == br->size) {
+        // A single line is longer than the buffer.
+        char *buf = realloc(br->buf, br->size*2 + 1);
+        if (buf == NULL) {
+            br->error = true;
+            errno = ENOMEM;
+            return -1;
+        }
+        br->buf = buf;
+        br->size *= 2;
+    }
+
+    if (br->stop != NULL && !wait_readable(br)) {
+        br->error = true;
+        errno = EINTR;
+        return -1;
+    }
+
+    rc = read_fd(br->fd, br->buf + br->end, br->size - br->end);
+    if (rc < 0) {
+        br->error = true;
+    } else if (rc == 0) {
+        br->eof = true;
+    } else {
+        br->end += rc;
+    }
+
+    return rc;
+}
+
+
+struct blockreader *blockreader_create(int fd, size_t block_size)
+{
+    struct blockreader *br;
+
+    if (block_size == 0) {
+        return NULL;
+    }
+
+    br = calloc(1, sizeof(struct blockreader));
+    if (br == NULL) {
+        return NULL;
+    }
+
+    br->buf = malloc(block_size + 1);
+    if (br->buf == NULL) {
+        free(br);
+        return NULL;
+    }
+
+    br->fd = fd;
+    br->size = block_size;
+    return br;
+}
+
+
+void blockreader_set_stop(struct blockreader *br, volatile int *stop)
+{
+    br->stop = stop;
+}
+
+
+void blockreader_destroy(struct blockreader *br)
+{
+    if (br == NULL) {
+        return;
+    }
+
+    free(br->buf);
+    free(br);
+}
+
+
+ssize_t blockreader_getline(struct blockreader *br, char **line)
+{
+    size_t scanned = 0;
+    size_t line_end;
+    char *nl;
+
+    restore_terminator(br);
+
+    for (;;) {
+        nl = memchr(br->buf + br->start + scanned, '\n', br->end - br->start - scanned);
+        if (nl) {
+            line_end = nl + 1 - br->buf;
+            break;
+        }
+
+        scanned = br->end - br->start;
+        if (fill(br) <= 0) {
+            if (br->error || br->start == br->end) {
+                return -1;
+            }
+            // Last line without a trailing newline.
+            line_end = br->end;
+            break;
+        }
+    }
+
+    // line_end can be at most br->size, which still has room for the NUL.
+    br->terminator_pos = br->buf + line_end;
+    br->terminator_saved = *br->terminator_pos;
+    *br->terminator_pos = '\0';
+
+    *line = br->buf + br->start;
+    br->start = line_end;
+
+    return line_end - (*line - br->buf);
+}
+
+
+bool blockreader_read(struct blockreader *br, void *buf, size_t len)
+{
+    char *dst = buf;
+    size_t chunk;
+    ssize_t rc;
+
+    restore_terminator(br);
+
+    while (len) {
+        chunk = br->end - br->start;
+        if (chunk) {
+            if (chunk > len) {
+                chunk = len;
+            }
+            memcpy(dst, br->buf + br->start, chunk);
+            br->start += chunk;
+        } else if (len >= br->size && !br->eof && !br->error) {
+            // Big reads skip the buffer entirely.
+            rc = read_fd(br->fd, dst, len);
+            if (rc < 0) {
+                br->error = true;
+                return false;
+            } else if (rc == 0) {
+                br->eof = true;
+                return false;
+            }
+            chunk = rc;
+        } else if (fill(br) <= 0) {
+            return false;
+        } else {
+            continue;
+        }
+
+        dst += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+
+int blockreader_getc(struct blockreader *br)
+{
+    restore_terminator(br);
+
+    if (br->start == br->end && fill(br) <= 0) {
+        return -1;
+    }
+
+    return (unsigned char)br->buf[br->start++];
+}
+
+
+size_t blockreader_peek(struct blockreader *br, char **data)
+{
+    restore_terminator(br);
+
+    if (br->start == br->end) {
+        fill(br);
+    }
+
+    *data = br->buf + br->start;
+    return br->end - br->start;
+}
+
+
+void blockreader_consume(struct blockreader *br, size_t len)
+{
+    br->start += len;
+}
+
+
+bool blockreader_error(struct blockreader *br)
+{
+    return br->error;
+}
@@ -0,0 +1,81 @@
+/*
+blockreader_portable.h - Block buffered reader handing out lines without
+copying them.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKREADER_PORTABLE_H
+#define BLOCKREADER_PORTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct blockreader;
+
+/*
+Creates a reader pulling block_size bytes at a time from fd.
+Returns NULL on failure.
+*/
+struct blockreader *blockreader_create(int fd, size_t block_size);
+
+/*
+Makes reads waiting for input give up once *stop is set, so another thread
+can stop the reader without cancelling it. The flag is checked at least every
+100 ms. A stopped read fails like an error. On Windows only pipes can be
+waited on, reads from anything else block as usual.
+*/
+void blockreader_set_stop(struct blockreader *br, volatile int *stop);
+
+void blockreader_destroy(struct blockreader *br);
+
+/*
+Points *line at the next line, including its terminating newline (if any)
+and NUL terminated. The line lives in the reader's buffer and is only valid
+until the next call on the reader. Returns the line length, or -1 on EOF or
+error (see blockreader_error()).
+*/
+ssize_t blockreader_getline(struct blockreader *br, char **line);
+
+/*
+Reads exactly len bytes into buf. Returns false on EOF or error.
+*/
+bool blockreader_read(struct blockreader *br, void *buf, size_t len);
+
+/*
+Returns the next byte, or -1 on EOF or error.
+*/
+int blockreader_getc(struct blockreader *br);
+
+/*
+Points *data at the unconsumed bytes in the buffer, reading a new block
+first if there are none. Returns how many bytes are available, 0 on EOF or
+error. The bytes are not NUL terminated.
+*/
+size_t blockreader_peek(struct blockreader *br, char **data);
+
+/*
+Marks len bytes returned by blockreader_peek() as used.
+*/
+void blockreader_consume(struct blockreader *br, size_t len);
+
+/*
+Returns true if reading failed for a reason other than EOF.
+*/
+bool blockreader_error(struct blockreader *br);
+
+#endif
@@ -0,0 +1,374 @@
+/*
+bulk_stream.c - Keeps a pool of asynchronous bulk transfers in flight to a
+Lasershark device.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "bulk_stream.h"
+
+// How long a single wait for USB events may block, in ms. Bounds how
+// quickly a set do_exit flag is noticed.
+#define BULK_STREAM_EVENT_TIMEOUT 100
+
+struct bulk_stream_slot
+{
+    struct bulk_stream *bs;
+    struct libusb_transfer *transfer;
+    unsigned char *buffer;
+    bool busy;
+};
+
+/*
+Handling events runs the callbacks of every stream on the context, so with
+several streams driven from their own threads a stream's callbacks can run
+on another stream's thread. lock covers everything the callback touches.
+*/
+struct bulk_stream
+{
+    pthread_mutex_t lock;
+    struct ls_device *dev;
+    unsigned char endpoint;
+    int buffer_len;
+    int depth;
+
+    struct bulk_stream_slot *slots;
+    // Stack of slots that are neither in flight nor handed out.
+    struct bulk_stream_slot **free_slots;
+    int free_count;
+    // Slot handed out by the last bulk_stream_get_buffer() call.
+    struct bulk_stream_slot *current;
+
+    int in_flight;
+    long in_flight_bytes;
+    // Transfers ever submitted and completed. They complete in order.
+    uint64_t submitted;
+    uint64_t completed;
+    int error;
+};
+
+
+static int transfer_status_to_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+
+/*
+Internal callback, returns a completed transfer's slot to the free stack.
+*/
+static void bulk_stream_callback(struct libusb_transfer *transfer)
+{
+    struct bulk_stream_slot *slot = transfer->user_data;
+    struct bulk_stream *bs = slot->bs;
+
+    pthread_mutex_lock(&bs->lock);
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        if (!bs->error) {
+            bs->error = transfer_status_to_error(transfer->status);
+        }
+    } else if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length != transfer->length) {
+        if (!bs->error) {
+            bs->error = LIBUSB_ERROR_IO;
+        }
+    }
+
+    slot->busy = false;
+    bs->in_flight--;
+    bs->in_flight_bytes -= transfer->length;
+    bs->completed++;
+    bs->free_slots[bs->free_count++] = slot;
+    pthread_mutex_unlock(&bs->lock);
+}
+
+
+int bulk_stream_handle_events(struct bulk_stream *bs, int timeout_us)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout_us / 1000000;
+    tv.tv_usec = timeout_us % 1000000;
+    return ls_device_handle_events(bs->dev, &tv);
+}
+
+
+struct bulk_stream *bulk_stream_create(struct ls_device *dev, unsigned char endpoint,
+                                       int buffer_len, int depth)
+{
+    struct bulk_stream *bs;
+    int i;
+
+    if (buffer_len <= 0 || depth <= 0) {
+        return NULL;
+    }
+
+    bs = calloc(1, sizeof(struct bulk_stream));
+    if (bs == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&bs->lock, NULL);
+    bs->dev = dev;
+    bs->endpoint = endpoint;
+    bs->buffer_len = buffer_len;
+    bs->depth = depth;
+
+    bs->slots = calloc(depth, sizeof(struct bulk_stream_slot));
+    bs->free_slots = calloc(depth, sizeof(struct bulk_stream_slot*));
+    if (bs->slots == NULL || bs->free_slots == NULL) {
+        goto fail;
+    }
+
+    for (i = 0; i < depth; i++) {
+        struct bulk_stream_slot *slot = &bs->slots[i];
+
+        slot->bs = bs;
+        slot->buffer = malloc(buffer_len);
+        slot->transfer = libusb_alloc_transfer(0);
+        if (slot->buffer == NULL || slot->transfer == NULL) {
+            goto fail;
+        }
+        bs->free_slots[bs->free_count++] = slot;
+    }
+
+    return bs;
+
+fail:
+    bulk_stream_destroy(bs);
+    return NULL;
+}
+
+
+void bulk_stream_destroy(struct bulk_stream *bs)
+{
+    int i;
+
+    if (bs == NULL) {
+        return;
+    }
+
+    if (bulk_stream_in_flight(bs)) {
+        pthread_mutex_lock(&bs->lock);
+        for (i = 0; i < bs->depth; i++) {
+            if (bs->slots[i].busy) {
+                ls_device_cancel_transfer(bs->dev, bs->slots[i].transfer);
+            }
+        }
+        pthread_mutex_unlock(&bs->lock);
+        while (bulk_stream_in_flight(bs)) {
+            if (bulk_stream_handle_events(bs, BULK_STREAM_EVENT_TIMEOUT * 1000) < 0) {
+                // Can't safely free transfers libusb still owns.
+                fprintf(stderr, "Could not reap %d bulk transfers\n", bulk_stream_in_flight(bs));
+                return;
+            }
+        }
+    }
+
+    if (bs->slots) {
+        for (i = 0; i < bs->depth; i++) {
+            if (bs->slots[i].transfer) {
+                libusb_free_transfer(bs->slots[i].transfer);
+            }
+            free(bs->slots[i].buffer);
+        }
+    }
+    free(bs->slots);
+    free(bs->free_slots);
+    pthread_mutex_destroy(&bs->lock);
+    free(bs);
+}
+
+
+unsigned char *bulk_stream_get_buffer(struct bulk_stream *bs, volatile int *do_exit)
+{
+    int rc;
+
+    if (bs->current) {
+        return bs->current->buffer;
+    }
+
+    pthread_mutex_lock(&bs->lock);
+    while (!bs->error && bs->free_count == 0) {
+        pthread_mutex_unlock(&bs->lock);
+        if (*do_exit) {
+            return NULL;
+        }
+        rc = bulk_stream_handle_events(bs, BULK_STREAM_EVENT_TIMEOUT * 1000);
+        pthread_mutex_lock(&bs->lock);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+            bs->error = rc;
+        }
+    }
+
+    if (!bs->error) {
+        bs->current = bs->free_slots[--bs->free_count];
+    }
+    pthread_mutex_unlock(&bs->lock);
+
+    return bs->current ? bs->current->buffer : NULL;
+}
+
+
+/*
+Submits len bytes of buffer using the slot handed out by the last
+bulk_stream_get_buffer() call.
+*/
+static bool submit_slot(struct bulk_stream *bs, unsigned char *buffer, int len)
+{
+    struct bulk_stream_slot *slot = bs->current;
+    int rc;
+
+    // No timeout: the device NAKs while its ringbuffer is full, and leaving
+    // the transfer queued is exactly what keeps it busy.
+    libusb_fill_bulk_transfer(slot->transfer, ls_device_usb_handle(bs->dev), bs->endpoint, buffer, len,
+                              bulk_stream_callback, slot, 0);
+
+    // Counted first, another thread may run the callback as soon as it's
+    // submitted.
+    pthread_mutex_lock(&bs->lock);
+    slot->busy = true;
+    bs->in_flight++;
+    bs->in_flight_bytes += len;
+    bs->submitted++;
+    pthread_mutex_unlock(&bs->lock);
+
+    rc = ls_device_submit_transfer(bs->dev, slot->transfer);
+    if (rc < 0) {
+        pthread_mutex_lock(&bs->lock);
+        slot->busy = false;
+        bs->in_flight--;
+        bs->in_flight_bytes -= len;
+        bs->submitted--;
+        bs->error = rc;
+        pthread_mutex_unlock(&bs->lock);
+        return false;
+    }
+
+    bs->current = NULL;
+    return true;
+}
+
+
+bool bulk_stream_submit(struct bulk_stream *bs, int len)
+{
+    if (bs->current == NULL || len <= 0 || len > bs->buffer_len || bulk_stream_error(bs)) {
+        return false;
+    }
+
+    return submit_slot(bs, bs->current->buffer, len);
+}
+
+
+bool bulk_stream_submit_buffer(struct bulk_stream *bs, const unsigned char *buffer, int len,
+                               volatile int *do_exit)
+{
+    if (len <= 0 || NULL == bulk_stream_get_buffer(bs, do_exit)) {
+        return false;
+    }
+
+    // OUT transfers only read the buffer.
+    return submit_slot(bs, (unsigned char*)buffer, len);
+}
+
+
+bool bulk_stream_wait_idle(struct bulk_stream *bs, volatile int *do_exit)
+{
+    int rc;
+
+    while (!bulk_stream_error(bs) && bulk_stream_in_flight(bs)) {
+        if (*do_exit) {
+            return false;
+        }
+        rc = bulk_stream_handle_events(bs, BULK_STREAM_EVENT_TIMEOUT * 1000);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+            pthread_mutex_lock(&bs->lock);
+            bs->error = rc;
+            pthread_mutex_unlock(&bs->lock);
+        }
+    }
+
+    return !bulk_stream_error(bs);
+}
+
+
+int bulk_stream_in_flight(struct bulk_stream *bs)
+{
+    int in_flight;
+
+    pthread_mutex_lock(&bs->lock);
+    in_flight = bs->in_flight;
+    pthread_mutex_unlock(&bs->lock);
+    return in_flight;
+}
+
+
+long bulk_stream_in_flight_bytes(struct bulk_stream *bs)
+{
+    long in_flight_bytes;
+
+    pthread_mutex_lock(&bs->lock);
+    in_flight_bytes = bs->in_flight_bytes;
+    pthread_mutex_unlock(&bs->lock);
+    return in_flight_bytes;
+}
+
+
+uint64_t bulk_stream_submitted(struct bulk_stream *bs)
+{
+    uint64_t submitted;
+
+    pthread_mutex_lock(&bs->lock);
+    submitted = bs->submitted;
+    pthread_mutex_unlock(&bs->lock);
+    return submitted;
+}
+
+
+uint64_t bulk_stream_completed(struct bulk_stream *bs)
+{
+    uint64_t completed;
+
+    pthread_mutex_lock(&bs->lock);
+    completed = bs->completed;
+    pthread_mutex_unlock(&bs->lock);
+    return completed;
+}
+
+
+int bulk_stream_error(struct bulk_stream *bs)
+{
+    int error;
+
+    pthread_mutex_lock(&bs->lock);
+    error = bs->error;
+    pthread_mutex_unlock(&bs->lock);
+    return error;
+}
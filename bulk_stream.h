@@ -0,0 +1,102 @@
+/*
+bulk_stream.h - Keeps a pool of asynchronous bulk transfers in flight to a
+Lasershark device.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BULK_STREAM_H
+#define BULK_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb.h>
+#include "lasershark_device.h"
+
+struct bulk_stream;
+
+/*
+Creates a stream with depth preallocated buffers of buffer_len bytes each.
+A stream is driven from one thread, but its completions may be handled by
+any thread handling events. Returns NULL on failure.
+*/
+struct bulk_stream *bulk_stream_create(struct ls_device *dev, unsigned char endpoint,
+                                       int buffer_len, int depth);
+
+/*
+Cancels anything still in flight and frees the stream.
+*/
+void bulk_stream_destroy(struct bulk_stream *bs);
+
+/*
+Returns a free buffer to be filled by the caller, handling USB events until
+one is available. Returns NULL if a transfer failed or *do_exit was set
+while waiting.
+*/
+unsigned char *bulk_stream_get_buffer(struct bulk_stream *bs, volatile int *do_exit);
+
+/*
+Submits the first len bytes of the buffer returned by the last
+bulk_stream_get_buffer() call.
+*/
+bool bulk_stream_submit(struct bulk_stream *bs, int len);
+
+/*
+Submits len bytes straight from the caller's buffer, which must stay
+unchanged until the transfer completes, handling USB events until a transfer
+is free. len may exceed the stream's buffer length. Returns false if a
+transfer failed or *do_exit was set while waiting.
+*/
+bool bulk_stream_submit_buffer(struct bulk_stream *bs, const unsigned char *buffer, int len,
+                               volatile int *do_exit);
+
+/*
+Handles USB events until every submitted transfer has completed. Returns
+false if a transfer failed or *do_exit was set while waiting.
+*/
+bool bulk_stream_wait_idle(struct bulk_stream *bs, volatile int *do_exit);
+
+/*
+Handles USB events (and so completions) for up to timeout_us microseconds.
+Returns a libusb error code.
+*/
+int bulk_stream_handle_events(struct bulk_stream *bs, int timeout_us);
+
+/*
+Returns the number of submitted transfers that have not completed yet.
+*/
+int bulk_stream_in_flight(struct bulk_stream *bs);
+
+/*
+Returns the number of bytes in submitted transfers that have not completed yet.
+*/
+long bulk_stream_in_flight_bytes(struct bulk_stream *bs);
+
+/*
+Return how many transfers were ever submitted and how many of those have
+completed. Transfers complete in submission order, so a buffer passed to
+bulk_stream_submit_buffer() is free again once bulk_stream_completed()
+reaches the bulk_stream_submitted() count taken right after submitting it.
+*/
+uint64_t bulk_stream_submitted(struct bulk_stream *bs);
+uint64_t bulk_stream_completed(struct bulk_stream *bs);
+
+/*
+Returns the libusb error of the first failed transfer, 0 if none failed.
+*/
+int bulk_stream_error(struct bulk_stream *bs);
+
+#endif
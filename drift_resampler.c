@@ -0,0 +1,180 @@
+/*
+drift_resampler.c - Keeps the JACK and Lasershark clocks from drifting apart.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "drift_resampler.h"
+
+/*
+Controller gains. The error is in seconds of queued output, so DRIFT_KP is
+per second: 1 ms off target asks for a 50 ppm correction. DRIFT_KI is
+DRIFT_KP^2/4 for a critically damped loop that settles in about 40 s.
+*/
+#define DRIFT_KP 0.05
+#define DRIFT_KI (DRIFT_KP * DRIFT_KP / 4)
+
+
+static double clamp_correction(double c)
+{
+    if (c > DRIFT_MAX_CORRECTION) {
+        return DRIFT_MAX_CORRECTION;
+    }
+    if (c < -DRIFT_MAX_CORRECTION) {
+        return -DRIFT_MAX_CORRECTION;
+    }
+    return c;
+}
+
+
+void drift_resampler_init(struct drift_resampler *rs)
+{
+    memset(rs, 0, sizeof(struct drift_resampler));
+    rs->ratio = 1.0;
+    rs->pos = -1.0;
+}
+
+
+void drift_resampler_set_ratio(struct drift_resampler *rs, double ratio)
+{
+    rs->ratio = 1.0 + clamp_correction(ratio - 1.0);
+}
+
+
+uint32_t drift_resampler_run(struct drift_resampler *rs, const float *const in[DRIFT_RESAMPLER_CHANNELS],
+                             uint32_t frames, float *const out[DRIFT_RESAMPLER_CHANNELS])
+{
+    double step, t;
+    uint32_t n = 0;
+    int c, i;
+    float frac, a;
+
+    if (frames == 0) {
+        return 0;
+    }
+
+    if (!rs->primed) {
+        for (c = 0; c < DRIFT_RESAMPLER_CHANNELS; c++) {
+            rs->last[c] = in[c][0];
+        }
+        rs->primed = true;
+    }
+
+    step = 1.0 / rs->ratio;
+    for (t = rs->pos; t < (double)(frames - 1); t += step) {
+        i = (int)floor(t);
+        frac = (float)(t - i);
+        for (c = 0; c < DRIFT_RESAMPLER_CHANNELS; c++) {
+            a = i < 0 ? rs->last[c] : in[c][i];
+            out[c][n] = a + (in[c][i + 1] - a) * frac;
+        }
+        n++;
+    }
+
+    rs->pos = t - frames;
+    for (c = 0; c < DRIFT_RESAMPLER_CHANNELS; c++) {
+        rs->last[c] = in[c][frames - 1];
+    }
+
+    rs->frames_in += frames;
+    rs->frames_out += n;
+    return n;
+}
+
+
+void drift_controller_init(struct drift_controller *dc, uint32_t rate, uint64_t now_us)
+{
+    memset(dc, 0, sizeof(struct drift_controller));
+    drift_controller_reset(dc, rate, now_us);
+}
+
+
+void drift_controller_reset(struct drift_controller *dc, uint32_t rate, uint64_t now_us)
+{
+    dc->rate = rate;
+    dc->integral = 0;
+    dc->correction = 0;
+    dc->start_us = now_us;
+    dc->last_us = now_us;
+    dc->locked = false;
+}
+
+
+double drift_controller_update(struct drift_controller *dc, double level, uint64_t now_us)
+{
+    double error, dt;
+
+    if (dc->rate == 0) {
+        return 0;
+    }
+
+    if (!dc->locked) {
+        // Follow the level while things settle, whatever it is at the end
+        // becomes the target.
+        dc->target = level;
+        dc->last_us = now_us;
+        if (now_us - dc->start_us >= DRIFT_SETTLE_US) {
+            dc->locked = true;
+        }
+        return 0;
+    }
+
+    dt = (double)(now_us - dc->last_us) / 1000000.0;
+    dc->last_us = now_us;
+
+    // A jump this size is an underrun or a stall, not drift. Slewing it
+    // back would take minutes, so live with the new level instead.
+    if (fabs(level - dc->target) > (double)dc->rate * DRIFT_RELOCK_US / 1000000.0) {
+        dc->target = level;
+        dc->relocks++;
+    }
+
+    // Positive when too much is queued, so output has to run slow.
+    error = (level - dc->target) / dc->rate;
+    // Clamping the integral too keeps it from winding up while saturated.
+    dc->integral = clamp_correction(dc->integral + DRIFT_KI * error * dt);
+    dc->correction = -clamp_correction(DRIFT_KP * error + dc->integral);
+
+    dc->updates++;
+    error = fabs(level - dc->target);
+    dc->error_sq_total += error * error;
+    if (error > dc->error_max) {
+        dc->error_max = error;
+    }
+    if (dc->correction < dc->correction_min) {
+        dc->correction_min = dc->correction;
+    }
+    if (dc->correction > dc->correction_max) {
+        dc->correction_max = dc->correction;
+    }
+
+    return dc->correction;
+}
+
+
+void drift_controller_print_stats(struct drift_controller *dc)
+{
+    printf("Drift: JACK clock %+.1f ppm against the Lasershark, correcting by %+.1f ppm"
+           " (%+.1f to %+.1f)\n", dc->integral * 1000000, dc->correction * 1000000,
+           dc->correction_min * 1000000, dc->correction_max * 1000000);
+    printf("Drift: held %.0f samples queued, %.1f samples rms error, %.0f samples largest error,"
+           " %u relocks\n", dc->target, dc->updates ? sqrt(dc->error_sq_total / dc->updates) : 0.0,
+           dc->error_max, dc->relocks);
+}
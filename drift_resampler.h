@@ -0,0 +1,115 @@
+/*
+drift_resampler.h - Keeps the JACK and Lasershark clocks from drifting apart.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DRIFT_RESAMPLER_H
+#define DRIFT_RESAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// x, y, r, g and b.
+#define DRIFT_RESAMPLER_CHANNELS 5
+// Largest correction either way, as a fraction of the rate. Crystals are
+// usually within 100 ppm of each other.
+#define DRIFT_MAX_CORRECTION 0.001
+// Most output frames drift_resampler_run() can make from frames input frames.
+#define DRIFT_RESAMPLER_MAX_OUT(frames) ((frames) + (frames) / 512 + 2)
+// How long the controller watches the level before locking onto it, in us.
+#define DRIFT_SETTLE_US 2000000
+// Errors bigger than this, in us, make the controller lock onto the new level.
+#define DRIFT_RELOCK_US 10000
+
+/*
+Linearly interpolates the input at a slightly different rate. Corrections
+are tiny, so in practice this smoothly slips or repeats a sample every so
+often rather than dropping one outright.
+*/
+struct drift_resampler
+{
+    // Output frames per input frame.
+    double ratio;
+    // Where the next output frame falls, in input frames relative to the
+    // first frame of the next call. -1 is the last frame of the previous call.
+    double pos;
+    float last[DRIFT_RESAMPLER_CHANNELS];
+    bool primed;
+
+    // Statistics
+    uint64_t frames_in;
+    uint64_t frames_out;
+};
+
+void drift_resampler_init(struct drift_resampler *rs);
+
+/*
+Sets the output to input ratio, clamped to DRIFT_MAX_CORRECTION of 1.
+*/
+void drift_resampler_set_ratio(struct drift_resampler *rs, double ratio);
+
+/*
+Resamples frames frames of every channel in in into out, which must have room
+for DRIFT_RESAMPLER_MAX_OUT(frames) frames. Returns the number of frames
+written. Output lags the input by one frame.
+*/
+uint32_t drift_resampler_run(struct drift_resampler *rs, const float *const in[DRIFT_RESAMPLER_CHANNELS],
+                             uint32_t frames, float *const out[DRIFT_RESAMPLER_CHANNELS]);
+
+/*
+A PI controller on the number of samples queued between JACK and the
+display. It locks onto the level seen after DRIFT_SETTLE_US and then trims
+the resampler ratio so that level holds. Jumps over DRIFT_RELOCK_US, from
+underruns, move the target rather than being slewed back. Once settled the integral term is
+the measured clock offset.
+*/
+struct drift_controller
+{
+    uint32_t rate;
+    double target;
+    double integral;
+    double correction;
+    uint64_t start_us;
+    uint64_t last_us;
+    bool locked;
+
+    // Statistics
+    uint32_t updates;
+    uint32_t relocks;
+    double error_sq_total;
+    double error_max;
+    double correction_min;
+    double correction_max;
+};
+
+void drift_controller_init(struct drift_controller *dc, uint32_t rate, uint64_t now_us);
+
+/*
+Starts over at a new rate, for example after the ilda rate changed.
+*/
+void drift_controller_reset(struct drift_controller *dc, uint32_t rate, uint64_t now_us);
+
+/*
+Feeds in the average number of samples queued since the last update and
+returns the correction to apply, as a fraction: the resampler ratio is one
+plus this.
+*/
+double drift_controller_update(struct drift_controller *dc, double level, uint64_t now_us);
+
+void drift_controller_print_stats(struct drift_controller *dc);
+
+#endif
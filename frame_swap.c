@@ -0,0 +1,177 @@
+/*
+frame_swap.c - Lock-free front and back frame buffers, for showing the newest
+frame as soon as the one being drawn is done.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame_swap.h"
+
+// Which buffer is the front one
+#define STATE_FRONT 1
+// The back buffer holds a complete frame that wasn't swapped in yet
+#define STATE_READY 2
+// The producer is writing the back buffer, it can't be swapped in
+#define STATE_BUSY 4
+
+struct frame_swap
+{
+    atomic_uint state;
+    uint32_t max_samples;
+
+    struct lasershark_sample *frames[2];
+    uint32_t counts[2];
+    uint32_t capacities[2];
+
+    // Written by the producer only.
+    uint64_t submitted;
+    uint64_t dropped;
+    // Written by the consumer only.
+    uint64_t swapped;
+};
+
+
+struct frame_swap *frame_swap_create(uint32_t max_samples)
+{
+    struct frame_swap *fs;
+
+    if (max_samples == 0) {
+        return NULL;
+    }
+
+    fs = calloc(1, sizeof(struct frame_swap));
+    if (fs == NULL) {
+        return NULL;
+    }
+    fs->max_samples = max_samples;
+    atomic_init(&fs->state, 0);
+
+    return fs;
+}
+
+
+void frame_swap_destroy(struct frame_swap *fs)
+{
+    if (fs == NULL) {
+        return;
+    }
+
+    free(fs->frames[0]);
+    free(fs->frames[1]);
+    free(fs);
+}
+
+
+// Grows a buffer by doubling, the consumer never touches the back one.
+static bool reserve(struct frame_swap *fs, int index, uint32_t count)
+{
+    struct lasershark_sample *grown;
+    uint32_t capacity = fs->capacities[index];
+
+    if (count <= capacity) {
+        return true;
+    }
+
+    if (capacity == 0) {
+        capacity = 64;
+    }
+    while (capacity < count) {
+        capacity = capacity > fs->max_samples / 2 ? fs->max_samples : capacity * 2;
+    }
+
+    grown = realloc(fs->frames[index], sizeof(struct lasershark_sample)*capacity);
+    if (grown == NULL) {
+        return false;
+    }
+    fs->frames[index] = grown;
+    fs->capacities[index] = capacity;
+    return true;
+}
+
+
+bool frame_swap_submit(struct frame_swap *fs, const struct lasershark_sample *samples, uint32_t count)
+{
+    unsigned int state, back;
+
+    if (count == 0 || count > fs->max_samples) {
+        return false;
+    }
+
+    // Once busy is set the consumer can't swap, so the back buffer stays put.
+    state = atomic_fetch_or_explicit(&fs->state, STATE_BUSY, memory_order_acquire);
+    back = !(state & STATE_FRONT);
+
+    if (!reserve(fs, back, count)) {
+        atomic_fetch_and_explicit(&fs->state, ~STATE_BUSY, memory_order_release);
+        return false;
+    }
+    memcpy(fs->frames[back], samples, sizeof(struct lasershark_sample)*count);
+    fs->counts[back] = count;
+
+    fs->submitted++;
+    if (state & STATE_READY) {
+        fs->dropped++;
+    }
+
+    state = atomic_load_explicit(&fs->state, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&fs->state, &state, (state | STATE_READY) & ~STATE_BUSY,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+
+    return true;
+}
+
+
+const struct lasershark_sample *frame_swap_front(struct frame_swap *fs, uint32_t *count)
+{
+    unsigned int state = atomic_load_explicit(&fs->state, memory_order_acquire);
+    unsigned int front;
+
+    if ((state & STATE_READY) && !(state & STATE_BUSY)) {
+        // Fails only if the producer just started writing a newer frame,
+        // which is then swapped in at the next boundary instead.
+        if (atomic_compare_exchange_strong_explicit(&fs->state, &state, (state ^ STATE_FRONT) & ~STATE_READY,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            state = (state ^ STATE_FRONT) & ~STATE_READY;
+            fs->swapped++;
+        }
+    }
+
+    front = state & STATE_FRONT;
+    *count = fs->counts[front];
+    return *count ? fs->frames[front] : NULL;
+}
+
+
+uint64_t frame_swap_submitted(struct frame_swap *fs)
+{
+    return fs->submitted;
+}
+
+
+uint64_t frame_swap_swapped(struct frame_swap *fs)
+{
+    return fs->swapped;
+}
+
+
+uint64_t frame_swap_dropped(struct frame_swap *fs)
+{
+    return fs->dropped;
+}
@@ -0,0 +1,68 @@
+/*
+frame_swap.h - Lock-free front and back frame buffers, for showing the newest
+frame as soon as the one being drawn is done.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FRAME_SWAP_H
+#define FRAME_SWAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "lasershark_sample.h"
+
+/*
+One producer hands frames to one consumer, which keeps drawing the front
+frame and only swaps in the back one between passes, so frames never tear.
+There is a single back buffer: a frame that is replaced before it was
+swapped in is dropped, so a producer that runs ahead never builds up a
+backlog and the newest frame is always at most one pass away.
+*/
+struct frame_swap;
+
+/*
+Creates an empty swap for frames of up to max_samples samples. Returns NULL
+on failure.
+*/
+struct frame_swap *frame_swap_create(uint32_t max_samples);
+
+void frame_swap_destroy(struct frame_swap *fs);
+
+/*
+Producer side. Copies count samples into the back buffer, replacing any
+frame there that wasn't swapped in yet. Returns false if count is 0 or too
+large, or memory ran out.
+*/
+bool frame_swap_submit(struct frame_swap *fs, const struct lasershark_sample *samples, uint32_t count);
+
+/*
+Consumer side. Call at each frame boundary. Swaps in the back frame if a new
+one is complete, and returns the front frame with its sample count in
+*count, or NULL if none was submitted yet. The frame stays unchanged until
+the next call.
+*/
+const struct lasershark_sample *frame_swap_front(struct frame_swap *fs, uint32_t *count);
+
+/*
+Return how many frames were submitted, swapped in and dropped unseen. Only
+exact once both sides are done.
+*/
+uint64_t frame_swap_submitted(struct frame_swap *fs);
+uint64_t frame_swap_swapped(struct frame_swap *fs);
+uint64_t frame_swap_dropped(struct frame_swap *fs);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+iso_pool.c - Fixed set of preallocated ISO transfers, recycled through a
+lock-free free list.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "iso_pool.h"
+
+/*
+The free list is a stack of transfer indexes. Its head packs the index of
+the top entry, plus one so 0 means empty, with a counter that changes on
+every update. A transfer popped and pushed back between another thread's
+load and compare-and-swap then still fails the swap (the ABA problem).
+*/
+#define HEAD_INDEX(head) ((uint32_t)(head))
+#define HEAD_TAG(head) ((uint32_t)((head) >> 32))
+#define MAKE_HEAD(tag, index) (((uint64_t)(tag) << 32) | (index))
+
+struct iso_pool_entry
+{
+    struct iso_pool *pool;
+    // Index of the next free entry plus one, 0 at the bottom of the stack.
+    atomic_uint_fast32_t next;
+    struct libusb_transfer *transfer;
+    unsigned char *buffer;
+    void *user_data;
+};
+
+struct iso_pool
+{
+    atomic_uint_fast64_t head;
+    atomic_int in_use;
+    atomic_uint_fast32_t exhausted;
+
+    int count;
+    struct iso_pool_entry *entries;
+};
+
+
+struct iso_pool *iso_pool_create(struct ls_device *dev, unsigned char endpoint, int count,
+                                 int packets, int packet_len,
+                                 libusb_transfer_cb_fn callback, void *user_data)
+{
+    struct iso_pool *pool;
+    struct iso_pool_entry *entry;
+    int i;
+
+    if (count <= 0 || packets <= 0 || packet_len <= 0) {
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(struct iso_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->count = count;
+    pool->entries = calloc(count, sizeof(struct iso_pool_entry));
+    if (pool->entries == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->exhausted, 0);
+
+    for (i = 0; i < count; i++) {
+        entry = &pool->entries[i];
+        entry->pool = pool;
+        entry->user_data = user_data;
+        entry->buffer = malloc(packets * packet_len);
+        entry->transfer = libusb_alloc_transfer(packets);
+        if (entry->buffer == NULL || entry->transfer == NULL) {
+            iso_pool_destroy(pool);
+            return NULL;
+        }
+
+        libusb_fill_iso_transfer(entry->transfer, ls_device_usb_handle(dev), endpoint,
+                                 entry->buffer, packets * packet_len, packets, callback, entry, 0);
+        libusb_set_iso_packet_lengths(entry->transfer, packet_len);
+
+        // Chain every entry onto the free list, entry 0 on top.
+        atomic_init(&entry->next, i + 2 <= count ? i + 2 : 0);
+    }
+    atomic_init(&pool->head, MAKE_HEAD(0, 1));
+
+    return pool;
+}
+
+
+void iso_pool_destroy(struct iso_pool *pool)
+{
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    for (i = 0; i < pool->count; i++) {
+        if (pool->entries[i].transfer) {
+            libusb_free_transfer(pool->entries[i].transfer);
+        }
+        free(pool->entries[i].buffer);
+    }
+    free(pool->entries);
+    free(pool);
+}
+
+
+struct libusb_transfer *iso_pool_get(struct iso_pool *pool)
+{
+    uint64_t head, new_head;
+    struct iso_pool_entry *entry;
+
+    head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    do {
+        if (HEAD_INDEX(head) == 0) {
+            atomic_fetch_add_explicit(&pool->exhausted, 1, memory_order_relaxed);
+            return NULL;
+        }
+        entry = &pool->entries[HEAD_INDEX(head) - 1];
+        new_head = MAKE_HEAD(HEAD_TAG(head) + 1,
+                             atomic_load_explicit(&entry->next, memory_order_relaxed));
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head,
+             memory_order_acquire, memory_order_acquire));
+
+    atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed);
+    return entry->transfer;
+}
+
+
+void iso_pool_put(struct iso_pool *pool, struct libusb_transfer *transfer)
+{
+    struct iso_pool_entry *entry = transfer->user_data;
+    uint32_t index = (uint32_t)(entry - pool->entries) + 1;
+    uint64_t head, new_head;
+
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&entry->next, HEAD_INDEX(head), memory_order_relaxed);
+        new_head = MAKE_HEAD(HEAD_TAG(head) + 1, index);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head,
+             memory_order_release, memory_order_relaxed));
+}
+
+
+void *iso_pool_user_data(struct libusb_transfer *transfer)
+{
+    return ((struct iso_pool_entry *)transfer->user_data)->user_data;
+}
+
+
+int iso_pool_in_use(struct iso_pool *pool)
+{
+    return atomic_load_explicit(&pool->in_use, memory_order_relaxed);
+}
+
+
+uint32_t iso_pool_exhausted(struct iso_pool *pool)
+{
+    return atomic_load_explicit(&pool->exhausted, memory_order_relaxed);
+}
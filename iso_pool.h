@@ -0,0 +1,72 @@
+/*
+iso_pool.h - Fixed set of preallocated ISO transfers, recycled through a
+lock-free free list.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ISO_POOL_H
+#define ISO_POOL_H
+
+#include <stdint.h>
+#include <libusb.h>
+#include "lasershark_device.h"
+
+struct iso_pool;
+
+/*
+Creates count transfers of packets packet_len byte ISO packets each, filled
+in for endpoint with callback. A transfer's buffer holds its packets back to
+back. Everything is allocated here so taking and returning transfers never
+allocates. Returns NULL on failure.
+*/
+struct iso_pool *iso_pool_create(struct ls_device *dev, unsigned char endpoint, int count,
+                                 int packets, int packet_len,
+                                 libusb_transfer_cb_fn callback, void *user_data);
+
+/*
+Frees the pool. Every transfer must have been returned.
+*/
+void iso_pool_destroy(struct iso_pool *pool);
+
+/*
+Takes a free transfer, its buffer ready to be written. Returns NULL, and
+counts it, when all of them are in flight. Safe from any thread.
+*/
+struct libusb_transfer *iso_pool_get(struct iso_pool *pool);
+
+/*
+Returns a transfer, typically from its completion callback. Safe from any
+thread.
+*/
+void iso_pool_put(struct iso_pool *pool, struct libusb_transfer *transfer);
+
+/*
+The user_data passed to iso_pool_create(), for use in callbacks.
+*/
+void *iso_pool_user_data(struct libusb_transfer *transfer);
+
+/*
+Returns the number of transfers taken and not yet returned.
+*/
+int iso_pool_in_use(struct iso_pool *pool);
+
+/*
+Returns how many times iso_pool_get() found no free transfer.
+*/
+uint32_t iso_pool_exhausted(struct iso_pool *pool);
+
+#endif
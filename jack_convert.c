@@ -0,0 +1,285 @@
+/*
+jack_convert.c - Converts JACK float port buffers into Lasershark samples.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include "lasersharklib/lasershark_lib.h"
+#include "jack_convert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JACK_CONVERT_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(JACK_CONVERT_SSE2)
+#include <immintrin.h>
+#define JACK_CONVERT_AVX2
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define JACK_CONVERT_NEON
+#endif
+
+
+/*
+Scales and clamps one value. Written so NaN ends up at lo, like the vector
+min/max sequences below.
+*/
+static inline float scale_clamp(float v, float scale, float offset, float lo, float hi)
+{
+    v = v * scale + offset;
+    if (!(v >= lo)) {
+        v = lo;
+    }
+    if (v > hi) {
+        v = hi;
+    }
+    return v;
+}
+
+
+static inline void convert_one(const struct jack_convert *cv, float x, float y, float r, float g, float b,
+                               uint16_t *out)
+{
+    float fb = scale_clamp(b, cv->color_scale, cv->color_offset, cv->dac_min, cv->dac_max);
+
+    out[0] = (uint16_t)scale_clamp(r, cv->color_scale, cv->color_offset, cv->dac_min, cv->dac_max);
+    if (fb >= cv->c_threshold) {
+        out[0] |= LASERSHARK_C_BITMASK;
+    }
+    out[0] |= LASERSHARK_INTL_A_BITMASK;
+    out[1] = (uint16_t)scale_clamp(g, cv->color_scale, cv->color_offset, cv->dac_min, cv->dac_max);
+    out[2] = (uint16_t)scale_clamp(x, cv->pos_scale, cv->pos_offset, cv->dac_min, cv->dac_max);
+    out[3] = (uint16_t)scale_clamp(y, -cv->pos_scale, cv->pos_offset, cv->dac_min, cv->dac_max);
+}
+
+
+static void convert_scalar(const struct jack_convert *cv, const float *x, const float *y,
+                           const float *r, const float *g, const float *b,
+                           uint16_t *out, uint32_t frames)
+{
+    uint32_t i;
+
+    for (i = 0; i < frames; i++) {
+        convert_one(cv, x[i], y[i], r[i], g[i], b[i], out + i*4);
+    }
+}
+
+
+#ifdef JACK_CONVERT_SSE2
+/*
+Packs 4 frames of converted (but unmasked) values, plus the blue comparison
+mask, into 4 interleaved samples.
+*/
+static inline void pack_store_sse2(__m128i ri, __m128i gi, __m128i xi, __m128i yi, __m128 c_mask, uint16_t *out)
+{
+    // Values are at most 4095 so signed saturating packs are exact. The
+    // flag bits would not be, they go in afterwards at 16 bits.
+    __m128i rg = _mm_packs_epi32(ri, gi);
+    __m128i xy = _mm_packs_epi32(xi, yi);
+    __m128i bits = _mm_packs_epi32(_mm_castps_si128(c_mask), _mm_setzero_si128());
+    __m128i a, c;
+
+    bits = _mm_and_si128(bits, _mm_set1_epi16((short)LASERSHARK_C_BITMASK));
+    bits = _mm_or_si128(bits, _mm_set_epi16(0, 0, 0, 0,
+                                            (short)LASERSHARK_INTL_A_BITMASK, (short)LASERSHARK_INTL_A_BITMASK,
+                                            (short)LASERSHARK_INTL_A_BITMASK, (short)LASERSHARK_INTL_A_BITMASK));
+    rg = _mm_or_si128(rg, bits);
+
+    // r0 g0 r1 g1 ... and x0 y0 x1 y1 ..., then zipped 32 bits at a time.
+    a = _mm_unpacklo_epi16(rg, _mm_unpackhi_epi64(rg, rg));
+    c = _mm_unpacklo_epi16(xy, _mm_unpackhi_epi64(xy, xy));
+    _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi32(a, c));
+    _mm_storeu_si128((__m128i *)(out + 8), _mm_unpackhi_epi32(a, c));
+}
+
+
+static inline __m128 scale_clamp_sse2(__m128 v, __m128 scale, __m128 offset, __m128 lo, __m128 hi)
+{
+    v = _mm_add_ps(_mm_mul_ps(v, scale), offset);
+    // maxps returns its second operand for NaN.
+    return _mm_min_ps(_mm_max_ps(v, lo), hi);
+}
+
+
+static void convert_sse2(const struct jack_convert *cv, const float *x, const float *y,
+                         const float *r, const float *g, const float *b,
+                         uint16_t *out, uint32_t frames)
+{
+    const __m128 cs = _mm_set1_ps(cv->color_scale);
+    const __m128 co = _mm_set1_ps(cv->color_offset);
+    const __m128 ps = _mm_set1_ps(cv->pos_scale);
+    const __m128 nps = _mm_set1_ps(-cv->pos_scale);
+    const __m128 po = _mm_set1_ps(cv->pos_offset);
+    const __m128 lo = _mm_set1_ps(cv->dac_min);
+    const __m128 hi = _mm_set1_ps(cv->dac_max);
+    const __m128 ct = _mm_set1_ps(cv->c_threshold);
+    uint32_t i;
+
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m128 fr = scale_clamp_sse2(_mm_loadu_ps(r + i), cs, co, lo, hi);
+        __m128 fg = scale_clamp_sse2(_mm_loadu_ps(g + i), cs, co, lo, hi);
+        __m128 fb = scale_clamp_sse2(_mm_loadu_ps(b + i), cs, co, lo, hi);
+        __m128 fx = scale_clamp_sse2(_mm_loadu_ps(x + i), ps, po, lo, hi);
+        __m128 fy = scale_clamp_sse2(_mm_loadu_ps(y + i), nps, po, lo, hi);
+
+        pack_store_sse2(_mm_cvttps_epi32(fr), _mm_cvttps_epi32(fg), _mm_cvttps_epi32(fx),
+                        _mm_cvttps_epi32(fy), _mm_cmpge_ps(fb, ct), out + i*4);
+    }
+
+    convert_scalar(cv, x + i, y + i, r + i, g + i, b + i, out + i*4, frames - i);
+}
+#endif
+
+
+#ifdef JACK_CONVERT_AVX2
+static inline __attribute__((target("avx2"))) __m256 scale_clamp_avx2(__m256 v, __m256 scale, __m256 offset,
+        __m256 lo, __m256 hi)
+{
+    v = _mm256_add_ps(_mm256_mul_ps(v, scale), offset);
+    return _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+}
+
+
+/*
+Scales 8 frames at a time. The packing shuffles don't cross 128 bit lanes
+well, so each half goes through the SSE2 packer.
+*/
+static __attribute__((target("avx2"))) void convert_avx2(const struct jack_convert *cv, const float *x,
+        const float *y, const float *r, const float *g, const float *b, uint16_t *out, uint32_t frames)
+{
+    const __m256 cs = _mm256_set1_ps(cv->color_scale);
+    const __m256 co = _mm256_set1_ps(cv->color_offset);
+    const __m256 ps = _mm256_set1_ps(cv->pos_scale);
+    const __m256 nps = _mm256_set1_ps(-cv->pos_scale);
+    const __m256 po = _mm256_set1_ps(cv->pos_offset);
+    const __m256 lo = _mm256_set1_ps(cv->dac_min);
+    const __m256 hi = _mm256_set1_ps(cv->dac_max);
+    const __m256 ct = _mm256_set1_ps(cv->c_threshold);
+    uint32_t i;
+
+    for (i = 0; i + 8 <= frames; i += 8) {
+        __m256i ri = _mm256_cvttps_epi32(scale_clamp_avx2(_mm256_loadu_ps(r + i), cs, co, lo, hi));
+        __m256i gi = _mm256_cvttps_epi32(scale_clamp_avx2(_mm256_loadu_ps(g + i), cs, co, lo, hi));
+        __m256i xi = _mm256_cvttps_epi32(scale_clamp_avx2(_mm256_loadu_ps(x + i), ps, po, lo, hi));
+        __m256i yi = _mm256_cvttps_epi32(scale_clamp_avx2(_mm256_loadu_ps(y + i), nps, po, lo, hi));
+        __m256 fb = scale_clamp_avx2(_mm256_loadu_ps(b + i), cs, co, lo, hi);
+        __m256 c_mask = _mm256_cmp_ps(fb, ct, _CMP_GE_OQ);
+
+        pack_store_sse2(_mm256_castsi256_si128(ri), _mm256_castsi256_si128(gi),
+                        _mm256_castsi256_si128(xi), _mm256_castsi256_si128(yi),
+                        _mm256_castps256_ps128(c_mask), out + i*4);
+        pack_store_sse2(_mm256_extracti128_si256(ri, 1), _mm256_extracti128_si256(gi, 1),
+                        _mm256_extracti128_si256(xi, 1), _mm256_extracti128_si256(yi, 1),
+                        _mm256_extractf128_ps(c_mask, 1), out + i*4 + 16);
+    }
+
+    convert_sse2(cv, x + i, y + i, r + i, g + i, b + i, out + i*4, frames - i);
+}
+#endif
+
+
+#ifdef JACK_CONVERT_NEON
+static inline float32x4_t scale_clamp_neon(float32x4_t v, float32x4_t scale, float32x4_t offset,
+        float32x4_t lo, float32x4_t hi)
+{
+    v = vmlaq_f32(offset, v, scale);
+    return vminq_f32(vmaxq_f32(v, lo), hi);
+}
+
+
+static void convert_neon(const struct jack_convert *cv, const float *x, const float *y,
+                         const float *r, const float *g, const float *b,
+                         uint16_t *out, uint32_t frames)
+{
+    const float32x4_t cs = vdupq_n_f32(cv->color_scale);
+    const float32x4_t co = vdupq_n_f32(cv->color_offset);
+    const float32x4_t ps = vdupq_n_f32(cv->pos_scale);
+    const float32x4_t nps = vdupq_n_f32(-cv->pos_scale);
+    const float32x4_t po = vdupq_n_f32(cv->pos_offset);
+    const float32x4_t lo = vdupq_n_f32(cv->dac_min);
+    const float32x4_t hi = vdupq_n_f32(cv->dac_max);
+    const float32x4_t ct = vdupq_n_f32(cv->c_threshold);
+    const uint16x4_t c_bit = vdup_n_u16(LASERSHARK_C_BITMASK);
+    const uint16x4_t intl_bit = vdup_n_u16(LASERSHARK_INTL_A_BITMASK);
+    uint32_t i;
+
+    for (i = 0; i + 4 <= frames; i += 4) {
+        float32x4_t fb = scale_clamp_neon(vld1q_f32(b + i), cs, co, lo, hi);
+        uint16x4x4_t sample;
+
+        sample.val[0] = vmovn_u32(vcvtq_u32_f32(scale_clamp_neon(vld1q_f32(r + i), cs, co, lo, hi)));
+        sample.val[0] = vorr_u16(sample.val[0], vand_u16(vmovn_u32(vcgeq_f32(fb, ct)), c_bit));
+        sample.val[0] = vorr_u16(sample.val[0], intl_bit);
+        sample.val[1] = vmovn_u32(vcvtq_u32_f32(scale_clamp_neon(vld1q_f32(g + i), cs, co, lo, hi)));
+        sample.val[2] = vmovn_u32(vcvtq_u32_f32(scale_clamp_neon(vld1q_f32(x + i), ps, po, lo, hi)));
+        sample.val[3] = vmovn_u32(vcvtq_u32_f32(scale_clamp_neon(vld1q_f32(y + i), nps, po, lo, hi)));
+        // Interleaving store, exactly the sample layout.
+        vst4_u16(out + i*4, sample);
+    }
+
+    convert_scalar(cv, x + i, y + i, r + i, g + i, b + i, out + i*4, frames - i);
+}
+#endif
+
+
+void jack_convert_init(struct jack_convert *cv, uint32_t dac_min, uint32_t dac_max)
+{
+    float range = (float)(dac_max - dac_min);
+    struct jack_convert_kernel kernels[JACK_CONVERT_MAX_KERNELS];
+    int count;
+
+    cv->color_scale = range;
+    cv->color_offset = (float)dac_min;
+    cv->pos_scale = range / 2.0f;
+    cv->pos_offset = range / 2.0f + (float)dac_min;
+    cv->dac_min = (float)dac_min;
+    cv->dac_max = (float)dac_max;
+    cv->c_threshold = (float)((dac_max + dac_min) / 2);
+
+    count = jack_convert_kernels(kernels);
+    cv->kernel = kernels[count - 1].fn;
+    cv->kernel_name = kernels[count - 1].name;
+}
+
+
+int jack_convert_kernels(struct jack_convert_kernel *kernels)
+{
+    int count = 0;
+
+    kernels[count].name = "scalar";
+    kernels[count++].fn = convert_scalar;
+#ifdef JACK_CONVERT_SSE2
+    kernels[count].name = "SSE2";
+    kernels[count++].fn = convert_sse2;
+#endif
+#ifdef JACK_CONVERT_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count].name = "AVX2";
+        kernels[count++].fn = convert_avx2;
+    }
+#endif
+#ifdef JACK_CONVERT_NEON
+    kernels[count].name = "NEON";
+    kernels[count++].fn = convert_neon;
+#endif
+
+    return count;
+}
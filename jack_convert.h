@@ -0,0 +1,85 @@
+/*
+jack_convert.h - Converts JACK float port buffers into Lasershark samples.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef JACK_CONVERT_H
+#define JACK_CONVERT_H
+
+#include <stdint.h>
+
+struct jack_convert;
+
+typedef void (*jack_convert_fn)(const struct jack_convert *cv, const float *x, const float *y,
+                                const float *r, const float *g, const float *b,
+                                uint16_t *out, uint32_t frames);
+
+/*
+Scale and offset are worked out once so the per frame work is a multiply,
+an add and a clamp. Colours map 0..1 and positions -1..1 onto the DAC range.
+*/
+struct jack_convert
+{
+    float color_scale, color_offset;
+    float pos_scale, pos_offset;
+    float dac_min, dac_max;
+    // A blue value converting to at least this turns the C output on.
+    float c_threshold;
+
+    jack_convert_fn kernel;
+    const char *kernel_name;
+};
+
+struct jack_convert_kernel
+{
+    const char *name;
+    jack_convert_fn fn;
+};
+
+#define JACK_CONVERT_MAX_KERNELS 4
+
+/*
+Sets up conversion for the given DAC range and picks the fastest kernel the
+CPU supports.
+*/
+void jack_convert_init(struct jack_convert *cv, uint32_t dac_min, uint32_t dac_max);
+
+/*
+Lists the kernels compiled in that the CPU supports, slowest first, so the
+scalar one always comes first and jack_convert_init() picks the last.
+Fills up to JACK_CONVERT_MAX_KERNELS entries and returns how many.
+*/
+int jack_convert_kernels(struct jack_convert_kernel *kernels);
+
+/*
+Converts frames samples into the Lasershark V2 layout, 4 little endian
+uint16s per sample:
+[0] = Channel A output (lower 12 bits) from r, LASERSHARK_C_BITMASK set when
+      b is at least half way, LASERSHARK_INTL_A_BITMASK always set
+[1] = Channel B output (lower 12 bits) from g
+[2] = X Galvo output (lower 12 bits)
+[3] = Y Galvo output (lower 12 bits), inverted
+Out of range input is clamped. out needs no particular alignment.
+*/
+static inline void jack_convert_run(const struct jack_convert *cv, const float *x, const float *y,
+                                    const float *r, const float *g, const float *b,
+                                    uint16_t *out, uint32_t frames)
+{
+    cv->kernel(cv, x, y, r, g, b, out, frames);
+}
+
+#endif
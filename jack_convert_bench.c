@@ -0,0 +1,254 @@
+/*
+jack_convert_bench.c - Times each JACK conversion kernel compiled in at the
+period sizes used at 96 and 192 kHz, and checks their output against the
+scalar kernel's.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "getopt_portable.h"
+#include "jack_convert.h"
+#include "lasersharklib/lasershark_lib.h"
+#include "time_portable.h"
+
+#define DAC_MIN 0
+#define DAC_MAX 4095
+#define VALUE_MASK 0x0FFF
+#define ROUNDS_DEFAULT 5
+// Frames converted per round at each period size
+#define ROUND_FRAMES 4000000
+// Every this many frames one of the special values below is put in
+#define SPECIAL_INTERVAL 7
+
+static const uint32_t periods[] = {128, 256, 512, 1024, 2048, 4096};
+#define PERIOD_COUNT (sizeof(periods) / sizeof(periods[0]))
+#define PERIOD_MAX 4096
+
+// Out of range, non finite and edge values, including the blue that scales
+// to exactly the C threshold.
+static const float specials[] = {
+    NAN, -NAN, INFINITY, -INFINITY, 2.0f, -2.0f, 1e30f, -1e30f, 1.0f, -1.0f,
+    0.0f, -0.0f, 0.5f, (float)(DAC_MAX / 2) / DAC_MAX, 1e-40f, -1e-40f
+};
+#define SPECIAL_COUNT (sizeof(specials) / sizeof(specials[0]))
+
+#define CHANNELS 5
+
+
+void print_help(const char* prog_name, FILE* stream)
+{
+    fprintf(stream, "%s [OPTIONS] - Benchmarks the lasershark_jack conversion kernels\n", prog_name);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-r <Rounds>\n");
+    fprintf(stream, "\t\tTimes to run each kernel at each period size, the fastest round counts (default %d)\n",
+            ROUNDS_DEFAULT);
+}
+
+
+/*
+Fills the port buffers with pseudo random values, colours mostly in 0..1
+and positions in -1..1. With special set one frame in SPECIAL_INTERVAL gets
+a special value instead. One extra frame is filled so the buffers can be
+read one frame in.
+*/
+static void generate_input(float in[CHANNELS][PERIOD_MAX + 1], bool special)
+{
+    uint32_t i, ch, seed = 1;
+    float v;
+
+    for (ch = 0; ch < CHANNELS; ch++) {
+        for (i = 0; i < PERIOD_MAX + 1; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (special && (i + ch) % SPECIAL_INTERVAL == 0) {
+                v = specials[(seed >> 16) % SPECIAL_COUNT];
+            } else {
+                // Slightly past the port range now and then, to hit the clamps.
+                v = (float)((seed >> 8) & 0xFFFF) / 0xFFFF * 1.1f - 0.05f;
+                if (ch < 2) {
+                    v = v * 2.0f - 1.0f;
+                }
+            }
+            in[ch][i] = v;
+        }
+    }
+}
+
+
+/*
+Checks kernel output against the scalar one's. Values may be off by 1 LSB,
+since not every kernel rounds the multiply and add the same way, the flag
+bits must match exactly. Returns how many words are off by more, and the
+largest difference in *diff_max.
+*/
+static uint32_t compare(const uint16_t *out, const uint16_t *ref, uint32_t frames, int *diff_max)
+{
+    uint32_t i, bad = 0;
+    int diff;
+
+    for (i = 0; i < frames*4; i++) {
+        diff = abs((out[i] & VALUE_MASK) - (ref[i] & VALUE_MASK));
+        if (diff > *diff_max) {
+            *diff_max = diff;
+        }
+        if (diff > 1 || (out[i] & ~VALUE_MASK) != (ref[i] & ~VALUE_MASK)) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+
+// Checks the scalar kernel's output is within the DAC range with INTL_A set.
+static bool check_reference(const uint16_t *ref, uint32_t frames)
+{
+    uint32_t i;
+
+    for (i = 0; i < frames*4; i++) {
+        if ((ref[i] & VALUE_MASK) < DAC_MIN || (ref[i] & VALUE_MASK) > DAC_MAX ||
+                (i % 4 != 0 && (ref[i] & ~VALUE_MASK)) ||
+                (i % 4 == 0 && !(ref[i] & LASERSHARK_INTL_A_BITMASK))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main (int argc, char *argv[])
+{
+    int ret = 1;
+    int c;
+    int i, k, round;
+    uint32_t p, frames, iter, iterations, bad;
+    int diff_max;
+    static float in[CHANNELS][PERIOD_MAX + 1];
+    static uint16_t ref[(PERIOD_MAX + 1) * 4], out[(PERIOD_MAX + 1) * 4];
+    struct jack_convert cv;
+    struct jack_convert_kernel kernels[JACK_CONVERT_MAX_KERNELS];
+    int kernel_count;
+    uint64_t start_us, us, best_us;
+    double ns;
+
+    int hflag = 0;
+    int rflag = 0;
+    int rounds = ROUNDS_DEFAULT;
+
+    opterr_portable = 1;
+    while (-1 != (c = getopt_portable(argc, argv, "hr:"))) {
+        switch(c) {
+        case 'h':
+            hflag++;
+            break;
+        case 'r':
+            rflag++;
+            rounds = atoi(optarg_portable);
+            break;
+        default:
+            print_help(argv[0], stderr);
+            exit(1);
+        }
+    }
+
+    if (hflag > 1 || rflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
+    }
+
+    if (rounds < 1) {
+        fprintf(stderr, "Rounds must be at least 1\n");
+        exit(1);
+    }
+
+    generate_input(in, true);
+    jack_convert_init(&cv, DAC_MIN, DAC_MAX);
+    kernel_count = jack_convert_kernels(kernels);
+
+    // Every period size, one frame short of it to leave a tail for the
+    // scalar remainder loops, and one frame into the buffers so the loads
+    // are misaligned.
+    for (k = 1; k < kernel_count; k++) {
+        diff_max = 0;
+        bad = 0;
+        for (p = 0; p < PERIOD_COUNT; p++) {
+            for (i = 0; i < 4; i++) {
+                frames = periods[p] - (i & 1);
+                cv.kernel = kernels[0].fn;
+                jack_convert_run(&cv, in[0] + i/2, in[1] + i/2, in[2] + i/2, in[3] + i/2, in[4] + i/2,
+                                 ref, frames);
+                if (!check_reference(ref, frames)) {
+                    fprintf(stderr, "The scalar kernel's output is out of range\n");
+                    goto out;
+                }
+                cv.kernel = kernels[k].fn;
+                jack_convert_run(&cv, in[0] + i/2, in[1] + i/2, in[2] + i/2, in[3] + i/2, in[4] + i/2,
+                                 out, frames);
+                bad += compare(out, ref, frames, &diff_max);
+            }
+        }
+        printf("%-6s matches scalar: %s, largest difference %d LSB\n", kernels[k].name,
+               bad ? "NO" : "yes", diff_max);
+        if (bad) {
+            fprintf(stderr, "%s differs from scalar in %u words\n", kernels[k].name, bad);
+            goto out;
+        }
+    }
+    printf("Picked by lasershark_jack: %s\n\n", cv.kernel_name);
+
+    // Timed without the special values, denormals alone slow some CPUs'
+    // vector units far more than real port data ever would.
+    generate_input(in, false);
+
+    printf("Fastest of %d rounds, per period and as a share of the period at 96k / 192k\n", rounds);
+    printf("%-6s %7s %12s %10s %10s\n", "kernel", "frames", "ns/period", "96k", "192k");
+    for (k = 0; k < kernel_count; k++) {
+        cv.kernel = kernels[k].fn;
+        for (p = 0; p < PERIOD_COUNT; p++) {
+            frames = periods[p];
+            iterations = ROUND_FRAMES / frames;
+            best_us = UINT64_MAX;
+            for (round = 0; round < rounds; round++) {
+                start_us = time_portable_now_us();
+                for (iter = 0; iter < iterations; iter++) {
+                    jack_convert_run(&cv, in[0], in[1], in[2], in[3], in[4], out, frames);
+                }
+                us = time_portable_now_us() - start_us;
+                if (us < best_us) {
+                    best_us = us;
+                }
+            }
+
+            ns = best_us * 1000.0 / iterations;
+            printf("%-6s %7u %12.1f %9.3f%% %9.3f%%\n", kernels[k].name, frames, ns,
+                   ns / (frames * 1e9 / 96000) * 100, ns / (frames * 1e9 / 192000) * 100);
+        }
+    }
+    ret = 0;
+
+out:
+    return ret;
+}
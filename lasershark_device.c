@@ -0,0 +1,317 @@
+/*
+lasershark_device.c - Backend independent access to a Lasershark, and the
+USB backend that talks to real ones through lasersharklib.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lasersharklib/lasershark_lib.h"
+#include "lasershark_device_backend.h"
+#include "lasershark_discovery.h"
+
+
+static int usb_command(struct ls_device *dev, enum ls_device_cmd cmd, uint32_t arg, uint32_t *val)
+{
+    struct libusb_device_handle *devh = dev->devh;
+    uint8_t state;
+    int rc;
+
+    switch (cmd) {
+    case LS_CMD_SET_OUTPUT:
+        return set_output(devh, arg);
+    case LS_CMD_GET_OUTPUT:
+        rc = get_output(devh, &state);
+        *val = state;
+        return rc;
+    case LS_CMD_SET_ILDA_RATE:
+        return set_ilda_rate(devh, arg);
+    case LS_CMD_GET_ILDA_RATE:
+        return get_ilda_rate(devh, val);
+    case LS_CMD_GET_MAX_ILDA_RATE:
+        return get_max_ilda_rate(devh, val);
+    case LS_CMD_GET_SAMP_ELEMENT_COUNT:
+        return get_samp_element_count(devh, val);
+    case LS_CMD_GET_ISO_PACKET_SAMPLE_COUNT:
+        return get_iso_packet_sample_count(devh, val);
+    case LS_CMD_GET_BULK_PACKET_SAMPLE_COUNT:
+        return get_bulk_packet_sample_count(devh, val);
+    case LS_CMD_GET_DAC_MIN:
+        return get_dac_min(devh, val);
+    case LS_CMD_GET_DAC_MAX:
+        return get_dac_max(devh, val);
+    case LS_CMD_GET_RINGBUFFER_SAMPLE_COUNT:
+        return get_ringbuffer_sample_count(devh, val);
+    case LS_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT:
+        return get_ringbuffer_empty_sample_count(devh, val);
+    case LS_CMD_GET_FW_MAJOR_VERSION:
+        return get_fw_major_version(devh, val);
+    case LS_CMD_GET_FW_MINOR_VERSION:
+        return get_fw_minor_version(devh, val);
+    case LS_CMD_CLEAR_RINGBUFFER:
+        return clear_ringbuffer(devh);
+    }
+
+    return LASERSHARK_CMD_FAIL;
+}
+
+
+static int usb_submit_transfer(struct ls_device *dev, struct libusb_transfer *transfer)
+{
+    return libusb_submit_transfer(transfer);
+}
+
+
+static int usb_cancel_transfer(struct ls_device *dev, struct libusb_transfer *transfer)
+{
+    return libusb_cancel_transfer(transfer);
+}
+
+
+static int usb_handle_events(struct ls_device *dev, struct timeval *tv)
+{
+    return libusb_handle_events_timeout_completed(NULL, tv, NULL);
+}
+
+
+static void usb_interrupt_events(struct ls_device *dev)
+{
+    libusb_interrupt_event_handler(NULL);
+}
+
+
+static int usb_get_max_iso_packet_size(struct ls_device *dev, unsigned char endpoint)
+{
+    return libusb_get_max_iso_packet_size(libusb_get_device(dev->devh), endpoint);
+}
+
+
+static void usb_close(struct ls_device *dev)
+{
+    libusb_release_interface(dev->devh, 0);
+    libusb_release_interface(dev->devh, 1);
+    libusb_close(dev->devh);
+}
+
+
+static const struct ls_device_ops usb_ops = {
+    usb_command,
+    usb_submit_transfer,
+    usb_cancel_transfer,
+    usb_handle_events,
+    usb_interrupt_events,
+    usb_get_max_iso_packet_size,
+    usb_close
+};
+
+
+struct ls_device *ls_device_open_usb(const char *serial, enum ls_data_mode mode)
+{
+    int rc;
+    struct ls_device *dev;
+
+    dev = calloc(1, sizeof(struct ls_device));
+    if (dev == NULL) {
+        return NULL;
+    }
+    dev->ops = &usb_ops;
+    dev->mode = mode;
+
+    dev->devh = ls_discovery_open(serial, dev->serial);
+    if (dev->devh == NULL) {
+        free(dev);
+        return NULL;
+    }
+
+    rc = libusb_claim_interface(dev->devh, 0);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error claiming control interface: %d\n", /*libusb_error_name(rc)*/rc);
+        goto fail_close;
+    }
+    rc = libusb_claim_interface(dev->devh, 1);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error claiming data interface: %d\n", /*libusb_error_name(rc)*/rc);
+        libusb_release_interface(dev->devh, 0);
+        goto fail_close;
+    }
+
+    rc = libusb_set_interface_alt_setting(dev->devh, 1, mode);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error setting alternative (%s) data interface: %d\n",
+                mode == LS_DATA_BULK ? "BULK" : "ISO", /*libusb_error_name(rc)*/rc);
+        libusb_release_interface(dev->devh, 0);
+        libusb_release_interface(dev->devh, 1);
+        goto fail_close;
+    }
+
+    return dev;
+
+fail_close:
+    libusb_close(dev->devh);
+    free(dev);
+    return NULL;
+}
+
+
+void ls_device_close(struct ls_device *dev)
+{
+    if (dev == NULL) {
+        return;
+    }
+    dev->ops->close(dev);
+    free(dev);
+}
+
+
+const char *ls_device_serial(struct ls_device *dev)
+{
+    return dev->serial;
+}
+
+
+struct libusb_device_handle *ls_device_usb_handle(struct ls_device *dev)
+{
+    return dev->devh;
+}
+
+
+int ls_device_set_output(struct ls_device *dev, uint8_t state)
+{
+    return dev->ops->command(dev, LS_CMD_SET_OUTPUT, state, NULL);
+}
+
+
+int ls_device_get_output(struct ls_device *dev, uint8_t *state)
+{
+    uint32_t val = 0;
+    int rc = dev->ops->command(dev, LS_CMD_GET_OUTPUT, 0, &val);
+
+    *state = val;
+    return rc;
+}
+
+
+int ls_device_set_ilda_rate(struct ls_device *dev, uint32_t rate)
+{
+    return dev->ops->command(dev, LS_CMD_SET_ILDA_RATE, rate, NULL);
+}
+
+
+int ls_device_get_ilda_rate(struct ls_device *dev, uint32_t *rate)
+{
+    return dev->ops->command(dev, LS_CMD_GET_ILDA_RATE, 0, rate);
+}
+
+
+int ls_device_get_max_ilda_rate(struct ls_device *dev, uint32_t *rate)
+{
+    return dev->ops->command(dev, LS_CMD_GET_MAX_ILDA_RATE, 0, rate);
+}
+
+
+int ls_device_get_samp_element_count(struct ls_device *dev, uint32_t *count)
+{
+    return dev->ops->command(dev, LS_CMD_GET_SAMP_ELEMENT_COUNT, 0, count);
+}
+
+
+int ls_device_get_iso_packet_sample_count(struct ls_device *dev, uint32_t *count)
+{
+    return dev->ops->command(dev, LS_CMD_GET_ISO_PACKET_SAMPLE_COUNT, 0, count);
+}
+
+
+int ls_device_get_bulk_packet_sample_count(struct ls_device *dev, uint32_t *count)
+{
+    return dev->ops->command(dev, LS_CMD_GET_BULK_PACKET_SAMPLE_COUNT, 0, count);
+}
+
+
+int ls_device_get_dac_min(struct ls_device *dev, uint32_t *val)
+{
+    return dev->ops->command(dev, LS_CMD_GET_DAC_MIN, 0, val);
+}
+
+
+int ls_device_get_dac_max(struct ls_device *dev, uint32_t *val)
+{
+    return dev->ops->command(dev, LS_CMD_GET_DAC_MAX, 0, val);
+}
+
+
+int ls_device_get_ringbuffer_sample_count(struct ls_device *dev, uint32_t *count)
+{
+    return dev->ops->command(dev, LS_CMD_GET_RINGBUFFER_SAMPLE_COUNT, 0, count);
+}
+
+
+int ls_device_get_ringbuffer_empty_sample_count(struct ls_device *dev, uint32_t *count)
+{
+    return dev->ops->command(dev, LS_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT, 0, count);
+}
+
+
+int ls_device_get_fw_major_version(struct ls_device *dev, uint32_t *version)
+{
+    return dev->ops->command(dev, LS_CMD_GET_FW_MAJOR_VERSION, 0, version);
+}
+
+
+int ls_device_get_fw_minor_version(struct ls_device *dev, uint32_t *version)
+{
+    return dev->ops->command(dev, LS_CMD_GET_FW_MINOR_VERSION, 0, version);
+}
+
+
+int ls_device_clear_ringbuffer(struct ls_device *dev)
+{
+    return dev->ops->command(dev, LS_CMD_CLEAR_RINGBUFFER, 0, NULL);
+}
+
+
+int ls_device_submit_transfer(struct ls_device *dev, struct libusb_transfer *transfer)
+{
+    return dev->ops->submit_transfer(dev, transfer);
+}
+
+
+int ls_device_cancel_transfer(struct ls_device *dev, struct libusb_transfer *transfer)
+{
+    return dev->ops->cancel_transfer(dev, transfer);
+}
+
+
+int ls_device_handle_events(struct ls_device *dev, struct timeval *tv)
+{
+    return dev->ops->handle_events(dev, tv);
+}
+
+
+void ls_device_interrupt_events(struct ls_device *dev)
+{
+    dev->ops->interrupt_events(dev);
+}
+
+
+int ls_device_get_max_iso_packet_size(struct ls_device *dev, unsigned char endpoint)
+{
+    return dev->ops->get_max_iso_packet_size(dev, endpoint);
+}
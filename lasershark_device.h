@@ -0,0 +1,112 @@
+/*
+lasershark_device.h - Backend independent access to a Lasershark, either a
+real one over USB or a software simulation of one.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LASERSHARK_DEVICE_H
+#define LASERSHARK_DEVICE_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#define LASERSHARK_VID 0x1fc9
+#define LASERSHARK_PID 0x04d8
+
+#define LASERSHARK_BULK_ENDPOINT (3 | LIBUSB_ENDPOINT_OUT)
+#define LASERSHARK_ISO_ENDPOINT (4 | LIBUSB_ENDPOINT_OUT)
+
+#define LASERSHARK_SERIALNUM_LEN 64
+
+// How sample data gets to the device. Picks the data interface's alt setting.
+enum ls_data_mode
+{
+    LS_DATA_ISO = 0,
+    LS_DATA_BULK = 1
+};
+
+struct ls_device;
+
+/*
+Opens the first Lasershark found, or the one with the given serial number,
+and readies its data interface for mode. libusb must be initialized.
+Returns NULL on failure.
+*/
+struct ls_device *ls_device_open_usb(const char *serial, enum ls_data_mode mode);
+
+/*
+Opens a simulated Lasershark that consumes samples in real time, reporting
+serial as its serial number, or "SIMULATED" if serial is NULL. Doesn't need
+libusb to be initialized.
+*/
+struct ls_device *ls_device_open_sim(const char *serial, enum ls_data_mode mode);
+
+/*
+Releases the device. A simulated device prints its statistics first.
+*/
+void ls_device_close(struct ls_device *dev);
+
+const char *ls_device_serial(struct ls_device *dev);
+
+/*
+The underlying libusb handle, NULL for simulated devices. Transfers should
+be filled in with it and then handed to ls_device_submit_transfer().
+*/
+struct libusb_device_handle *ls_device_usb_handle(struct ls_device *dev);
+
+/*
+Control commands, mirroring lasersharklib. They return LASERSHARK_CMD_SUCCESS
+or LASERSHARK_CMD_FAIL.
+*/
+int ls_device_set_output(struct ls_device *dev, uint8_t state);
+int ls_device_get_output(struct ls_device *dev, uint8_t *state);
+int ls_device_set_ilda_rate(struct ls_device *dev, uint32_t rate);
+int ls_device_get_ilda_rate(struct ls_device *dev, uint32_t *rate);
+int ls_device_get_max_ilda_rate(struct ls_device *dev, uint32_t *rate);
+int ls_device_get_samp_element_count(struct ls_device *dev, uint32_t *count);
+int ls_device_get_iso_packet_sample_count(struct ls_device *dev, uint32_t *count);
+int ls_device_get_bulk_packet_sample_count(struct ls_device *dev, uint32_t *count);
+int ls_device_get_dac_min(struct ls_device *dev, uint32_t *val);
+int ls_device_get_dac_max(struct ls_device *dev, uint32_t *val);
+int ls_device_get_ringbuffer_sample_count(struct ls_device *dev, uint32_t *count);
+int ls_device_get_ringbuffer_empty_sample_count(struct ls_device *dev, uint32_t *count);
+int ls_device_get_fw_major_version(struct ls_device *dev, uint32_t *version);
+int ls_device_get_fw_minor_version(struct ls_device *dev, uint32_t *version);
+int ls_device_clear_ringbuffer(struct ls_device *dev);
+
+/*
+Data transfers. Transfers are ordinary libusb transfers, filled in by the
+caller. These return libusb error codes.
+*/
+int ls_device_submit_transfer(struct ls_device *dev, struct libusb_transfer *transfer);
+int ls_device_cancel_transfer(struct ls_device *dev, struct libusb_transfer *transfer);
+
+/*
+Runs completion callbacks for up to tv, returning early once some were run.
+Like libusb's, this services every open device of dev's backend.
+*/
+int ls_device_handle_events(struct ls_device *dev, struct timeval *tv);
+
+/*
+Makes a ls_device_handle_events() call in another thread return now, or the
+next one return straight away if none is running.
+*/
+void ls_device_interrupt_events(struct ls_device *dev);
+
+int ls_device_get_max_iso_packet_size(struct ls_device *dev, unsigned char endpoint);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+lasershark_device_backend.h - Interface implemented by each Lasershark
+device backend.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LASERSHARK_DEVICE_BACKEND_H
+#define LASERSHARK_DEVICE_BACKEND_H
+
+#include "lasershark_device.h"
+
+enum ls_device_cmd
+{
+    LS_CMD_SET_OUTPUT,
+    LS_CMD_GET_OUTPUT,
+    LS_CMD_SET_ILDA_RATE,
+    LS_CMD_GET_ILDA_RATE,
+    LS_CMD_GET_MAX_ILDA_RATE,
+    LS_CMD_GET_SAMP_ELEMENT_COUNT,
+    LS_CMD_GET_ISO_PACKET_SAMPLE_COUNT,
+    LS_CMD_GET_BULK_PACKET_SAMPLE_COUNT,
+    LS_CMD_GET_DAC_MIN,
+    LS_CMD_GET_DAC_MAX,
+    LS_CMD_GET_RINGBUFFER_SAMPLE_COUNT,
+    LS_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT,
+    LS_CMD_GET_FW_MAJOR_VERSION,
+    LS_CMD_GET_FW_MINOR_VERSION,
+    LS_CMD_CLEAR_RINGBUFFER
+};
+
+struct ls_device_ops
+{
+    /*
+    Runs a control command. Setters take arg, getters store into *val.
+    Returns LASERSHARK_CMD_SUCCESS or LASERSHARK_CMD_FAIL.
+    */
+    int (*command)(struct ls_device *dev, enum ls_device_cmd cmd, uint32_t arg, uint32_t *val);
+    int (*submit_transfer)(struct ls_device *dev, struct libusb_transfer *transfer);
+    int (*cancel_transfer)(struct ls_device *dev, struct libusb_transfer *transfer);
+    int (*handle_events)(struct ls_device *dev, struct timeval *tv);
+    void (*interrupt_events)(struct ls_device *dev);
+    int (*get_max_iso_packet_size)(struct ls_device *dev, unsigned char endpoint);
+    void (*close)(struct ls_device *dev);
+};
+
+struct ls_device
+{
+    const struct ls_device_ops *ops;
+    struct libusb_device_handle *devh;
+    char serial[LASERSHARK_SERIALNUM_LEN];
+    enum ls_data_mode mode;
+    // Backend specific state
+    void *priv;
+};
+
+#endif
@@ -0,0 +1,547 @@
+/*
+lasershark_device_sim.c - Software Lasershark for running the tools without
+hardware.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include "lasersharklib/lasershark_lib.h"
+#include "lasershark_device_backend.h"
+#include "time_portable.h"
+
+/*
+The simulator answers control commands like a V2 board and plays samples out
+of a modelled ringbuffer at the ilda rate, on the real clock. Bulk transfers
+trickle into the ringbuffer as space frees up and complete once all their
+data is in, just like the device NAKing while full. ISO packets are taken
+whole on arrival and whatever doesn't fit is dropped.
+
+Like a libusb context, all simulated boards share one lock and one event
+loop, so handling events on any of them services them all.
+*/
+#define SIM_RINGBUFFER_SAMPLES 4096
+#define SIM_MAX_ILDA_RATE 64000
+#define SIM_DAC_MIN 0
+#define SIM_DAC_MAX 4095
+#define SIM_SAMP_ELEMENT_COUNT 4
+#define SIM_BULK_PACKET_SAMPLES 64
+#define SIM_ISO_PACKET_SAMPLES 32
+#define SIM_SAMPLE_LEN (SIM_SAMP_ELEMENT_COUNT*sizeof(uint16_t))
+
+struct sim_transfer
+{
+    struct sim_state *sim;
+    struct libusb_transfer *transfer;
+    // Bytes of a bulk transfer already moved into the ringbuffer
+    int offset;
+    struct sim_transfer *next;
+};
+
+struct sim_queue
+{
+    struct sim_transfer *head;
+    struct sim_transfer *tail;
+};
+
+struct sim_state
+{
+    struct sim_state *next;
+
+    uint32_t rate;
+    uint8_t output;
+
+    // Samples in the ringbuffer as of last_us. Fractional so slow rates
+    // still drain.
+    double level;
+    uint64_t last_us;
+    // Set once data arrived, so an idle device isn't counted as starving.
+    bool started;
+    // Samples missed since the ringbuffer last ran dry. Only counted as an
+    // underrun if more data shows up, the end of a stream is no underrun.
+    double gap_samples;
+
+    struct sim_queue pending;
+
+    // Statistics
+    uint64_t samples_received;
+    double samples_played;
+    uint64_t samples_dropped;
+    uint64_t starved_samples;
+    uint32_t underruns;
+    uint32_t peak_level;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a transfer is submitted or cancelled.
+static pthread_cond_t sim_cond = PTHREAD_COND_INITIALIZER;
+static struct sim_state *sim_devices = NULL;
+// Finished transfers of every board, waiting for their callbacks.
+static struct sim_queue sim_done = {NULL, NULL};
+// Set by sim_interrupt_events(), cleared by the sim_handle_events() it
+// stopped.
+static bool sim_interrupted = false;
+// Bumped once a sim_handle_events() call has run its callbacks. Other
+// threads waiting return then, as libusb's event waiters do.
+static uint64_t sim_generation = 0;
+
+
+static void queue_push(struct sim_queue *q, struct sim_transfer *st)
+{
+    st->next = NULL;
+    if (q->tail) {
+        q->tail->next = st;
+    } else {
+        q->head = st;
+    }
+    q->tail = st;
+}
+
+
+static struct sim_transfer *queue_pop(struct sim_queue *q)
+{
+    struct sim_transfer *st = q->head;
+
+    if (st) {
+        q->head = st->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return st;
+}
+
+
+/*
+Plays out samples up to now_us. Called with the lock held.
+*/
+static void sim_advance(struct sim_state *sim, uint64_t now_us)
+{
+    double played;
+
+    if (now_us <= sim->last_us) {
+        return;
+    }
+
+    played = (double)(now_us - sim->last_us) * sim->rate / 1000000.0;
+    if (played > sim->level) {
+        if (sim->started) {
+            sim->gap_samples += played - sim->level;
+        }
+        played = sim->level;
+    }
+    sim->level -= played;
+    sim->samples_played += played;
+    sim->last_us = now_us;
+}
+
+
+/*
+Adds samples to the ringbuffer, returning how many fit. Called with the lock
+held.
+*/
+static uint32_t sim_fill(struct sim_state *sim, uint32_t samples)
+{
+    uint32_t space = SIM_RINGBUFFER_SAMPLES - (uint32_t)(sim->level + 0.999);
+
+    if (samples > space) {
+        samples = space;
+    }
+    if (samples == 0) {
+        return 0;
+    }
+
+    if (sim->started && sim->gap_samples >= 1) {
+        sim->underruns++;
+        sim->starved_samples += (uint64_t)sim->gap_samples;
+    }
+    sim->gap_samples = 0;
+    sim->started = true;
+
+    sim->level += samples;
+    sim->samples_received += samples;
+    if (sim->level > sim->peak_level) {
+        sim->peak_level = (uint32_t)sim->level;
+    }
+    return samples;
+}
+
+
+/*
+Moves as much pending data into the ringbuffer as fits, queueing finished
+transfers for their callbacks. Bulk data is taken in order and stops at the
+first transfer that doesn't fit, ISO data never waits. Called with the lock
+held.
+*/
+static void sim_service(struct sim_state *sim)
+{
+    struct sim_queue still_pending = {NULL, NULL};
+    struct sim_transfer *st;
+    struct libusb_transfer *transfer;
+    bool bulk_blocked = false;
+    uint32_t samples, taken;
+    int i, len;
+
+    while (NULL != (st = queue_pop(&sim->pending))) {
+        transfer = st->transfer;
+
+        if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+            for (i = 0; i < transfer->num_iso_packets; i++) {
+                len = transfer->iso_packet_desc[i].length;
+                samples = len / SIM_SAMPLE_LEN;
+                taken = sim_fill(sim, samples);
+                sim->samples_dropped += samples - taken;
+                transfer->iso_packet_desc[i].actual_length = len;
+                transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+            }
+            transfer->actual_length = transfer->length;
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            queue_push(&sim_done, st);
+            continue;
+        }
+
+        if (!bulk_blocked) {
+            samples = (transfer->length - st->offset) / SIM_SAMPLE_LEN;
+            st->offset += sim_fill(sim, samples) * SIM_SAMPLE_LEN;
+            if (transfer->length - st->offset < (int)SIM_SAMPLE_LEN) {
+                transfer->actual_length = transfer->length;
+                transfer->status = LIBUSB_TRANSFER_COMPLETED;
+                queue_push(&sim_done, st);
+                continue;
+            }
+            bulk_blocked = true;
+        }
+        queue_push(&still_pending, st);
+    }
+
+    sim->pending = still_pending;
+}
+
+
+/*
+Returns how long until the oldest waiting bulk transfer can move more data,
+in us. UINT64_MAX if nothing is waiting on the ringbuffer. Called with the
+lock held.
+*/
+static uint64_t sim_next_wakeup(struct sim_state *sim)
+{
+    double need;
+
+    if (sim->pending.head == NULL || sim->rate == 0) {
+        return UINT64_MAX;
+    }
+
+    // Wait for room for a full bulk packet rather than single samples.
+    need = sim->level + SIM_BULK_PACKET_SAMPLES - SIM_RINGBUFFER_SAMPLES;
+    if (need <= 0) {
+        return 0;
+    }
+    return (uint64_t)(need * 1000000.0 / sim->rate) + 1;
+}
+
+
+static int sim_command(struct ls_device *dev, enum ls_device_cmd cmd, uint32_t arg, uint32_t *val)
+{
+    struct sim_state *sim = dev->priv;
+    int rc = LASERSHARK_CMD_SUCCESS;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_advance(sim, time_portable_now_us());
+
+    switch (cmd) {
+    case LS_CMD_SET_OUTPUT:
+        sim->output = arg ? LASERSHARK_CMD_OUTPUT_ENABLE : LASERSHARK_CMD_OUTPUT_DISABLE;
+        break;
+    case LS_CMD_GET_OUTPUT:
+        *val = sim->output;
+        break;
+    case LS_CMD_SET_ILDA_RATE:
+        if (arg == 0 || arg > SIM_MAX_ILDA_RATE) {
+            rc = LASERSHARK_CMD_FAIL;
+        } else {
+            sim->rate = arg;
+        }
+        break;
+    case LS_CMD_GET_ILDA_RATE:
+        *val = sim->rate;
+        break;
+    case LS_CMD_GET_MAX_ILDA_RATE:
+        *val = SIM_MAX_ILDA_RATE;
+        break;
+    case LS_CMD_GET_SAMP_ELEMENT_COUNT:
+        *val = SIM_SAMP_ELEMENT_COUNT;
+        break;
+    case LS_CMD_GET_ISO_PACKET_SAMPLE_COUNT:
+        *val = SIM_ISO_PACKET_SAMPLES;
+        break;
+    case LS_CMD_GET_BULK_PACKET_SAMPLE_COUNT:
+        *val = SIM_BULK_PACKET_SAMPLES;
+        break;
+    case LS_CMD_GET_DAC_MIN:
+        *val = SIM_DAC_MIN;
+        break;
+    case LS_CMD_GET_DAC_MAX:
+        *val = SIM_DAC_MAX;
+        break;
+    case LS_CMD_GET_RINGBUFFER_SAMPLE_COUNT:
+        *val = SIM_RINGBUFFER_SAMPLES;
+        break;
+    case LS_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT:
+        *val = SIM_RINGBUFFER_SAMPLES - (uint32_t)(sim->level + 0.999);
+        break;
+    case LS_CMD_GET_FW_MAJOR_VERSION:
+        *val = LASERSHARK_FW_MAJOR_VERSION;
+        break;
+    case LS_CMD_GET_FW_MINOR_VERSION:
+        *val = LASERSHARK_FW_MINOR_VERSION;
+        break;
+    case LS_CMD_CLEAR_RINGBUFFER:
+        sim->level = 0;
+        sim->started = false;
+        sim->gap_samples = 0;
+        break;
+    default:
+        rc = LASERSHARK_CMD_FAIL;
+    }
+
+    pthread_mutex_unlock(&sim_lock);
+    return rc;
+}
+
+
+static int sim_submit_transfer(struct ls_device *dev, struct libusb_transfer *transfer)
+{
+    struct sim_state *sim = dev->priv;
+    struct sim_transfer *st;
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        if (dev->mode != LS_DATA_ISO || transfer->endpoint != LASERSHARK_ISO_ENDPOINT) {
+            return LIBUSB_ERROR_NOT_FOUND;
+        }
+    } else if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK || dev->mode != LS_DATA_BULK ||
+               transfer->endpoint != LASERSHARK_BULK_ENDPOINT) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    st = malloc(sizeof(struct sim_transfer));
+    if (st == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    st->sim = sim;
+    st->transfer = transfer;
+    st->offset = 0;
+
+    pthread_mutex_lock(&sim_lock);
+    queue_push(&sim->pending, st);
+    pthread_cond_signal(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+
+    return 0;
+}
+
+
+static int sim_cancel_transfer(struct ls_device *dev, struct libusb_transfer *transfer)
+{
+    struct sim_state *sim = dev->priv;
+    struct sim_queue still_pending = {NULL, NULL};
+    struct sim_transfer *st;
+    int rc = LIBUSB_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&sim_lock);
+    while (NULL != (st = queue_pop(&sim->pending))) {
+        if (st->transfer == transfer) {
+            transfer->actual_length = st->offset;
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            queue_push(&sim_done, st);
+            rc = 0;
+        } else {
+            queue_push(&still_pending, st);
+        }
+    }
+    sim->pending = still_pending;
+    pthread_cond_signal(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+
+    return rc;
+}
+
+
+static int sim_handle_events(struct ls_device *dev, struct timeval *tv)
+{
+    struct sim_state *sim;
+    struct sim_transfer *st;
+    struct sim_queue done;
+    struct timespec deadline;
+    uint64_t now_us, end_us, wake_us, sim_wake_us, generation;
+
+    now_us = time_portable_now_us();
+    end_us = now_us + (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+    pthread_mutex_lock(&sim_lock);
+    generation = sim_generation;
+    while (1) {
+        wake_us = end_us - now_us;
+        for (sim = sim_devices; sim; sim = sim->next) {
+            sim_advance(sim, now_us);
+            sim_service(sim);
+            sim_wake_us = sim_next_wakeup(sim);
+            if (sim_wake_us < wake_us) {
+                wake_us = sim_wake_us;
+            }
+        }
+        if (sim_done.head || sim_interrupted || now_us >= end_us || generation != sim_generation) {
+            break;
+        }
+
+        // The condition variable runs on the realtime clock.
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wake_us / 1000000;
+        deadline.tv_nsec += (wake_us % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&sim_cond, &sim_lock, &deadline);
+        now_us = time_portable_now_us();
+    }
+    done = sim_done;
+    sim_done.head = sim_done.tail = NULL;
+    sim_interrupted = false;
+    pthread_mutex_unlock(&sim_lock);
+
+    if (done.head == NULL) {
+        return 0;
+    }
+
+    // Callbacks run unlocked, they usually submit the next transfer.
+    while (NULL != (st = queue_pop(&done))) {
+        struct libusb_transfer *transfer = st->transfer;
+
+        free(st);
+        transfer->callback(transfer);
+    }
+
+    pthread_mutex_lock(&sim_lock);
+    sim_generation++;
+    pthread_cond_broadcast(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+
+    return 0;
+}
+
+
+static void sim_interrupt_events(struct ls_device *dev)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_interrupted = true;
+    pthread_cond_signal(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+
+static int sim_get_max_iso_packet_size(struct ls_device *dev, unsigned char endpoint)
+{
+    if (endpoint != LASERSHARK_ISO_ENDPOINT) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return SIM_ISO_PACKET_SAMPLES * SIM_SAMPLE_LEN;
+}
+
+
+static void sim_close(struct ls_device *dev)
+{
+    struct sim_state *sim = dev->priv;
+    struct sim_state **link;
+    struct sim_queue other_done = {NULL, NULL};
+    struct sim_transfer *st;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_advance(sim, time_portable_now_us());
+    for (link = &sim_devices; *link; link = &(*link)->next) {
+        if (*link == sim) {
+            *link = sim->next;
+            break;
+        }
+    }
+    // Transfers still queued belong to the caller, only our wrappers go.
+    while (NULL != (st = queue_pop(&sim->pending))) {
+        free(st);
+    }
+    while (NULL != (st = queue_pop(&sim_done))) {
+        if (st->sim == sim) {
+            free(st);
+        } else {
+            queue_push(&other_done, st);
+        }
+    }
+    sim_done = other_done;
+    pthread_mutex_unlock(&sim_lock);
+
+    printf("Simulator: %" PRIu64 " samples received, %.0f played, %" PRIu64 " dropped\n",
+           sim->samples_received, sim->samples_played, sim->samples_dropped);
+    printf("Simulator: ran dry %u times for %" PRIu64 " samples, peak ringbuffer use %u of %u\n",
+           sim->underruns, sim->starved_samples, sim->peak_level, SIM_RINGBUFFER_SAMPLES);
+
+    free(sim);
+}
+
+
+static const struct ls_device_ops sim_ops = {
+    sim_command,
+    sim_submit_transfer,
+    sim_cancel_transfer,
+    sim_handle_events,
+    sim_interrupt_events,
+    sim_get_max_iso_packet_size,
+    sim_close
+};
+
+
+struct ls_device *ls_device_open_sim(const char *serial, enum ls_data_mode mode)
+{
+    struct ls_device *dev;
+    struct sim_state *sim;
+
+    dev = calloc(1, sizeof(struct ls_device));
+    sim = calloc(1, sizeof(struct sim_state));
+    if (dev == NULL || sim == NULL) {
+        free(dev);
+        free(sim);
+        return NULL;
+    }
+
+    sim->output = LASERSHARK_CMD_OUTPUT_DISABLE;
+    sim->last_us = time_portable_now_us();
+
+    dev->ops = &sim_ops;
+    dev->mode = mode;
+    dev->priv = sim;
+    strncpy(dev->serial, serial ? serial : "SIMULATED", LASERSHARK_SERIALNUM_LEN - 1);
+    printf("iSerialNumber: %s\n", dev->serial);
+
+    pthread_mutex_lock(&sim_lock);
+    sim->next = sim_devices;
+    sim_devices = sim;
+    pthread_mutex_unlock(&sim_lock);
+
+    return dev;
+}
@@ -0,0 +1,443 @@
+/*
+lasershark_discovery.c - Finds Lasersharks on the bus by serial number,
+remembering where each one was last seen.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "lasershark_discovery.h"
+
+#define CACHE_MAX_ENTRIES 64
+#define CACHE_FILE_NAME "lasershark_devices"
+#define CACHE_FILE_NAME_LEN 1024
+// "bus-port.port..." with USB's limit of 7 hub tiers
+#define PATH_LEN 32
+#define PATH_MAX_PORTS 7
+
+struct cache_entry
+{
+    char path[PATH_LEN];
+    char serial[LASERSHARK_SERIALNUM_LEN];
+};
+
+// Hotplug callbacks run wherever events are handled, so the cache is locked.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry cache[CACHE_MAX_ENTRIES];
+static int cache_count = 0;
+static bool cache_dirty = false;
+static char cache_file[CACHE_FILE_NAME_LEN];
+
+static bool hotplug_registered = false;
+static bool hotplug_enumerating = false;
+static libusb_hotplug_callback_handle hotplug_handle;
+
+
+static bool device_path(libusb_device *dev, char *path)
+{
+    uint8_t ports[PATH_MAX_PORTS];
+    int count, i, len;
+
+    count = libusb_get_port_numbers(dev, ports, PATH_MAX_PORTS);
+    if (count < 0) {
+        return false;
+    }
+
+    len = snprintf(path, PATH_LEN, "%u-", libusb_get_bus_number(dev));
+    for (i = 0; i < count; i++) {
+        len += snprintf(path + len, PATH_LEN - len, i ? ".%u" : "%u", ports[i]);
+    }
+
+    return true;
+}
+
+
+static bool is_lasershark(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+
+    if (libusb_get_device_descriptor(dev, &desc) < 0) {
+        return false;
+    }
+    return desc.idVendor == LASERSHARK_VID && desc.idProduct == LASERSHARK_PID;
+}
+
+
+// Callers hold cache_lock.
+static int cache_find_path(const char *path)
+{
+    int i;
+
+    for (i = 0; i < cache_count; i++) {
+        if (0 == strcmp(cache[i].path, path)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Callers hold cache_lock.
+static void cache_remove(int i)
+{
+    cache[i] = cache[--cache_count];
+    cache_dirty = true;
+}
+
+
+/*
+Records that serial is at path. Whatever else was cached for either is
+dropped, a board can only be in one place.
+*/
+static void cache_store(const char *path, const char *serial)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    i = cache_find_path(path);
+    if (i != -1 && 0 == strncmp(cache[i].serial, serial, LASERSHARK_SERIALNUM_LEN)) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    for (i = cache_count - 1; i >= 0; i--) {
+        if (0 == strcmp(cache[i].path, path) ||
+                0 == strncmp(cache[i].serial, serial, LASERSHARK_SERIALNUM_LEN)) {
+            cache_remove(i);
+        }
+    }
+
+    if (cache_count < CACHE_MAX_ENTRIES) {
+        memset(&cache[cache_count], 0, sizeof(cache[cache_count]));
+        strncpy(cache[cache_count].path, path, PATH_LEN - 1);
+        strncpy(cache[cache_count].serial, serial, LASERSHARK_SERIALNUM_LEN - 1);
+        cache_count++;
+        cache_dirty = true;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+static void cache_forget(const char *path)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    if (-1 != (i = cache_find_path(path))) {
+        cache_remove(i);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+/*
+Stores what's cached for path into serial. Returns false if nothing is.
+*/
+static bool cache_lookup(const char *path, char *serial)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    i = cache_find_path(path);
+    if (i != -1) {
+        memcpy(serial, cache[i].serial, LASERSHARK_SERIALNUM_LEN);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return i != -1;
+}
+
+
+static bool cache_file_name(void)
+{
+    const char *dir;
+
+    if (NULL != (dir = getenv("LASERSHARK_DEVICE_CACHE"))) {
+        snprintf(cache_file, sizeof(cache_file), "%s", dir);
+#ifdef _WIN32
+    } else if (NULL != (dir = getenv("LOCALAPPDATA"))) {
+        snprintf(cache_file, sizeof(cache_file), "%s\\" CACHE_FILE_NAME, dir);
+#else
+    } else if (NULL != (dir = getenv("XDG_CACHE_HOME"))) {
+        snprintf(cache_file, sizeof(cache_file), "%s/" CACHE_FILE_NAME, dir);
+    } else if (NULL != (dir = getenv("HOME"))) {
+        snprintf(cache_file, sizeof(cache_file), "%s/.cache/" CACHE_FILE_NAME, dir);
+#endif
+    } else {
+        cache_file[0] = '\0';
+    }
+
+    return cache_file[0] != '\0';
+}
+
+
+// One "path serial" pair per line.
+static void cache_load(void)
+{
+    FILE *f;
+    char line[PATH_LEN + LASERSHARK_SERIALNUM_LEN + 2];
+    struct cache_entry *e;
+
+    if (!cache_file_name() || NULL == (f = fopen(cache_file, "r"))) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    while (cache_count < CACHE_MAX_ENTRIES && fgets(line, sizeof(line), f)) {
+        e = &cache[cache_count];
+        memset(e, 0, sizeof(*e));
+        if (2 == sscanf(line, "%31s %63[^\n]", e->path, e->serial)) {
+            cache_count++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    fclose(f);
+}
+
+
+// The cache is only a hint, failing to save it isn't worth reporting.
+static void cache_save(void)
+{
+    FILE *f;
+    char temp_file[CACHE_FILE_NAME_LEN + 4];
+    int i;
+
+    if (!cache_dirty || cache_file[0] == '\0') {
+        return;
+    }
+
+    // Written aside and renamed over so concurrent runs never see half a file.
+    snprintf(temp_file, sizeof(temp_file), "%s.new", cache_file);
+    if (NULL == (f = fopen(temp_file, "w"))) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < cache_count; i++) {
+        fprintf(f, "%s %s\n", cache[i].path, cache[i].serial);
+    }
+    cache_dirty = false;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (fclose(f)) {
+        remove(temp_file);
+        return;
+    }
+#ifdef _WIN32
+    remove(cache_file);
+#endif
+    if (rename(temp_file, cache_file)) {
+        remove(temp_file);
+    }
+}
+
+
+/*
+A device coming or going at a path means whatever was cached there can't be
+trusted anymore. Devices present at registration are reported too, those
+are left alone, the cache is checked on open anyway.
+*/
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
+                                        libusb_hotplug_event event, void *user_data)
+{
+    char path[PATH_LEN];
+
+    if (!hotplug_enumerating && device_path(dev, path)) {
+        cache_forget(path);
+    }
+
+    return 0;
+}
+
+
+void ls_discovery_init(void)
+{
+    int rc;
+
+    cache_load();
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return;
+    }
+
+    hotplug_enumerating = true;
+    rc = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                          LIBUSB_HOTPLUG_ENUMERATE, LASERSHARK_VID, LASERSHARK_PID,
+                                          LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &hotplug_handle);
+    hotplug_enumerating = false;
+    hotplug_registered = rc == LIBUSB_SUCCESS;
+}
+
+
+void ls_discovery_exit(void)
+{
+    if (hotplug_registered) {
+        libusb_hotplug_deregister_callback(NULL, hotplug_handle);
+        hotplug_registered = false;
+    }
+    cache_save();
+}
+
+
+/*
+Opens dev and reads its serial number into serial, caching it. Returns NULL
+on failure.
+*/
+static struct libusb_device_handle *open_device(libusb_device *dev, const char *path, char *serial)
+{
+    int rc;
+    struct libusb_device_handle *devh;
+    struct libusb_device_descriptor desc;
+
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc < 0) {
+        fprintf(stderr, "Error obtaining device descriptor: %d\n", /*libusb_error_name(rc)*/rc);
+        return NULL;
+    }
+
+    rc = libusb_open(dev, &devh);
+    if (rc < 0) {
+        fprintf(stderr, "Error opening USB device\n");
+        return NULL;
+    }
+
+    memset(serial, 0, LASERSHARK_SERIALNUM_LEN);
+    rc = libusb_get_string_descriptor_ascii(devh, desc.iSerialNumber, (unsigned char*)serial,
+                                            LASERSHARK_SERIALNUM_LEN);
+    if (rc < 0) {
+        fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
+        libusb_close(devh);
+        return NULL;
+    }
+
+    if (path != NULL) {
+        cache_store(path, serial);
+    }
+
+    return devh;
+}
+
+
+struct libusb_device_handle *ls_discovery_open(const char *serial, char *found_serial)
+{
+    libusb_device **devs = NULL;
+    struct libusb_device_handle *devh = NULL;
+    ssize_t count;
+    ssize_t i;
+    int pass;
+    char (*paths)[PATH_LEN];
+    char cached[LASERSHARK_SERIALNUM_LEN];
+    bool known;
+
+    count = libusb_get_device_list(NULL, &devs);
+
+    if (count < 0) {
+        fprintf(stderr, "Error encountered acquiring device list: %d\n", (int)count);
+        return NULL;
+    }
+
+    paths = calloc(count ? count : 1, PATH_LEN);
+    if (paths == NULL) {
+        libusb_free_device_list(devs, 1);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (is_lasershark(devs[i]) && !device_path(devs[i], paths[i])) {
+            paths[i][0] = '?';
+        }
+    }
+
+    /*
+    Pass 0 opens only the device cached with the wanted serial, the common
+    case. Pass 1 tries devices nothing is cached for, newly plugged boards.
+    Pass 2 gives the rest a go in case the cache is stale.
+    */
+    for (pass = serial == NULL ? 2 : 0; devh == NULL && pass < 3; pass++) {
+        for (i = 0; devh == NULL && i < count; i++) {
+            if (paths[i][0] == '\0') {
+                continue; // Not a Lasershark, or opened in an earlier pass
+            }
+
+            known = paths[i][0] != '?' && cache_lookup(paths[i], cached);
+            if ((pass == 0 && (!known || 0 != strncmp(cached, serial, LASERSHARK_SERIALNUM_LEN))) ||
+                    (pass == 1 && known)) {
+                continue;
+            }
+
+            devh = open_device(devs[i], paths[i][0] != '?' ? paths[i] : NULL, found_serial);
+            paths[i][0] = '\0';
+            if (devh == NULL) {
+                continue;
+            }
+
+            if (NULL == serial || 0 == strncmp(found_serial, serial, LASERSHARK_SERIALNUM_LEN)) {
+                printf("iSerialNumber: %s\n", found_serial);
+                break;
+            }
+
+            libusb_close(devh);
+            memset(found_serial, 0, LASERSHARK_SERIALNUM_LEN);
+            devh = NULL;
+        }
+    }
+
+    free(paths);
+    libusb_free_device_list(devs, 1); // Free the list and dereference all devices
+
+    return devh;
+}
+
+
+int ls_discovery_list(char (*serials)[LASERSHARK_SERIALNUM_LEN], int max)
+{
+    libusb_device **devs = NULL;
+    struct libusb_device_handle *devh;
+    ssize_t count;
+    ssize_t i;
+    int found = 0;
+    char path[PATH_LEN];
+
+    count = libusb_get_device_list(NULL, &devs);
+
+    if (count < 0) {
+        fprintf(stderr, "Error encountered acquiring device list: %d\n", (int)count);
+        return -1;
+    }
+
+    // Listing has to be accurate, so every board is read, refreshing the cache.
+    for (i = 0; i < count && found < max; i++) {
+        if (!is_lasershark(devs[i])) {
+            continue;
+        }
+
+        devh = open_device(devs[i], device_path(devs[i], path) ? path : NULL, serials[found]);
+        if (devh == NULL) {
+            continue;
+        }
+        libusb_close(devh);
+        found++;
+    }
+
+    libusb_free_device_list(devs, 1); // Free the list and dereference all devices
+
+    return found;
+}
@@ -0,0 +1,65 @@
+/*
+lasershark_discovery.h - Finds Lasersharks on the bus by serial number,
+remembering where each one was last seen.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LASERSHARK_DISCOVERY_H
+#define LASERSHARK_DISCOVERY_H
+
+#include <libusb.h>
+#include "lasershark_device.h"
+
+/*
+Reading a serial number means opening the device and a control transfer, so
+with many boards on the bus checking each one in turn is slow. Instead the
+USB port path each serial was last seen at is cached, in memory and in a
+file that survives between runs, and only the device at that path is tried.
+Its serial is always read back, so a stale cache just costs a full scan.
+libusb hotplug events, where supported, drop paths that had a device
+unplugged or plugged in so the cache doesn't point at the wrong board.
+
+The cache file is $LASERSHARK_DEVICE_CACHE if set, otherwise
+lasershark_devices in the user's cache directory.
+*/
+
+/*
+Loads the cache and starts listening for hotplug events. Call after
+libusb_init(). Discovery works without it, it just has to scan every time.
+*/
+void ls_discovery_init(void);
+
+/*
+Stops listening for hotplug events and saves the cache. Call before
+libusb_exit().
+*/
+void ls_discovery_exit(void);
+
+/*
+Opens the Lasershark with the given serial number, or the first one found if
+serial is NULL, and stores its serial number into found_serial, which must
+hold LASERSHARK_SERIALNUM_LEN chars. Returns NULL if none matched.
+*/
+struct libusb_device_handle *ls_discovery_open(const char *serial, char *found_serial);
+
+/*
+Reads the serial number of every connected Lasershark into serials, up to
+max of them. Returns how many were stored, or -1 on failure.
+*/
+int ls_discovery_list(char (*serials)[LASERSHARK_SERIALNUM_LEN], int max);
+
+#endif
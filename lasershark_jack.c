@@ -18,22 +18,33 @@ You should have received a copy of the GNU General Public License
 along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE // pthread_setaffinity_np()
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <math.h>
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 #include <libusb.h>
 #include <signal.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include "lasersharklib/lasershark_lib.h"
-
-
-#define LASERSHARK_VIN 0x1fc9
-#define LASERSHARK_PID 0x04d8
+#include "getopt_portable.h"
+#include "occupancy_model.h"
+#include "time_portable.h"
+#include "lasershark_device.h"
+#include "lasershark_discovery.h"
+#include "iso_pool.h"
+#include "jack_convert.h"
+#include "drift_resampler.h"
+#include "rt_log.h"
 
 int do_exit = 0;
 pid_t pid;
@@ -43,57 +54,215 @@ jack_client_t *client;
 typedef jack_default_audio_sample_t sample_t;
 typedef jack_nframes_t nframes_t;
 
-jack_port_t *in_x;
-jack_port_t *in_y;
-jack_port_t *in_r;
-jack_port_t *in_g;
-jack_port_t *in_b;
-
 nframes_t rate;
 
-// Number of laserjack data packets the ringbuffer will have space for.
+// Number of laserjack data packets each board's ringbuffer will have space for.
 #define JACK_RB_PACKETS 256
-jack_ringbuffer_t *jack_rb = NULL;
-uint32_t jack_rb_len = 0;
-
-uint8_t *laserjack_iso_data_packet_buf = NULL;
-int laserjack_iso_data_packet_len = 0;
-
-int lasershark_serialnum_len = 64;
-unsigned char lasershark_serialnum[64];
-uint32_t lasershark_fw_major_version = 0;
-uint32_t lasershark_fw_minor_version = 0;
-
-
-uint32_t lasershark_iso_packet_sample_count;
-uint32_t lasershark_samp_element_count;
-uint32_t lasershark_max_ilda_rate;
-uint32_t lasershark_dac_min_val;
-uint32_t lasershark_dac_max_val;
-
-uint32_t lasershark_ringbuffer_sample_count;
 
-uint32_t lasershark_ilda_rate = 0;
+// Every transfer carries iso_packets_per_transfer packets back to back and is
+// only sent once a board's jack_rb holds all of them.
+#define ISO_PACKETS_MAX 32
+#define ISO_PACKETS_DEFAULT 1
+int iso_packets_per_transfer = ISO_PACKETS_DEFAULT;
+
+// Samples are 4 uint16s, see process().
+#define LASERJACK_SAMPLE_ELEMENTS 4
+#define LASERJACK_SAMPLE_LEN (LASERJACK_SAMPLE_ELEMENTS*sizeof(uint16_t))
+
+// ISO transfers preallocated per board at startup so sending never
+// allocates. This bounds the transfers in flight.
+#define ISO_POOL_TRANSFERS 64
+// Times to wait 100ms for in-flight transfers when quitting.
+#define ISO_POOL_REAP_TRIES 10
+
+// process() only fills each board's jack_rb. This thread moves them on to the
+// devices, keeping iso_queue_target transfers queued per board.
+#define USB_WRITER_PRIORITY 60
+#define ISO_QUEUE_DEFAULT 16
+// Longest the writer sleeps without being woken, in us.
+#define USB_WRITER_WAIT_US 10000
+pthread_t usb_writer;
+bool usb_writer_started = false;
+// Posted by process() after writing the ringbuffers and by completed transfers.
+sem_t usb_writer_wake;
+int iso_queue_target = ISO_QUEUE_DEFAULT;
+
+// Runs completion callbacks so they aren't held up by anything else. It
+// outranks the writer since completions are what free up transfers.
+#define USB_EVENTS_PRIORITY_DEFAULT 62
+// Longest a libusb event wait lasts, shutdown interrupts it anyway.
+#define USB_EVENTS_WAIT_US 1000000
+pthread_t usb_events;
+bool usb_events_started = false;
+int usb_events_priority = USB_EVENTS_PRIORITY_DEFAULT;
+// CPU the event thread is pinned to, -1 for any.
+int usb_events_cpu = -1;
 
 typedef struct
 {
     float x, y, r, g, b;
 } bufsample_t;
 
-struct libusb_device_handle *devh_ctl = NULL;
-struct libusb_device_handle *devh_data = NULL;
-uint32_t max_iso_data_len = 0;
+#define TARGET_LATENCY_MAX_MS 10000
+uint64_t target_latency_us = 0;
 
+// Set when -L or -D need the occupancy models kept up to date.
+bool track_occupancy = false;
+
+// With -D process() resamples so the samples queued between JACK and each
+// display hold steady while the clocks drift apart. The writer runs the
+// controllers and hands process() their corrections in parts per billion.
+#define DRIFT_CHUNK_FRAMES 256
+#define DRIFT_UPDATE_INTERVAL_US 100000
+bool drift_enabled = false;
+
+// The reported latency range is the lowest and highest queue measured over
+// this many occupancy syncs. JACK is only told again when either end moved
+// by more than a millisecond.
+#define LATENCY_WINDOW_SYNCS 10
+
+// The rate JACK runs at, which every board plays at, 0 until JACK named one.
+// When JACK changes rate mid show srate() records the new one and, per
+// board, how many samples had been converted at the old one. The writer
+// then drops those and reprograms the devices.
+#define RATE_CHANGE_POLL_US 1000
+atomic_uint rate_change_rate;
+
+/*
+Everything about one Lasershark. All boards hang off the one JACK client,
+so they see the same JACK cycles and stay sample synchronous, and share the
+USB writer and event threads.
+*/
+#define MAX_BOARDS 8
+struct board
+{
+    int index;
+    const char *requested_serial;
+    struct ls_device *dev;
+
+    jack_port_t *in_x;
+    jack_port_t *in_y;
+    jack_port_t *in_r;
+    jack_port_t *in_g;
+    jack_port_t *in_b;
+
+    jack_ringbuffer_t *jack_rb;
+    struct iso_pool *iso_pool;
+    struct jack_convert converter;
+
+    uint32_t fw_major_version;
+    uint32_t fw_minor_version;
+    uint32_t iso_packet_sample_count;
+    uint32_t samp_element_count;
+    uint32_t max_ilda_rate;
+    uint32_t dac_min_val;
+    uint32_t dac_max_val;
+    uint32_t ringbuffer_sample_count;
+    uint32_t max_iso_data_len;
+
+    int iso_data_packet_len;
+    int iso_transfer_len;
+    uint32_t iso_transfer_sample_count;
+
+    // Samples queued ahead of the output. Only the USB writer touches the
+    // model, the main thread hands it ringbuffer query results through the
+    // occupancy_sync atomics.
+    struct occupancy_model occupancy;
+    uint32_t target_latency_samples;
+
+    // Samples in ISO transfers that haven't completed yet.
+    atomic_uint iso_in_flight_samples;
+    // Samples ever handed to USB by the USB writer.
+    atomic_ullong samples_sent;
+
+    atomic_bool occupancy_sync_pending;
+    atomic_uint occupancy_sync_samples;
+    atomic_ullong occupancy_sync_sent;
+    atomic_ullong occupancy_sync_us;
+
+    // -D, process() side.
+    struct drift_resampler resampler;
+    float drift_buf[DRIFT_RESAMPLER_CHANNELS][DRIFT_RESAMPLER_MAX_OUT(DRIFT_CHUNK_FRAMES)];
+    atomic_int drift_correction_ppb;
+    // -D, writer side.
+    struct drift_controller drift;
+    double drift_level_total;
+    uint32_t drift_level_count;
+    uint64_t drift_last_us;
+
+    // The rate the device plays at. Only the USB writer changes it once
+    // running, main() reads it for the latency slack.
+    atomic_uint ilda_rate;
+    atomic_bool rate_change_pending;
+    atomic_ullong rate_change_mark;
+    // Samples ever written to jack_rb by process() and read by the writer.
+    atomic_ullong jack_rb_samples_written;
+    uint64_t jack_rb_samples_read;
+
+    // Playback latency reported on the board's ports. main() measures it
+    // and latency() hands it to JACK.
+    uint32_t latency_window_min;
+    uint32_t latency_window_max;
+    int latency_window_syncs;
+    atomic_uint latency_min;
+    atomic_uint latency_max;
+};
+
+struct board boards[MAX_BOARDS];
+int board_count = 0;
+
+
+// Signals main() waits for. They are blocked in every thread.
+sigset_t mask;
+
+// process(), the completion callbacks and the USB writer mustn't block on
+// stdio, so they count and queue what went wrong and main() prints it.
+// SIGUSR2 prints the counters.
+enum log_event
+{
+    LOG_JACK_RB_FULL,
+    LOG_SAMPLES_DROPPED,
+    LOG_ISO_TRANSFER_ERR,
+    LOG_ISO_PACKET_ERR,
+    LOG_ISO_SHORT_WRITE,
+    LOG_SUBMIT_FAIL,
+    LOG_JACK_RB_READ_FAIL,
+    LOG_EVENTS
+};
+
+static const struct rt_log_event_type log_events[LOG_EVENTS] = {
+    {"JACK ringbuffer overruns", "Board %d: Ringbuffer full, dropped %d samples"},
+    {"Samples dropped", NULL},
+    {"ISO transfer errors", "Board %d: ISO transfer err: %d   bytes transferred: %d"},
+    {"ISO packet errors", "Board %d: ISO packet %d err: %d"},
+    {"ISO short writes", "Board %d: ISO packet %d only wrote %d bytes"},
+    {"ISO submit failures", "Board %d: Could not submit transfer: rc=%d"},
+    {"JACK ringbuffer read failures", "Board %d: Ringbuffer read failure"}
+};
+
+// Each thread posting to the log gets its own ring. Completions run on the
+// event thread, or on main() once that has been joined.
+enum log_source
+{
+    LOG_SOURCE_PROCESS,
+    LOG_SOURCE_USB_EVENTS,
+    LOG_SOURCE_USB_WRITER,
+    LOG_SOURCES
+};
 
-sigset_t mask, oldmask;
+#define LOG_DEPTH 256
+// How often main() prints queued messages, in us.
+#define LOG_DRAIN_INTERVAL_US 100000
+struct rt_log *rt_log;
 
 
 
-static void sig_hdlr(int signum)
+static void handle_signal(int signum)
 {
     switch (signum)
     {
     case SIGINT:
+    case SIGTERM:
         printf("\nGot request to quit\n");
         do_exit = 1;
         break;
@@ -101,6 +270,9 @@ static void sig_hdlr(int signum)
         printf("sigusr1 caught\n");
         do_exit = 1;
         break;
+    case SIGUSR2:
+        rt_log_print_counters(rt_log, stdout);
+        break;
     default:
         printf("what\n");
     }
@@ -113,77 +285,277 @@ void quit_program()
 }
 
 /*
-Internal callback for cleaning up async writes.
+Internal callback, hands finished async writes back to the pool.
  */
 void
 WriteAsyncCallback(struct libusb_transfer *transfer)
 {
+    struct board *b = iso_pool_user_data(transfer);
+    int i;
+
     if (transfer && (transfer->status != LIBUSB_TRANSFER_COMPLETED/* || transfer->actual_length != transfer->length*/))
     {
-        printf("ISO transfer err: %d   bytes transferred: %d\n", transfer->status, transfer->actual_length);
+        rt_log_post(rt_log, LOG_SOURCE_USB_EVENTS, LOG_ISO_TRANSFER_ERR, b->index,
+                    transfer->status, transfer->actual_length);
     }
-    free(transfer->buffer);
-    libusb_free_transfer(transfer);
+    else
+    {
+        for (i = 0; i < transfer->num_iso_packets; i++)
+        {
+            if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED)
+            {
+                rt_log_post(rt_log, LOG_SOURCE_USB_EVENTS, LOG_ISO_PACKET_ERR, b->index,
+                            i, transfer->iso_packet_desc[i].status);
+            }
+            else if (transfer->iso_packet_desc[i].actual_length < transfer->iso_packet_desc[i].length)
+            {
+                rt_log_post(rt_log, LOG_SOURCE_USB_EVENTS, LOG_ISO_SHORT_WRITE, b->index,
+                            i, transfer->iso_packet_desc[i].actual_length);
+            }
+        }
+    }
+    atomic_fetch_sub(&b->iso_in_flight_samples, b->iso_transfer_sample_count);
+    iso_pool_put(b->iso_pool, transfer);
+    sem_post(&usb_writer_wake);
 }
 
 
 
 /*
-Writes an ISO packet to the Lasershark device.
+Submits a pooled ISO transfer whose buffer has been filled. The transfer
+goes back to the pool if it can't be submitted.
 Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
 */
-int write_lasershark_data(unsigned char *data, int len)
+int write_lasershark_data(struct board *b, struct libusb_transfer *transfer)
 {
     int rc;
 
-    if (len > max_iso_data_len)
+    atomic_fetch_add(&b->iso_in_flight_samples, b->iso_transfer_sample_count);
+    rc = ls_device_submit_transfer(b->dev, transfer);
+
+    if(rc != 0)
     {
-        printf("Oversized iso write length. %d > %d\n", len, max_iso_data_len);
+        atomic_fetch_sub(&b->iso_in_flight_samples, b->iso_transfer_sample_count);
+        iso_pool_put(b->iso_pool, transfer);
+        rt_log_post(rt_log, LOG_SOURCE_USB_WRITER, LOG_SUBMIT_FAIL, b->index, rc, 0);
         return LASERSHARK_CMD_FAIL;
     }
 
-    struct libusb_transfer *transfer = libusb_alloc_transfer(1);
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+/*
+Applies a ringbuffer query posted by the main thread. The query was taken a
+little while ago, so samples sent since then are added back and the model
+drains the time in between.
+*/
+static void apply_occupancy_sync(struct board *b, uint64_t now_us)
+{
+    uint64_t sync_us, sync_sent;
+    double queued;
+
+    if (!atomic_exchange(&b->occupancy_sync_pending, false)) {
+        return;
+    }
 
-    if (!transfer)
+    sync_us = atomic_load(&b->occupancy_sync_us);
+    sync_sent = atomic_load(&b->occupancy_sync_sent);
+    queued = atomic_load(&b->occupancy_sync_samples);
+
+    queued += atomic_load(&b->samples_sent) - sync_sent;
+    if (now_us > sync_us) {
+        queued -= (double)(now_us - sync_us) * b->occupancy.rate / 1000000.0;
+    }
+    occupancy_model_sync(&b->occupancy, queued > 0 ? (uint32_t)queued : 0, now_us);
+}
+
+
+/*
+Returns true if another ISO transfer fits under the target latency. Always
+true while nothing is queued so tiny targets can't stall the output.
+*/
+static bool iso_transfer_allowed(struct board *b, uint64_t now_us)
+{
+    double level;
+
+    if (target_latency_us == 0) {
+        return true;
+    }
+
+    level = occupancy_model_level(&b->occupancy, now_us);
+    return level == 0 || level + b->iso_transfer_sample_count <= b->target_latency_samples;
+}
+
+
+/*
+Queries the ringbuffer and posts the result for the USB writer to pick up.
+Runs on the main thread since control transfers block.
+Returns the samples queued past jack_rb, or -1 if the query failed.
+*/
+static int64_t post_occupancy_sync(struct board *b)
+{
+    int rc;
+    uint32_t empty_samples, queued_samples;
+    uint64_t sent;
+
+    sent = atomic_load(&b->samples_sent);
+    queued_samples = atomic_load(&b->iso_in_flight_samples);
+
+    rc = ls_device_get_ringbuffer_empty_sample_count(b->dev, &empty_samples);
+    if (rc != LASERSHARK_CMD_SUCCESS)
     {
-        printf("Could not allocate memory for iso transfer.\n");
-        return LIBUSB_ERROR_NO_MEM;
+        printf("Getting ringbuffer empty sample count failed.\n");
+        return -1;
     }
+    if (empty_samples < b->ringbuffer_sample_count) {
+        queued_samples += b->ringbuffer_sample_count - empty_samples;
+    }
+
+    atomic_store(&b->occupancy_sync_samples, queued_samples);
+    atomic_store(&b->occupancy_sync_sent, sent);
+    atomic_store(&b->occupancy_sync_us, time_portable_now_us());
+    atomic_store(&b->occupancy_sync_pending, true);
+
+    return queued_samples;
+}
 
-    libusb_fill_iso_transfer(transfer, devh_data, (4 | LIBUSB_ENDPOINT_OUT),
-                             malloc(len), len, 1, WriteAsyncCallback, 0, 0);
 
-    if (!transfer->buffer)
+/*
+Sets the latency reported before anything has been measured from the
+configuration: at least a transfer, and at most the -L target or a full
+ISO queue.
+*/
+static void init_latency(struct board *b)
+{
+    uint32_t min, max;
+
+    min = b->iso_transfer_sample_count;
+    if (target_latency_us)
     {
-        printf("Could not create iso transfer packet.\n");
-        libusb_free_transfer(transfer);
-        return LASERSHARK_CMD_FAIL;
+        max = b->target_latency_samples + b->iso_transfer_sample_count;
+    }
+    else
+    {
+        max = b->iso_transfer_sample_count * iso_queue_target;
     }
+    atomic_store(&b->latency_min, min);
+    atomic_store(&b->latency_max, max);
+    b->latency_window_syncs = 0;
+}
 
-    libusb_set_iso_packet_lengths(transfer, len);
 
-    memcpy(transfer->buffer, data, len);
+/*
+Adds a measurement of the samples queued past jack_rb, plus what jack_rb
+holds now, to a board's latency window. Once the window is full its range
+replaces the reported one if that is more than a millisecond off.
+Returns true if JACK needs to recompute latencies.
+*/
+static bool update_latency(struct board *b, uint32_t queued_samples)
+{
+    uint32_t level, min, max, slack;
 
-    rc = libusb_submit_transfer(transfer);
+    level = queued_samples + jack_ringbuffer_read_space(b->jack_rb) / LASERJACK_SAMPLE_LEN;
+    if (b->latency_window_syncs == 0 || level < b->latency_window_min)
+    {
+        b->latency_window_min = level;
+    }
+    if (b->latency_window_syncs == 0 || level > b->latency_window_max)
+    {
+        b->latency_window_max = level;
+    }
+    if (++b->latency_window_syncs < LATENCY_WINDOW_SYNCS)
+    {
+        return false;
+    }
+    b->latency_window_syncs = 0;
 
-    if(rc != 0)
+    min = atomic_load(&b->latency_min);
+    max = atomic_load(&b->latency_max);
+    slack = atomic_load(&b->ilda_rate) / 1000;
+    if (abs((int)(b->latency_window_min - min)) <= slack && abs((int)(b->latency_window_max - max)) <= slack)
     {
-        printf("Could not submit transfer: rc=%d\n", rc);
-        return LASERSHARK_CMD_FAIL;
+        return false;
     }
 
-    return LASERSHARK_CMD_SUCCESS;
+    atomic_store(&b->latency_min, b->latency_window_min);
+    atomic_store(&b->latency_max, b->latency_window_max);
+    return true;
+}
+
+
+/*
+Converts frames samples into a board's jack_rb, which may wrap once.
+Returns how many fit.
+*/
+static nframes_t write_samples(struct board *b, const sample_t *x, const sample_t *y, const sample_t *r,
+                               const sample_t *g, const sample_t *bl, nframes_t frames)
+{
+    jack_ringbuffer_data_t vec[2];
+    nframes_t first, second;
+
+    jack_ringbuffer_get_write_vector(b->jack_rb, vec);
+    first = vec[0].len / LASERJACK_SAMPLE_LEN;
+    if (first > frames)
+    {
+        first = frames;
+    }
+    second = vec[1].len / LASERJACK_SAMPLE_LEN;
+    if (second > frames - first)
+    {
+        second = frames - first;
+    }
+
+    jack_convert_run(&b->converter, x, y, r, g, bl, (uint16_t *)vec[0].buf, first);
+    if (second)
+    {
+        jack_convert_run(&b->converter, x + first, y + first, r + first, g + first, bl + first,
+                         (uint16_t *)vec[1].buf, second);
+    }
+    jack_ringbuffer_write_advance(b->jack_rb, (first + second) * LASERJACK_SAMPLE_LEN);
+    atomic_fetch_add(&b->jack_rb_samples_written, first + second);
+
+    return first + second;
 }
 
 
 /*
-Converts from one linear scale to another in the sexiest manner possible, with math.
+Converts one board's ports into its jack_rb, resampling first with -D.
+Returns how many samples didn't fit.
 */
-static uint16_t convert(float OldValue, float OldMin, float OldMax, uint32_t NewMax, uint32_t NewMin)
+static nframes_t process_board(struct board *b, nframes_t nframes)
 {
+    nframes_t frm, chunk, count;
+    nframes_t dropped = 0;
+    const float *in[DRIFT_RESAMPLER_CHANNELS];
+    float *const out[DRIFT_RESAMPLER_CHANNELS] = {b->drift_buf[0], b->drift_buf[1], b->drift_buf[2],
+                                                  b->drift_buf[3], b->drift_buf[4]};
+
+    sample_t *i_x = (sample_t *) jack_port_get_buffer (b->in_x, nframes);
+    sample_t *i_y = (sample_t *) jack_port_get_buffer (b->in_y, nframes);
+    sample_t *i_r = (sample_t *) jack_port_get_buffer (b->in_r, nframes);
+    sample_t *i_g = (sample_t *) jack_port_get_buffer (b->in_g, nframes);
+    sample_t *i_b = (sample_t *) jack_port_get_buffer (b->in_b, nframes);
+
+    if (!drift_enabled)
+    {
+        return nframes - write_samples(b, i_x, i_y, i_r, i_g, i_b, nframes);
+    }
+
+    drift_resampler_set_ratio(&b->resampler, 1.0 + atomic_load(&b->drift_correction_ppb) / 1000000000.0);
+    for (frm = 0; frm < nframes; frm += chunk)
+    {
+        chunk = nframes - frm < DRIFT_CHUNK_FRAMES ? nframes - frm : DRIFT_CHUNK_FRAMES;
+        in[0] = i_x + frm;
+        in[1] = i_y + frm;
+        in[2] = i_r + frm;
+        in[3] = i_g + frm;
+        in[4] = i_b + frm;
+        count = drift_resampler_run(&b->resampler, in, chunk, out);
+        dropped += count - write_samples(b, out[0], out[1], out[2], out[3], out[4], count);
+    }
 
-    uint16_t val = (uint16_t)((((OldValue - OldMin) * (float)(NewMax - NewMin)) / (OldMax - OldMin)) + (float)NewMin);
-    return val;
+    return dropped;
 }
 
 
@@ -200,68 +572,303 @@ with multiple different lasershark versions... but for now, it's good enough.
 */
 static int process (nframes_t nframes, void *arg)
 {
-    uint16_t temp[4];
-    int avail, written, i, j, rc;
-    nframes_t frm;
-
-    sample_t *i_x = (sample_t *) jack_port_get_buffer (in_x, nframes);
-    sample_t *i_y = (sample_t *) jack_port_get_buffer (in_y, nframes);
-    sample_t *i_r = (sample_t *) jack_port_get_buffer (in_r, nframes);
-    sample_t *i_g = (sample_t *) jack_port_get_buffer (in_g, nframes);
-    sample_t *i_b = (sample_t *) jack_port_get_buffer (in_b, nframes);
-
-    // Read in all samples given to us from the GODLY JACK SERVER
-    for (frm = 0; frm < nframes; frm++)
-    {
-        // Read the data and convert it to a format suitable to be sent out to the lasershark.
-        temp[0] = convert(*i_r++, -0.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-        temp[1] = convert(*i_g++, -0.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-        if (convert(*i_b++, -0.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val) >= 
-		(lasershark_dac_max_val + lasershark_dac_min_val)/2) {
-		temp[0] |= LASERSHARK_C_BITMASK; // If the laser power is >= half the dac output.. turn this ttl channel on.
-	}
-	temp[0] |= LASERSHARK_INTL_A_BITMASK; // Turn on the interlock pin since this is a valid sample.
-
-        temp[2] = convert(*i_x++, -1.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-        temp[3] = convert(*i_y++ * -1.0f, -1.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-
-        // Jam the samples in the ringbuffer.
-        avail = jack_ringbuffer_write_space(jack_rb);
-        if (avail >= lasershark_samp_element_count*sizeof(uint16_t))
+    int i;
+    nframes_t dropped;
+
+    // Convert all samples given to us from the GODLY JACK SERVER straight
+    // into the ringbuffers.
+    for (i = 0; i < board_count; i++)
+    {
+        dropped = process_board(&boards[i], nframes);
+        if (dropped)
         {
-            written = jack_ringbuffer_write(jack_rb, (const char*)temp, lasershark_samp_element_count*sizeof(uint16_t));
-            if (written != lasershark_samp_element_count*sizeof(uint16_t) )
-            {
-                printf("Ringbuffer write failure\n");
-            }
+            rt_log_post(rt_log, LOG_SOURCE_PROCESS, LOG_JACK_RB_FULL, i, dropped, 0);
+            rt_log_count(rt_log, LOG_SAMPLES_DROPPED, dropped);
         }
-        else
+    }
+
+    sem_post(&usb_writer_wake);
+
+    return 0;
+}
+
+
+/*
+Averages the samples queued between JACK and the display, jack_rb included,
+and runs the drift controller on that every DRIFT_UPDATE_INTERVAL_US.
+*/
+static void update_drift(struct board *b, uint64_t now_us)
+{
+    double correction;
+
+    b->drift_level_total += occupancy_model_level(&b->occupancy, now_us) +
+                            jack_ringbuffer_read_space(b->jack_rb) / LASERJACK_SAMPLE_LEN;
+    b->drift_level_count++;
+    if (now_us - b->drift_last_us < DRIFT_UPDATE_INTERVAL_US)
+    {
+        return;
+    }
+
+    correction = drift_controller_update(&b->drift, b->drift_level_total / b->drift_level_count, now_us);
+    atomic_store(&b->drift_correction_ppb, (int)lround(correction * 1000000000.0));
+    b->drift_level_total = 0;
+    b->drift_level_count = 0;
+    b->drift_last_us = now_us;
+}
+
+
+/*
+Sets up a board's estimates for the current ilda rate with nothing queued.
+*/
+static void reset_board_estimates(struct board *b, uint64_t now_us)
+{
+    uint32_t rate = atomic_load(&b->ilda_rate);
+
+    atomic_store(&b->occupancy_sync_pending, false);
+    occupancy_model_init(&b->occupancy, rate, now_us);
+    b->target_latency_samples = occupancy_model_samples_for_us(&b->occupancy, target_latency_us);
+    drift_controller_init(&b->drift, rate, now_us);
+    atomic_store(&b->drift_correction_ppb, 0);
+    b->drift_level_total = 0;
+    b->drift_level_count = 0;
+    b->drift_last_us = now_us;
+}
+
+
+/*
+Switches a Lasershark over to the rate JACK changed to. Samples converted
+at the old rate are thrown away rather than played at the wrong speed, so
+once in-flight transfers have landed the device's ringbuffer is cleared too.
+Returns false while transfers are still in flight.
+*/
+static bool change_rate(struct board *b)
+{
+    int rc;
+    uint32_t new_rate = atomic_load(&rate_change_rate);
+    uint64_t mark = atomic_load(&b->rate_change_mark);
+    uint64_t stale;
+
+    if (mark > b->jack_rb_samples_read)
+    {
+        stale = mark - b->jack_rb_samples_read;
+        if (stale > jack_ringbuffer_read_space(b->jack_rb) / LASERJACK_SAMPLE_LEN)
         {
-            printf("Ringbuffer full\n");
-            break;
+            stale = jack_ringbuffer_read_space(b->jack_rb) / LASERJACK_SAMPLE_LEN;
         }
+        jack_ringbuffer_read_advance(b->jack_rb, stale * LASERJACK_SAMPLE_LEN);
+        b->jack_rb_samples_read += stale;
+    }
+
+    if (iso_pool_in_use(b->iso_pool))
+    {
+        return false;
+    }
+    atomic_store(&b->rate_change_pending, false);
+
+    rc = ls_device_clear_ringbuffer(b->dev);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Clearing ringbuffer failed\n");
+        quit_program();
+        return true;
+    }
+    rc = ls_device_set_ilda_rate(b->dev, new_rate);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Setting ILDA rate failed\n");
+        quit_program();
+        return true;
     }
+    atomic_store(&b->ilda_rate, new_rate);
+    printf("Board %d: ILDA rate changed to %u pps\n", b->index, new_rate);
+
+    // Everything queued is gone, start the estimates over.
+    reset_board_estimates(b, time_portable_now_us());
 
-    // Send out as many data packets as we can to the DEMIGOD LASERSHARK DEVICE
-    while ((i = jack_ringbuffer_read_space(jack_rb)) >= laserjack_iso_data_packet_len)
+    return true;
+}
+
+
+/*
+Sends out as many full transfers as we can to the DEMIGOD LASERSHARK DEVICE
+without going over the target latency or the queued transfer target.
+Samples stay in the ringbuffer while every pooled transfer is in flight.
+Returns how long until more could be sent, in us.
+*/
+static uint64_t send_packets(struct board *b)
+{
+    int j, rc;
+    uint64_t now_us = 0;
+    uint64_t wait_us = USB_WRITER_WAIT_US;
+    uint32_t target;
+    struct libusb_transfer *transfer;
+
+    if (atomic_load(&b->rate_change_pending) && !change_rate(b))
     {
+        return RATE_CHANGE_POLL_US;
+    }
+
+    if (track_occupancy)
+    {
+        now_us = time_portable_now_us();
+        apply_occupancy_sync(b, now_us);
+    }
+
+    while (jack_ringbuffer_read_space(b->jack_rb) >= b->iso_transfer_len &&
+            iso_pool_in_use(b->iso_pool) < iso_queue_target)
+    {
+        if (!iso_transfer_allowed(b, now_us))
+        {
+            target = b->target_latency_samples > b->iso_transfer_sample_count ?
+                     b->target_latency_samples - b->iso_transfer_sample_count : 0;
+            wait_us = occupancy_model_time_until(&b->occupancy, target, now_us);
+            break;
+        }
+
+        transfer = iso_pool_get(b->iso_pool);
+        if (transfer == NULL)
+        {
+            break;
+        }
+
         // read from the buffer
-        j = jack_ringbuffer_read(jack_rb, (char *)laserjack_iso_data_packet_buf, laserjack_iso_data_packet_len);
+        j = jack_ringbuffer_read(b->jack_rb, (char *)transfer->buffer, b->iso_transfer_len);
+        b->jack_rb_samples_read += b->iso_transfer_sample_count;
 
-        if (j != laserjack_iso_data_packet_len)
+        if (j != b->iso_transfer_len)
         {
-            printf("Ringbuffer read failure\n");
+            rt_log_post(rt_log, LOG_SOURCE_USB_WRITER, LOG_JACK_RB_READ_FAIL, b->index, 0, 0);
             quit_program();
         }
 
-        rc = write_lasershark_data((void *)laserjack_iso_data_packet_buf, laserjack_iso_data_packet_len);
+        rc = write_lasershark_data(b, transfer);
         if (rc != LASERSHARK_CMD_SUCCESS)
         {
             quit_program();
+            break;
+        }
+
+        atomic_fetch_add(&b->samples_sent, b->iso_transfer_sample_count);
+        if (track_occupancy)
+        {
+            occupancy_model_add(&b->occupancy, b->iso_transfer_sample_count, now_us);
         }
     }
 
-    return 0;
+    if (drift_enabled)
+    {
+        update_drift(b, now_us);
+    }
+
+    return wait_us;
+}
+
+
+static void *usb_writer_thread(void *arg)
+{
+    uint64_t wait_us, board_wait_us;
+    struct timespec deadline;
+    int i;
+
+    while (!do_exit)
+    {
+        wait_us = USB_WRITER_WAIT_US;
+        for (i = 0; i < board_count; i++)
+        {
+            board_wait_us = send_packets(&boards[i]);
+            if (board_wait_us < wait_us)
+            {
+                wait_us = board_wait_us;
+            }
+        }
+
+        // sem_timedwait() runs on the realtime clock.
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_us / 1000000;
+        deadline.tv_nsec += (wait_us % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&usb_writer_wake, &deadline);
+    }
+
+    return NULL;
+}
+
+
+static void *usb_events_thread(void *arg)
+{
+    struct timeval tv;
+
+    // Events are handled for the whole backend, so any board will do.
+    while (!do_exit)
+    {
+        tv.tv_sec = USB_EVENTS_WAIT_US / 1000000;
+        tv.tv_usec = USB_EVENTS_WAIT_US % 1000000;
+        ls_device_handle_events(boards[0].dev, &tv);
+    }
+
+    return NULL;
+}
+
+
+/*
+Starts a thread at SCHED_FIFO priority, falling back to normal scheduling
+when that isn't permitted. A priority of 0 asks for normal scheduling and a
+negative cpu leaves it free to run anywhere.
+*/
+static bool start_thread(pthread_t *thread, void *(*fn)(void *), int priority, int cpu, const char *name)
+{
+    int rc;
+    pthread_attr_t attr;
+    struct sched_param param;
+
+    if (priority)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        param.sched_priority = priority;
+        pthread_attr_setschedparam(&attr, &param);
+
+        rc = pthread_create(thread, &attr, fn, NULL);
+        pthread_attr_destroy(&attr);
+        if (rc == EPERM)
+        {
+            printf("Not allowed to use realtime scheduling, %s runs at normal priority\n", name);
+            rc = pthread_create(thread, NULL, fn, NULL);
+        }
+    }
+    else
+    {
+        rc = pthread_create(thread, NULL, fn, NULL);
+    }
+    if (rc)
+    {
+        printf("Could not start %s thread: %d\n", name, rc);
+        return false;
+    }
+
+    if (cpu >= 0)
+    {
+#ifdef __linux__
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        rc = pthread_setaffinity_np(*thread, sizeof(cpus), &cpus);
+        if (rc)
+        {
+            printf("Could not pin %s to CPU %d: %d\n", name, cpu, rc);
+        }
+#else
+        printf("CPU affinity isn't supported here, %s runs on any CPU\n", name);
+#endif
+    }
+
+    return true;
 }
 
 
@@ -274,23 +881,38 @@ static int bufsize (nframes_t nframes, void *arg)
 
 static int srate (nframes_t nframes, void *arg)
 {
+    int i;
+
     rate = nframes;
-    if (rate > lasershark_max_ilda_rate)
+    for (i = 0; i < board_count; i++)
     {
-        printf("Rate (%d) is higher than lasershark supports (%d)\n", rate, lasershark_max_ilda_rate);
-        quit_program();
-        return 1;
+        if (rate > boards[i].max_ilda_rate)
+        {
+            printf("Rate (%d) is higher than board %d supports (%d)\n", rate, i, boards[i].max_ilda_rate);
+            quit_program();
+            return 1;
+        }
     }
 
-    if (lasershark_ilda_rate != 0)
+    if (atomic_load(&rate_change_rate) != 0)
     {
-        printf("ILDA rate was already set.. but we were asked to set again.. unimplemented! Dying.\n");
-        quit_program();
-        return 1;
+        // Once running the USB writer owns the devices, hand it the change.
+        if (nframes != atomic_load(&rate_change_rate))
+        {
+            printf("ILDA rate changing to: %u pps\n", nframes);
+            atomic_store(&rate_change_rate, nframes);
+            for (i = 0; i < board_count; i++)
+            {
+                atomic_store(&boards[i].rate_change_mark, atomic_load(&boards[i].jack_rb_samples_written));
+                atomic_store(&boards[i].rate_change_pending, true);
+            }
+            sem_post(&usb_writer_wake);
+        }
+        return 0;
     }
 
-    lasershark_ilda_rate = nframes;
-    printf ("ILDA rate specified as: %u pps\n", lasershark_ilda_rate);
+    atomic_store(&rate_change_rate, nframes);
+    printf ("ILDA rate specified as: %u pps\n", nframes);
 
 
     return 0;
@@ -304,295 +926,675 @@ static void jack_shutdown (void *arg)
 }
 
 
-int main (int argc, char *argv[])
+/*
+The ports only lead to the Lasersharks, so there is no capture latency to
+pass on. Their playback latency is how long samples take to reach the
+display.
+*/
+static void latency (jack_latency_callback_mode_t mode, void *arg)
 {
-    int rc;
-    uint32_t temp;
-    struct sigaction sigact;
+    jack_latency_range_t range;
+    int i;
 
-    char jack_client_name[] = "lasershark";
-
-
-    pid = getpid();
-    sigact.sa_handler = sig_hdlr;
-    sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
-    sigaction(SIGINT, &sigact, NULL);
-    sigaction(SIGUSR1, &sigact, NULL);
-
-
-    rc = libusb_init(NULL);
-    if (rc < 0)
+    if (mode != JackPlaybackLatency)
     {
-        fprintf(stderr, "Error initializing libusb: %d\n", /*libusb_error_name(rc)*/rc);
-        exit(1);
+        return;
     }
 
-    devh_ctl = libusb_open_device_with_vid_pid(NULL, LASERSHARK_VIN, LASERSHARK_PID);
-    devh_data = libusb_open_device_with_vid_pid(NULL, LASERSHARK_VIN, LASERSHARK_PID);
-    if (!devh_ctl || !devh_data)
+    for (i = 0; i < board_count; i++)
     {
-        fprintf(stderr, "Error finding USB device\n");
-        goto out_post_release;
+        range.min = atomic_load(&boards[i].latency_min);
+        range.max = atomic_load(&boards[i].latency_max);
+        jack_port_set_latency_range(boards[i].in_x, mode, &range);
+        jack_port_set_latency_range(boards[i].in_y, mode, &range);
+        jack_port_set_latency_range(boards[i].in_r, mode, &range);
+        jack_port_set_latency_range(boards[i].in_g, mode, &range);
+        jack_port_set_latency_range(boards[i].in_b, mode, &range);
     }
+}
 
 
-    libusb_set_debug(NULL, 3);
+/*
+Opens a board and reads back what it supports.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int open_board(struct board *b, bool simulated)
+{
+    int rc;
+    uint32_t temp;
 
-    rc = libusb_claim_interface(devh_ctl, 0);
-    if (rc < 0)
+    if (simulated)
     {
-        fprintf(stderr, "Error claiming control interface: %d\n", /*libusb_error_name(rc)*/rc);
-        goto out_post_release;
+        b->dev = ls_device_open_sim(b->requested_serial, LS_DATA_ISO);
+        if (b->dev == NULL)
+        {
+            fprintf(stderr, "Error creating simulated LaserShark\n");
+            return LASERSHARK_CMD_FAIL;
+        }
     }
-    rc = libusb_claim_interface(devh_data, 1);
-    if (rc < 0)
+    else
     {
-        fprintf(stderr, "Error claiming data interface: %d\n", /*libusb_error_name(rc)*/rc);
-        libusb_release_interface(devh_ctl, 0);
-        goto out_post_release;
-    }
-
-    rc = libusb_set_interface_alt_setting(devh_data, 1, 0);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error setting alternative (ISO) data interface: %d\n", /*libusb_error_name(rc)*/rc);
-        goto out;
-    }
-
-    struct libusb_device_descriptor desc;
-
-    rc = libusb_get_device_descriptor(libusb_get_device(devh_ctl), &desc);
-    if (rc < 0) {
-        fprintf(stderr, "Error obtaining device descriptor: %d\n", /*libusb_error_name(rc)*/rc);
-    }
-    
-    memset(lasershark_serialnum, 0, lasershark_serialnum_len);
-    rc = libusb_get_string_descriptor_ascii(devh_ctl, desc.iSerialNumber, lasershark_serialnum, lasershark_serialnum_len);
-    if (rc < 0) {
-        fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
+        b->dev = ls_device_open_usb(b->requested_serial, LS_DATA_ISO);
+        if (b->dev == NULL)
+        {
+            if (b->requested_serial)
+            {
+                fprintf(stderr, "Error finding USB device with serial %s\n", b->requested_serial);
+            }
+            else
+            {
+                fprintf(stderr, "Error finding USB device\n");
+            }
+            return LASERSHARK_CMD_FAIL;
+        }
     }
-
-    printf("iSerialNumber: %s\n", lasershark_serialnum);
+    printf("Board %d: %s\n", b->index, ls_device_serial(b->dev));
 
 
-    rc = get_fw_major_version(devh_ctl, &lasershark_fw_major_version);
+    rc = ls_device_get_fw_major_version(b->dev, &b->fw_major_version);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting FW Major version failed. (Consider upgrading your firmware!)\n");
-        goto out;
+        return rc;
     }
-    printf("Getting FW Major version: %d\n", lasershark_fw_major_version);
+    printf("Getting FW Major version: %d\n", b->fw_major_version);
 
-    rc = get_fw_minor_version(devh_ctl, &lasershark_fw_minor_version);
+    rc = ls_device_get_fw_minor_version(b->dev, &b->fw_minor_version);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting FW Minor version failed. (Consider upgrading your firmware!)\n");
-        goto out;
+        return rc;
     }
-    printf("Getting FW Minor version: %d\n", lasershark_fw_minor_version);
+    printf("Getting FW Minor version: %d\n", b->fw_minor_version);
 
-    if (lasershark_fw_major_version != LASERSHARK_FW_MAJOR_VERSION ||
-            lasershark_fw_minor_version != LASERSHARK_FW_MINOR_VERSION) {
+    if (b->fw_major_version != LASERSHARK_FW_MAJOR_VERSION ||
+            b->fw_minor_version != LASERSHARK_FW_MINOR_VERSION) {
         printf("Your FW is not capable of proper bulk transfers or clear commands. Consider upgrading your firmware!\n");
     } else {
         printf("Firmware supports ring buffer clears. Clearing now.\n");
-        rc = clear_ringbuffer(devh_ctl);
+        rc = ls_device_clear_ringbuffer(b->dev);
         if (rc != LASERSHARK_CMD_SUCCESS) {
             printf("Clearing ringbuffer buffer failed.\n");
-            goto out; 
+            return rc;
         }
     }
 
-    max_iso_data_len = libusb_get_max_iso_packet_size(libusb_get_device(devh_data), (4 | LIBUSB_ENDPOINT_OUT));
-    printf("Max iso data packet length according to descriptors: %d\n", max_iso_data_len);
+    b->max_iso_data_len = ls_device_get_max_iso_packet_size(b->dev, LASERSHARK_ISO_ENDPOINT);
+    printf("Max iso data packet length according to descriptors: %d\n", b->max_iso_data_len);
 
 
-    rc = get_samp_element_count(devh_ctl, &lasershark_samp_element_count);
+    rc = ls_device_get_samp_element_count(b->dev, &b->samp_element_count);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting sample element count failed\n");
-        goto out;
+        return rc;
+    }
+    printf("Getting sample element count: %d\n", b->samp_element_count);
+    if (b->samp_element_count != LASERJACK_SAMPLE_ELEMENTS)
+    {
+        printf("Only Lasershark V2.X modules with %d element samples are supported\n", LASERJACK_SAMPLE_ELEMENTS);
+        return LASERSHARK_CMD_FAIL;
     }
-    printf("Getting sample element count: %d\n", lasershark_samp_element_count);
 
 
-    rc = get_iso_packet_sample_count(devh_ctl, &lasershark_iso_packet_sample_count);
+    rc = ls_device_get_iso_packet_sample_count(b->dev, &b->iso_packet_sample_count);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting iso packet sample count failed\n");
-        goto out;
+        return rc;
     }
-    printf("Getting iso packet sample count: %d\n", lasershark_iso_packet_sample_count);
+    printf("Getting iso packet sample count: %d\n", b->iso_packet_sample_count);
 
 
-    rc = get_max_ilda_rate(devh_ctl, &lasershark_max_ilda_rate);
+    rc = ls_device_get_max_ilda_rate(b->dev, &b->max_ilda_rate);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting max ilda rate failed\n");
-        goto out;
+        return rc;
     }
-    printf("Getting max ilda rate: %u pps\n", lasershark_max_ilda_rate);
+    printf("Getting max ilda rate: %u pps\n", b->max_ilda_rate);
 
 
-    rc = get_dac_min(devh_ctl, &lasershark_dac_min_val);
+    rc = ls_device_get_dac_min(b->dev, &b->dac_min_val);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting dac min failed\n");
-        goto out;
+        return rc;
     }
-    printf("Getting dac min: %d\n", lasershark_dac_min_val);
+    printf("Getting dac min: %d\n", b->dac_min_val);
 
 
-    rc = get_dac_max(devh_ctl, &lasershark_dac_max_val);
+    rc = ls_device_get_dac_max(b->dev, &b->dac_max_val);
     if (rc != LASERSHARK_CMD_SUCCESS) {
         printf("Getting dac max failed\n");
-        goto out;
+        return rc;
     }
-    printf("getting dac max: %d\n", lasershark_dac_max_val);
+    printf("getting dac max: %d\n", b->dac_max_val);
+
+    jack_convert_init(&b->converter, b->dac_min_val, b->dac_max_val);
+    printf("Converting samples with the %s kernel\n", b->converter.kernel_name);
 
 
-    rc = get_ringbuffer_sample_count(devh_ctl, &lasershark_ringbuffer_sample_count);
+    rc = ls_device_get_ringbuffer_sample_count(b->dev, &b->ringbuffer_sample_count);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting ringbuffer sample count\n");
-        goto out;
+        return rc;
     }
-    printf("Getting ringbuffer sample count: %d\n", lasershark_ringbuffer_sample_count);
+    printf("Getting ringbuffer sample count: %d\n", b->ringbuffer_sample_count);
 
 
-    rc = get_ringbuffer_empty_sample_count(devh_ctl, &temp);
+    rc = ls_device_get_ringbuffer_empty_sample_count(b->dev, &temp);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Getting ringbuffer empty sample count failed. (Consider upgrading your firmware)\n");
     }
     printf("Getting ringbuffer empty sample count: %d\n", temp);
 
+    return LASERSHARK_CMD_SUCCESS;
+}
 
-    jack_status_t jack_status;
-    jack_options_t  jack_options = JackNullOption;
 
-    if ((client = jack_client_open(jack_client_name, jack_options, &jack_status)) == 0)
+/*
+Registers a board's port group. A lone board keeps the original port names
+so existing connections still work, more than one get a board<N>_ prefix.
+Returns false if a port couldn't be registered.
+*/
+static bool register_board_ports(struct board *b)
+{
+    char name[32];
+    const char *prefix = "";
+    char board_prefix[16];
+
+    if (board_count > 1)
     {
-        fprintf (stderr, "JACK server not running? FSCK!\n");
-        goto out;
+        snprintf(board_prefix, sizeof(board_prefix), "board%d_", b->index);
+        prefix = board_prefix;
     }
 
+    snprintf(name, sizeof(name), "%sin_x", prefix);
+    b->in_x = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%sin_y", prefix);
+    b->in_y = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%sin_g", prefix);
+    b->in_r = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%sin_r", prefix);
+    b->in_g = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%sin_b", prefix);
+    b->in_b = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+
+    if (!b->in_x || !b->in_y || !b->in_r || !b->in_g || !b->in_b)
+    {
+        printf("Could not register ports for board %d\n", b->index);
+        return false;
+    }
 
-    jack_set_process_callback (client, process, 0);
-    jack_set_buffer_size_callback (client, bufsize, 0);
-    jack_set_sample_rate_callback (client, srate, 0);
-    jack_on_shutdown (client, jack_shutdown, 0);
+    return true;
+}
 
-    in_x = jack_port_register (client, "in_x", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_y = jack_port_register (client, "in_y", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_r = jack_port_register (client, "in_g", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_g = jack_port_register (client, "in_r", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_b = jack_port_register (client, "in_b", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
 
-    if (lasershark_ilda_rate == 0)
-    {
-        printf("ILDA rate wasn't specified by server.. unimplemented case.. dying\n");
-        goto out;
-    }
+/*
+Programs a board for the JACK rate, enables its output and allocates its
+transfer pool and ringbuffer.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int start_board(struct board *b)
+{
+    int rc;
+    uint32_t rate = atomic_load(&rate_change_rate);
 
-    rc = set_ilda_rate(devh_ctl, lasershark_ilda_rate);
+    rc = ls_device_set_ilda_rate(b->dev, rate);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("setting ILDA rate failed\n");
-        goto out;
+        return rc;
     }
-    printf("Setting ILDA rate worked: %u pps\n", lasershark_ilda_rate);
+    atomic_store(&b->ilda_rate, rate);
+    printf("Board %d: Setting ILDA rate worked: %u pps\n", b->index, rate);
 
+    drift_resampler_init(&b->resampler);
+    reset_board_estimates(b, time_portable_now_us());
+    if (target_latency_us)
+    {
+        printf("Pacing output to %.1f ms of latency (%u samples)\n", target_latency_us / 1000.0,
+               b->target_latency_samples);
+    }
 
-    rc = set_output(devh_ctl, LASERSHARK_CMD_OUTPUT_ENABLE);
+    rc = ls_device_set_output(b->dev, LASERSHARK_CMD_OUTPUT_ENABLE);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         printf("Enable output failed\n");
-        goto out;
+        return rc;
     }
     printf("Enable output worked\n");
 
 
-    laserjack_iso_data_packet_len = lasershark_iso_packet_sample_count * lasershark_samp_element_count * sizeof(uint16_t);
-    laserjack_iso_data_packet_buf = malloc(laserjack_iso_data_packet_len);
-    if (laserjack_iso_data_packet_buf == NULL)
+    b->iso_data_packet_len = b->iso_packet_sample_count * b->samp_element_count * sizeof(uint16_t);
+    if (b->iso_data_packet_len > b->max_iso_data_len)
     {
-        printf("Could not allocate laserjack iso data packet buffer\n");
-        goto out;
+        printf("Oversized iso write length. %d > %d\n", b->iso_data_packet_len, b->max_iso_data_len);
+        return LASERSHARK_CMD_FAIL;
+    }
+    b->iso_transfer_len = b->iso_data_packet_len * iso_packets_per_transfer;
+    b->iso_transfer_sample_count = b->iso_packet_sample_count * iso_packets_per_transfer;
+    printf("Sending %d ISO packet(s), %d samples, per transfer\n", iso_packets_per_transfer,
+           b->iso_transfer_sample_count);
+    init_latency(b);
+
+    b->iso_pool = iso_pool_create(b->dev, LASERSHARK_ISO_ENDPOINT, ISO_POOL_TRANSFERS, iso_packets_per_transfer,
+                                  b->iso_data_packet_len, WriteAsyncCallback, b);
+    if (b->iso_pool == NULL)
+    {
+        printf("Could not allocate ISO transfer pool\n");
+        return LASERSHARK_CMD_FAIL;
     }
 
-    jack_rb_len = laserjack_iso_data_packet_len * JACK_RB_PACKETS;
-    jack_rb = jack_ringbuffer_create(jack_rb_len);
-    if (jack_rb == NULL)
+    b->jack_rb = jack_ringbuffer_create(b->iso_data_packet_len * JACK_RB_PACKETS);
+    if (b->jack_rb == NULL)
     {
         printf("Could not allocate JACK ringbuffer\n");
-        goto out;
+        return LASERSHARK_CMD_FAIL;
     }
 
 
     // lock the buffer into memory, this is *NOT* realtime safe, do it before
     // using the buffer!
-    rc = jack_ringbuffer_mlock(jack_rb);
+    rc = jack_ringbuffer_mlock(b->jack_rb);
     if (rc)
     {
         printf("Could not lock JACK ringbuffer memory\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+void print_help(const char* prog_name, FILE* stream)
+{
+    fprintf(stream, "%s [OPTION]\n", prog_name);
+    fprintf(stream, "\t-A <CPU>\n");
+    fprintf(stream, "\t\tPin the USB event thread to this CPU (default any)\n");
+    fprintf(stream, "\t-D");
+    fprintf(stream, "\tResample slightly to make up for the JACK and Lasershark clocks drifting\n");
+    fprintf(stream, "\t\tapart, keeping latency steady over long runs\n");
+    fprintf(stream, "\t-E <Priority>\n");
+    fprintf(stream, "\t\tRealtime priority of the USB event thread\n");
+    fprintf(stream, "\t\t(0 for normal scheduling, 1-99, default %d)\n", USB_EVENTS_PRIORITY_DEFAULT);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-L <Latency in ms>\n");
+    fprintf(stream, "\t\tHold samples back to keep about this much output queued\n");
+    fprintf(stream, "\t\t(0-%d, default 0 sends as fast as they arrive)\n", TARGET_LATENCY_MAX_MS);
+    fprintf(stream, "\t-n");
+    fprintf(stream, "\tDrive simulated Lasersharks instead of real hardware\n");
+    fprintf(stream, "\t-P <Packet count>\n");
+    fprintf(stream, "\t\tNumber of ISO packets per transfer (1-%d, default %d)\n",
+            ISO_PACKETS_MAX, ISO_PACKETS_DEFAULT);
+    fprintf(stream, "\t\tMore packets means fewer transfers and callbacks per second,\n");
+    fprintf(stream, "\t\tbut samples wait until a whole transfer's worth has arrived\n");
+    fprintf(stream, "\t-s <Serial number>\n");
+    fprintf(stream, "\t\tDrive the Lasershark with this serial number. Repeat for up to %d\n", MAX_BOARDS);
+    fprintf(stream, "\t\tboards, each gets board<N>_in_* ports in the order given\n");
+    fprintf(stream, "\t\t(default the first Lasershark found, with plain in_* ports)\n");
+    fprintf(stream, "\t-T <Transfer count>\n");
+    fprintf(stream, "\t\tNumber of ISO transfers to keep queued per board (1-%d, default %d)\n",
+            ISO_POOL_TRANSFERS, ISO_QUEUE_DEFAULT);
+    fprintf(stream, "Send SIGUSR2 while running to print the error and drop counters\n");
+}
+
+
+int main (int argc, char *argv[])
+{
+    int rc = 0;
+    struct timeval tv;
+    struct timespec timeout;
+    uint64_t last_sync_us = 0;
+    int i, j, signum;
+    int in_use;
+    struct board *b;
+    int64_t queued;
+    bool latency_changed;
+
+    int Aflag = 0;
+    int Dflag = 0;
+    int Eflag = 0;
+    int hflag = 0;
+    int Lflag = 0;
+    int nflag = 0;
+    int Pflag = 0;
+    int sflag = 0;
+    int Tflag = 0;
+    bool usb_initialized = false;
+    int target_latency_ms = 0;
+    int c;
+
+    opterr_portable = 1;
+    while (-1 != (c = getopt_portable(argc, argv, "A:DE:hL:nP:s:T:"))) {
+        switch(c) {
+        case 'A':
+            Aflag++;
+            usb_events_cpu = atoi(optarg_portable);
+            break;
+        case 'D':
+            Dflag++;
+            break;
+        case 'E':
+            Eflag++;
+            usb_events_priority = atoi(optarg_portable);
+            break;
+        case 'h':
+            hflag++;
+            break;
+        case 'L':
+            Lflag++;
+            target_latency_ms = atoi(optarg_portable);
+            break;
+        case 'n':
+            nflag++;
+            break;
+        case 'P':
+            Pflag++;
+            iso_packets_per_transfer = atoi(optarg_portable);
+            break;
+        case 's':
+            // May be given once per board.
+            if (sflag < MAX_BOARDS)
+            {
+                boards[sflag].requested_serial = optarg_portable;
+            }
+            sflag++;
+            break;
+        case 'T':
+            Tflag++;
+            iso_queue_target = atoi(optarg_portable);
+            break;
+        default:
+            print_help(argv[0], stderr);
+            exit(1);
+        }
+    }
+
+    if (Aflag > 1 || Dflag > 1 || Eflag > 1 || hflag > 1 || Lflag > 1 || nflag > 1 || Pflag > 1 || Tflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
+    }
+
+    if (sflag > MAX_BOARDS) {
+        fprintf(stderr, "Cannot drive more than %d boards\n", MAX_BOARDS);
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+    for (i = 0; i < sflag; i++) {
+        for (j = 0; j < i; j++) {
+            if (0 == strncmp(boards[i].requested_serial, boards[j].requested_serial, LASERSHARK_SERIALNUM_LEN)) {
+                fprintf(stderr, "Serial number %s given more than once\n", boards[i].requested_serial);
+                exit(1);
+            }
+        }
+    }
+    // Without -s the first board found is used.
+    board_count = sflag ? sflag : 1;
+    for (i = 0; i < board_count; i++) {
+        boards[i].index = i;
+    }
+
+    if (target_latency_ms < 0 || target_latency_ms > TARGET_LATENCY_MAX_MS) {
+        fprintf(stderr, "Target latency must be between 0 and %d ms\n", TARGET_LATENCY_MAX_MS);
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+    target_latency_us = (uint64_t)target_latency_ms * 1000;
+    drift_enabled = Dflag;
+    track_occupancy = target_latency_us || drift_enabled;
+
+    if (iso_queue_target < 1 || iso_queue_target > ISO_POOL_TRANSFERS) {
+        fprintf(stderr, "Transfer count must be between 1 and %d\n", ISO_POOL_TRANSFERS);
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (iso_packets_per_transfer < 1 || iso_packets_per_transfer > ISO_PACKETS_MAX) {
+        fprintf(stderr, "Packet count must be between 1 and %d\n", ISO_PACKETS_MAX);
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (Aflag && (usb_events_cpu < 0 || usb_events_cpu >= sysconf(_SC_NPROCESSORS_CONF))) {
+        fprintf(stderr, "CPU must be between 0 and %ld\n", sysconf(_SC_NPROCESSORS_CONF) - 1);
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (usb_events_priority < 0 || usb_events_priority > sched_get_priority_max(SCHED_FIFO)) {
+        fprintf(stderr, "Priority must be between 0 and %d\n", sched_get_priority_max(SCHED_FIFO));
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    sem_init(&usb_writer_wake, 0, 0);
+
+    rt_log = rt_log_create(log_events, LOG_EVENTS, LOG_SOURCES, LOG_DEPTH);
+    if (rt_log == NULL)
+    {
+        fprintf(stderr, "Could not allocate the log\n");
+        exit(1);
+    }
+
+    char jack_client_name[] = "lasershark";
+
+
+    pid = getpid();
+    // Block these before libusb and JACK start threads so they all inherit
+    // the mask, then main() picks them up with sigtimedwait().
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+
+    if (!nflag)
+    {
+        // One context for every board, so one event thread services them all.
+        rc = libusb_init(NULL);
+        if (rc < 0)
+        {
+            fprintf(stderr, "Error initializing libusb: %d\n", /*libusb_error_name(rc)*/rc);
+            exit(1);
+        }
+        usb_initialized = true;
+
+        libusb_set_debug(NULL, 3);
+        ls_discovery_init();
+    }
+
+    for (i = 0; i < board_count; i++)
+    {
+        rc = open_board(&boards[i], nflag);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            goto out;
+        }
+    }
+
+
+    jack_status_t jack_status;
+    jack_options_t  jack_options = JackNullOption;
+
+    if ((client = jack_client_open(jack_client_name, jack_options, &jack_status)) == 0)
+    {
+        fprintf (stderr, "JACK server not running? FSCK!\n");
         goto out;
     }
 
-    if (jack_activate (client))
+
+    jack_set_process_callback (client, process, 0);
+    jack_set_buffer_size_callback (client, bufsize, 0);
+    jack_set_sample_rate_callback (client, srate, 0);
+    jack_set_latency_callback (client, latency, 0);
+    jack_on_shutdown (client, jack_shutdown, 0);
+
+    for (i = 0; i < board_count; i++)
     {
-        fprintf (stderr, "Cannot activate JACK client");
+        if (!register_board_ports(&boards[i]))
+        {
+            goto out;
+        }
+    }
+
+    if (atomic_load(&rate_change_rate) == 0)
+    {
+        printf("ILDA rate wasn't specified by server.. unimplemented case.. dying\n");
         goto out;
     }
 
+    for (i = 0; i < board_count; i++)
+    {
+        rc = start_board(&boards[i]);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            goto out;
+        }
+    }
+
+    if (!start_thread(&usb_events, usb_events_thread, usb_events_priority, usb_events_cpu, "USB event"))
+    {
+        goto out;
+    }
+    usb_events_started = true;
 
-    sigemptyset (&mask);
-    sigaddset (&mask, SIGUSR1);
+    if (!start_thread(&usb_writer, usb_writer_thread, USB_WRITER_PRIORITY, -1, "USB writer"))
+    {
+        goto out;
+    }
+    usb_writer_started = true;
 
-    sigprocmask (SIG_BLOCK, &mask, &oldmask);
+    if (jack_activate (client))
+    {
+        fprintf (stderr, "Cannot activate JACK client");
+        goto out;
+    }
 
 
     printf("Running\n");
-    do
+    while (!do_exit)
     {
-	libusb_handle_events(0); // Quick hack.. this should be made better later.
-        //sigsuspend (&oldmask);
-        //printf("Looping... (Must have recieved a signal, don't panic).\n");
+        // Wake up often enough to print what the realtime threads logged,
+        // to keep the writer's occupancy estimates honest and to measure the
+        // latency reported to JACK.
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = LOG_DRAIN_INTERVAL_US * 1000;
+        signum = sigtimedwait(&mask, NULL, &timeout);
+
+        if (signum > 0)
+        {
+            handle_signal(signum);
+        }
+        else if (time_portable_now_us() - last_sync_us >= OCCUPANCY_SYNC_INTERVAL_US)
+        {
+            latency_changed = false;
+            for (i = 0; i < board_count; i++)
+            {
+                queued = post_occupancy_sync(&boards[i]);
+                if (queued >= 0 && update_latency(&boards[i], queued))
+                {
+                    latency_changed = true;
+                }
+            }
+            if (latency_changed)
+            {
+                jack_recompute_total_latencies(client);
+            }
+            last_sync_us = time_portable_now_us();
+        }
+        rt_log_drain(rt_log, stdout);
     }
-    while (!do_exit);
-    //sigprocmask (SIG_UNBLOCK, &mask, NULL);
 
 
     printf("Quitting gracefully\n");
+    for (i = 0; i < board_count; i++)
+    {
+        printf("Board %d: ISO transfer pool ran dry %u times\n", i, iso_pool_exhausted(boards[i].iso_pool));
+        if (drift_enabled)
+        {
+            drift_controller_print_stats(&boards[i].drift);
+        }
+    }
+    rt_log_print_counters(rt_log, stdout);
 
 // THINGS COME HERE TO DIE!!!!!!!!!!!!!!!!!!!
 out:
-    libusb_release_interface(devh_ctl, 0);
-    libusb_release_interface(devh_data, 0);
+    if (client)
+    {
+        jack_client_close(client);
+    }
 
-out_post_release:
-    if (devh_ctl)
+    do_exit = 1;
+    if (usb_writer_started)
     {
-        libusb_close(devh_ctl);
+        sem_post(&usb_writer_wake);
+        pthread_join(usb_writer, NULL);
     }
-    if (devh_data)
+    if (usb_events_started)
     {
-        libusb_close(devh_data);
+        ls_device_interrupt_events(boards[0].dev);
+        pthread_join(usb_events, NULL);
     }
-    libusb_exit(NULL);
 
-    if (jack_rb != NULL)
+    // Nothing submits or handles events anymore, wait for what is in flight
+    // to come back. Events are handled for every board at once.
+    for (j = 0; j < ISO_POOL_REAP_TRIES; j++)
     {
-        jack_ringbuffer_free(jack_rb);
+        in_use = 0;
+        for (i = 0; i < board_count; i++)
+        {
+            in_use += boards[i].iso_pool ? iso_pool_in_use(boards[i].iso_pool) : 0;
+        }
+        if (in_use == 0)
+        {
+            break;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        ls_device_handle_events(boards[0].dev, &tv);
     }
 
-    if (laserjack_iso_data_packet_buf != NULL)
+    for (i = 0; i < board_count; i++)
+    {
+        b = &boards[i];
+        if (b->iso_pool && iso_pool_in_use(b->iso_pool))
+        {
+            // Can't safely free transfers libusb still owns.
+            printf("Board %d: Could not reap %d ISO transfers\n", i, iso_pool_in_use(b->iso_pool));
+            b->iso_pool = NULL;
+        }
+        ls_device_close(b->dev);
+
+        if (b->jack_rb != NULL)
+        {
+            jack_ringbuffer_free(b->jack_rb);
+        }
+        iso_pool_destroy(b->iso_pool);
+    }
+    if (usb_initialized)
     {
-        free(laserjack_iso_data_packet_buf);
+        ls_discovery_exit();
+        libusb_exit(NULL);
     }
 
+    // Whatever was logged on the way down.
+    rt_log_drain(rt_log, stdout);
+    rt_log_destroy(rt_log);
+    sem_destroy(&usb_writer_wake);
+
 
     return rc;
 }
-
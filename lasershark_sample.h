@@ -0,0 +1,36 @@
+/*
+lasershark_sample.h - Sample layout used by Lasershark bulk transfers.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LASERSHARK_SAMPLE_H
+#define LASERSHARK_SAMPLE_H
+
+#include <stdbool.h>
+
+struct lasershark_sample
+{
+    unsigned short a	: 12;
+    unsigned short pad	: 2;
+    bool c	: 1;
+    bool intl_a	: 1;
+    unsigned short b	: 16;
+    unsigned short x	: 16;
+    unsigned short y	: 16;
+} __attribute__((packed));
+
+#endif
@@ -27,62 +27,189 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <inttypes.h>
 #include <math.h>
 #include <libusb.h>
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <signal.h>
 #endif
 #include <time.h>
+#include <pthread.h>
 #include "lasersharklib/lasershark_lib.h"
-#include "getline_portable.h"
+#include "blockreader_portable.h"
 #include "getopt_portable.h"
+#include "bulk_stream.h"
+#include "lasershark_sample.h"
+#include "sample_parse.h"
+#include "spsc_ring.h"
+#include "time_portable.h"
+#include "occupancy_model.h"
+#include "lasershark_device.h"
+#include "lasershark_discovery.h"
+#include "show_file.h"
+#include "frame_swap.h"
+// Number of bulk transfers kept in flight unless overridden with -t
+#define BULK_TRANSFERS_DEFAULT 4
+#define BULK_TRANSFERS_MAX 64
+// Device packets sent per bulk transfer unless overridden with -c
+#define COALESCE_PACKETS_DEFAULT 1
+#define COALESCE_PACKETS_MAX 64
+
+volatile int do_exit = 0;
+
+
+// Every board must agree on these, the input is parsed once for all of them.
+uint32_t lasershark_bulk_packet_sample_count;
+uint32_t lasershark_dac_max_val;
 
+int bulk_transfer_count = BULK_TRANSFERS_DEFAULT;
+int coalesce_packets = COALESCE_PACKETS_DEFAULT;
 
-#define LASERSHARK_VID 0x1fc9
-#define LASERSHARK_PID 0x04d8
-
-// Bulk timeout in ms
-#define BULK_TIMEOUT 100
-
-int do_exit = 0;
-
-
-int lasershark_serialnum_len = 64;
-unsigned char lasershark_serialnum[64];
-uint32_t lasershark_fw_major_version = 0;
-uint32_t lasershark_fw_minor_version = 0;
-
+// Bytes pulled from stdin per read
+#define INPUT_BLOCK_SIZE (64*1024)
+struct blockreader *input = NULL;
 
-uint32_t lasershark_bulk_packet_sample_count;
-uint32_t lasershark_samp_element_count;
-uint32_t lasershark_max_ilda_rate;
-uint32_t lasershark_dac_min_val;
-uint32_t lasershark_dac_max_val;
 
-uint32_t lasershark_ringbuffer_sample_count;
+uint64_t line_number = 0;
+bool binary_input = false;
 
-uint32_t lasershark_ilda_rate = 0;
 
-struct libusb_device_handle *ls_devh = NULL;
+// Queue of blocks handed from the reader thread to each USB writer, in input order
+#define INPUT_QUEUE_DEFAULT 64
+#define INPUT_QUEUE_MAX 65536
+// How long a thread sleeps when a queue is full (reader) or empty (writer), in us
+#define INPUT_QUEUE_POLL_US 200
+uint32_t input_queue_depth = INPUT_QUEUE_DEFAULT;
 
+enum block_type
+{
+    BLOCK_SAMPLES,
+    BLOCK_SET_ILDA_RATE,
+    BLOCK_SET_OUTPUT,
+    BLOCK_FLUSH,
+    BLOCK_PRINT,
+    BLOCK_LOOP,
+    BLOCK_END
+};
 
-uint64_t line_number = 0;
+/*
+A frame defined with "b=" ... "d=". Its samples are stored once and every
+board's writer sends them straight from here each time the frame is looped,
+so static content doesn't come through the pipe over and over. Shared by
+the boards, the last reference frees it.
+*/
+struct frame
+{
+    atomic_int refs;
+    uint32_t sample_count;
+    uint32_t capacity;
+    struct lasershark_sample *samples;
+};
 
+struct block
+{
+    enum block_type type;
+    // Sample count, ilda rate, output enable state or loop count depending on type
+    uint32_t val;
+    // Text for BLOCK_PRINT, malloc'd by the reader and freed by the writer
+    char *text;
+    // Frame for BLOCK_LOOP, holding a reference for the writer
+    struct frame *frame;
+    // Input line (or binary record) the block came from
+    uint64_t line_number;
+    struct lasershark_sample samples[];
+};
+
+pthread_t reader;
+
+// Reader side. The frame being defined, and the last one defined, which "l=" loops.
+struct frame *new_frame = NULL;
+struct frame *loop_frame = NULL;
+// Whether the last block queued loops a frame until more input arrives
+bool looping_forever = false;
+// Set by -F. Each frame defined goes to every board's frame swap instead of
+// being looped with "l=", and the boards draw the newest one continuously.
+bool swap_frames = false;
+// Frames hold at most this many samples
+#define FRAME_SAMPLES_MAX (1U << 24)
+
+
+// Flushes sleep until the ringbuffer should have drained, plus this much so
+// the confirming query usually finds it empty, in us.
+#define FLUSH_SLACK_US 500
+// Shortest and longest sleep between ringbuffer queries while flushing, in us.
+#define FLUSH_SLEEP_MIN_US 250
+#define FLUSH_SLEEP_MAX_US 1000000
+
+// Submissions are held back to keep roughly this much queued, in us. 0 sends
+// as fast as USB allows.
+#define TARGET_LATENCY_MAX_MS 10000
+uint64_t target_latency_us = 0;
+// Longest single wait while holding back samples, in us. Bounds how quickly a
+// set do_exit flag is noticed.
+#define PACE_WAIT_MAX_US 100000
+
+// Most boards -l reports.
+#define LIST_MAX_LASERSHARKS 64
+
+// Show file played with -f instead of reading stdin, and the section to start at.
+struct show_file *show = NULL;
+long show_section = -1;
 
-struct lasershark_sample
+/*
+Everything about one Lasershark. The reader parses the input once and either
+copies every block to each board's queue or, with -R, routes samples by
+their board field. Each board has its own USB writer thread draining its
+queue into its own bulk stream. The queues absorb short hiccups, but a board
+that keeps falling behind holds the reader up and with it every other board.
+*/
+#define MAX_BOARDS 8
+struct board
 {
-    unsigned short a	: 12;
-    unsigned short pad	: 2;
-    bool c	: 1;
-    bool intl_a	: 1;
-    unsigned short b	: 16;
-    unsigned short x	: 16;
-    unsigned short y	: 16;
-} __attribute__((packed)) *samples;
-uint32_t current_sample_entry = 0;
+    int index;
+    const char *requested_serial;
+    struct ls_device *dev;
+    struct bulk_stream *bulk;
+    struct spsc_ring *queue;
+    // Only with -F
+    struct frame_swap *swap;
+
+    uint32_t max_ilda_rate;
+    uint32_t ringbuffer_sample_count;
+    uint32_t ilda_rate;
+
+    // Samples queued ahead of the output, as estimated between ringbuffer queries.
+    struct occupancy_model occupancy;
+
+    // Reader side. Samples collected for this board until they fill a packet.
+    struct lasershark_sample *samples;
+    uint32_t current_sample_entry;
+
+    // Writer side.
+    pthread_t writer;
+    bool writer_started;
+    // Samples copied into the bulk buffer being filled, not yet submitted
+    uint32_t coalesced_samples;
+    // Looped frames whose samples may still be in flight, each with the
+    // bulk_stream_submitted() count once its last packet went out.
+    struct frame *retired_frames[BULK_TRANSFERS_MAX];
+    uint64_t retired_submitted[BULK_TRANSFERS_MAX];
+    int retired_count;
+    uint64_t frames_looped;
+    uint32_t flush_count;
+    uint64_t flush_total_us;
+    uint64_t flush_max_us;
+};
+
+struct board boards[MAX_BOARDS];
+int board_count = 0;
+// Set by -R. Otherwise every board gets every block.
+bool route_samples = false;
 
 
 #ifdef _WIN32
@@ -130,122 +257,284 @@ static void sig_hdlr(int signum)
 }
 #endif
 
-static bool inline send_samples(unsigned int sample_count)
+static void queue_wait()
 {
-    int r, actual;
-    do {
-        r = libusb_bulk_transfer(ls_devh, (3 | LIBUSB_ENDPOINT_OUT), (unsigned char*)samples,
-                                 sizeof(struct lasershark_sample)*sample_count,
-                                 &actual, BULK_TIMEOUT);
-    } while (!do_exit && r == LIBUSB_ERROR_TIMEOUT);
+    time_portable_sleep_us(INPUT_QUEUE_POLL_US);
+}
 
-    if (r < 0 && r != LIBUSB_ERROR_TIMEOUT) {
-        fprintf(stderr, "Error sending sample packet: %s", libusb_error_name(r));
-        return false;
+
+static void frame_unref(struct frame *frame)
+{
+    if (frame != NULL && 1 == atomic_fetch_sub(&frame->refs, 1)) {
+        free(frame->samples);
+        free(frame);
     }
+}
 
-    return true;
+
+/*
+Reader side. Makes room for count more samples at the end of the frame being
+defined, returning where they go or NULL on failure.
+*/
+static struct lasershark_sample *frame_extend(struct frame *frame, uint32_t count)
+{
+    struct lasershark_sample *samples;
+    uint32_t capacity = frame->capacity ? frame->capacity : lasershark_bulk_packet_sample_count;
+
+    if (count > FRAME_SAMPLES_MAX - frame->sample_count) {
+        fprintf(stderr, "Frames can hold at most %u samples\n", FRAME_SAMPLES_MAX);
+        return NULL;
+    }
+    while (capacity < frame->sample_count + count) {
+        capacity *= 2;
+    }
+
+    if (capacity != frame->capacity) {
+        samples = realloc(frame->samples, sizeof(struct lasershark_sample)*capacity);
+        if (samples == NULL) {
+            fprintf(stderr, "Could not allocate frame.\n");
+            return NULL;
+        }
+        frame->samples = samples;
+        frame->capacity = capacity;
+    }
+
+    samples = &frame->samples[frame->sample_count];
+    frame->sample_count += count;
+    return samples;
+}
+
+
+/*
+Reader side. Waits for room in a board's queue. Returns NULL if asked to quit
+while waiting. The one reader feeds every board, so while it waits here no
+board gets new input: the slowest board sets the pace for all of them, with
+-R too.
+*/
+static struct block *claim_block(struct board *b)
+{
+    struct block *block;
+
+    while (NULL == (block = spsc_ring_claim(b->queue))) {
+        if (do_exit) {
+            return NULL;
+        }
+        queue_wait();
+    }
+
+    block->text = NULL;
+    block->frame = NULL;
+    block->line_number = line_number;
+    looping_forever = false;
+    return block;
 }
 
 
-// Sample integers are parsed this way vs scanf/etc for speed reasons.
-static bool inline parse_sample_integer(char* line, size_t len, unsigned int *pos, unsigned int *val)
+/*
+Reader side. Queues a command for every board, taking ownership of text.
+Prints only go to the first board so they show up once.
+*/
+static bool queue_command(enum block_type type, uint32_t val, char *text)
 {
-    unsigned int orig_pos = *pos;
-    *val = 0;
-    while (*pos < len && line[*pos] >= '0' && line[*pos] <= '9') {
-        *val = 10*(*val) + line[*pos]-'0';
-        (*pos)++;
-        if (*val > lasershark_dac_max_val) {
+    struct block *block;
+    int i, count = type == BLOCK_PRINT ? 1 : board_count;
+
+    for (i = 0; i < count; i++) {
+        block = claim_block(&boards[i]);
+        if (block == NULL) {
+            if (i == 0) {
+                free(text);
+            }
             return false;
         }
+
+        block->type = type;
+        block->val = val;
+        block->text = text;
+        spsc_ring_publish(boards[i].queue);
     }
 
-    return orig_pos != *pos;
+    return true;
 }
 
 
-static bool handle_sample(char* line, size_t len)
+/*
+Reader side. Queues the samples collected so far for src, to src alone with
+-R and to every board otherwise. Samples are staged outside the queues so
+that commands arriving before a packet fills up keep their place ahead of
+it, exactly as when everything ran on one thread.
+*/
+static bool queue_samples(struct board *src, unsigned int sample_count)
 {
-    unsigned int x, y, a, b, c, intl_a;
-    unsigned int pos;
-
-    // Lets make a giant if statement for fun
-    if (
-        len < 14 ||
-        (pos = 0, line[pos] != 's') || (pos++, line[pos] != '=') ||
-        (pos++, !parse_sample_integer(line, len, &pos, &x)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, !parse_sample_integer(line, len, &pos, &y)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, !parse_sample_integer(line, len, &pos, &a)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, !parse_sample_integer(line, len, &pos, &b)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, pos >= len) || (c=line[pos]-'0', c > 1) ||
-        (pos++, pos >= len) || line[pos] !=',' ||
-        (pos++, pos >= len) || (intl_a=line[pos]-'0', intl_a > 1)
-    ) {
-        fprintf(stderr, "Received bad sample command\n");
-        return false;
+    struct block *block;
+    int i, first, last;
+
+    first = route_samples ? src->index : 0;
+    last = route_samples ? src->index + 1 : board_count;
+    for (i = first; i < last; i++) {
+        block = claim_block(&boards[i]);
+        if (block == NULL) {
+            return false;
+        }
+
+        block->type = BLOCK_SAMPLES;
+        block->val = sample_count;
+        memcpy(block->samples, src->samples, sizeof(struct lasershark_sample)*sample_count);
+        spsc_ring_publish(boards[i].queue);
     }
 
-    samples[current_sample_entry].x = x;
-    samples[current_sample_entry].y = y;
-    samples[current_sample_entry].a = a;
-    samples[current_sample_entry].b = b;
-    samples[current_sample_entry].c = c;
-    samples[current_sample_entry].intl_a = intl_a;
+    return true;
+}
 
-    current_sample_entry++;
 
-    if (current_sample_entry == lasershark_bulk_packet_sample_count) {
-        current_sample_entry = 0;
-        return send_samples(lasershark_bulk_packet_sample_count);
+/*
+Reader side. Counts a sample just staged for b, queueing the packet once it
+is full.
+*/
+static bool sample_staged(struct board *b)
+{
+    b->current_sample_entry++;
+
+    if (b->current_sample_entry == lasershark_bulk_packet_sample_count) {
+        b->current_sample_entry = 0;
+        return queue_samples(b, lasershark_bulk_packet_sample_count);
     }
 
     return true;
 }
 
 
-static bool handle_set_ilda_rate(char* line, size_t len)
+// Reader side. With -F samples only come in frames.
+static bool samples_allowed(void)
 {
-    uint32_t rate = 0;
-    int rc;
-    if (1 != sscanf(line, "r=%u", &rate)) {
-        fprintf(stderr, "Received malformated ilda rate command\n");
+    if (swap_frames) {
+        fprintf(stderr, "Samples must be given in frames with -F\n");
+        return false;
+    }
+    return true;
+}
+
+
+static bool handle_sample(char* line, size_t len)
+{
+    struct board *b = &boards[0];
+    struct lasershark_sample sample;
+    uint32_t board;
+    struct lasershark_sample *frame_sample;
+
+    if (new_frame != NULL) {
+        if (!parse_sample_line(line, len, lasershark_dac_max_val, &sample)) {
+            fprintf(stderr, "Received bad sample command\n");
+            return false;
+        }
+        if (NULL == (frame_sample = frame_extend(new_frame, 1))) {
+            return false;
+        }
+        *frame_sample = sample;
+        return true;
+    }
+    if (!samples_allowed()) {
+        return false;
+    }
+
+    if (route_samples) {
+        if (!parse_routed_sample_line(line, len, lasershark_dac_max_val, board_count, &sample, &board)) {
+            fprintf(stderr, "Received bad sample command\n");
+            return false;
+        }
+        b = &boards[board];
+        b->samples[b->current_sample_entry] = sample;
+    } else if (!parse_sample_line(line, len, lasershark_dac_max_val, &b->samples[b->current_sample_entry])) {
+        fprintf(stderr, "Received bad sample command\n");
         return false;
     }
 
-    if (rate == 0 || rate > lasershark_max_ilda_rate) {
+    return sample_staged(b);
+}
+
+
+static bool do_set_ilda_rate(struct board *b, uint32_t rate)
+{
+    int rc;
+
+    if (rate == 0 || rate > b->max_ilda_rate) {
         fprintf(stderr, "Received ilda rate outside acceptable range\n");
     }
 
-    lasershark_ilda_rate = rate;
-    rc = set_ilda_rate(ls_devh, lasershark_ilda_rate);
+    b->ilda_rate = rate;
+    rc = ls_device_set_ilda_rate(b->dev, b->ilda_rate);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         fprintf(stderr, "setting ILDA rate failed\n");
         return false;
     }
-    printf("Setting ILDA rate worked: %u pps\n", lasershark_ilda_rate);
+    printf("Setting ILDA rate worked: %u pps\n", b->ilda_rate);
+    occupancy_model_set_rate(&b->occupancy, b->ilda_rate, time_portable_now_us());
 
     return true;
 }
 
 
-static bool handle_set_output(char*line, size_t len)
+/*
+Decodes the run of sample lines sitting in the input buffer in one go.
+Anything the batch parser stops at is left for process_line(), so bad lines
+get reported exactly as if they had been read one at a time. Routed lines
+and frame definitions always go through process_line().
+*/
+static bool handle_sample_run()
 {
-    uint32_t enable = 0;
-    int rc;
+    struct board *b = &boards[0];
+    char *data;
+    size_t avail, used;
+    uint32_t count;
 
-    if (1 != sscanf(line, "e=%u", &enable)) {
-        fprintf(stderr, "Received malfored enable command\n");
+    if (route_samples || swap_frames || new_frame != NULL) {
+        return true;
+    }
+
+    avail = blockreader_peek(input, &data);
+    while (!do_exit && avail > 0 && data[0] == 's') {
+        used = parse_sample_lines(data, avail, lasershark_dac_max_val, &b->samples[b->current_sample_entry],
+                                  lasershark_bulk_packet_sample_count - b->current_sample_entry, &count);
+        if (count == 0) {
+            break;
+        }
+
+        blockreader_consume(input, used);
+        data += used;
+        avail -= used;
+        line_number += count;
+        b->current_sample_entry += count;
+
+        if (b->current_sample_entry == lasershark_bulk_packet_sample_count) {
+            b->current_sample_entry = 0;
+            if (!queue_samples(b, lasershark_bulk_packet_sample_count)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+static bool handle_set_ilda_rate(char* line, size_t len)
+{
+    uint32_t rate = 0;
+    if (1 != sscanf(line, "r=%u", &rate)) {
+        fprintf(stderr, "Received malformated ilda rate command\n");
         return false;
     }
 
+    return queue_command(BLOCK_SET_ILDA_RATE, rate, NULL);
+}
+
+
+static bool do_set_output(struct board *b, uint32_t enable)
+{
+    int rc;
 
-    rc = set_output(ls_devh, enable ? LASERSHARK_CMD_OUTPUT_ENABLE : LASERSHARK_CMD_OUTPUT_DISABLE);
+    rc = ls_device_set_output(b->dev, enable ? LASERSHARK_CMD_OUTPUT_ENABLE : LASERSHARK_CMD_OUTPUT_DISABLE);
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
         fprintf(stderr, "Setting output failed\n");
@@ -258,56 +547,246 @@ static bool handle_set_output(char*line, size_t len)
 }
 
 
+static bool handle_set_output(char*line, size_t len)
+{
+    uint32_t enable = 0;
+
+    if (1 != sscanf(line, "e=%u", &enable)) {
+        fprintf(stderr, "Received malfored enable command\n");
+        return false;
+    }
+
+    return queue_command(BLOCK_SET_OUTPUT, enable, NULL);
+}
+
+
 static bool handle_print(char* line, size_t len)
 {
     bool rc = false;
+    char *text;
     if (len > 2 && line[1] == '=') {
-        printf("PRINT: %s", line+2);
-        rc = true;
+        text = strdup(line+2);
+        rc = text != NULL && queue_command(BLOCK_PRINT, 0, text);
     }
     return rc;
 }
 
 
-static bool handle_flush(char* line, size_t len)
+/*
+Reader side. Pushes out every partial packet, so it goes ahead of what is
+queued next.
+*/
+static bool queue_staged_samples(void)
 {
-    int rc;
-    uint32_t empty_samples;
+    struct board *b;
+    int i;
+
+    for (i = 0; i < board_count; i++) {
+        b = &boards[i];
+        if (b->current_sample_entry != 0) {
+            if (!queue_samples(b, b->current_sample_entry)) {
+                return false;
+            }
+        }
+        b->current_sample_entry = 0;
+    }
+
+    return true;
+}
+
+
+static bool queue_flush(void)
+{
+    return queue_staged_samples() && queue_command(BLOCK_FLUSH, 0, NULL);
+}
+
+
+static bool begin_frame(void)
+{
+    if (route_samples) {
+        fprintf(stderr, "Frames cannot be used with -R\n");
+        return false;
+    }
+    if (new_frame != NULL) {
+        fprintf(stderr, "Already defining a frame\n");
+        return false;
+    }
+
+    new_frame = calloc(1, sizeof(struct frame));
+    if (new_frame == NULL) {
+        fprintf(stderr, "Could not allocate frame.\n");
+        return false;
+    }
+    atomic_init(&new_frame->refs, 1);
+    return true;
+}
+
+
+/*
+Makes the frame just defined the one "l=" loops. The previous one lives on
+until the writers are done with it.
+*/
+static bool end_frame(void)
+{
+    int i;
+
+    if (new_frame == NULL) {
+        fprintf(stderr, "No frame is being defined\n");
+        return false;
+    }
+    if (new_frame->sample_count == 0) {
+        fprintf(stderr, "Frame has no samples\n");
+        return false;
+    }
+
+    if (swap_frames) {
+        for (i = 0; i < board_count; i++) {
+            if (!frame_swap_submit(boards[i].swap, new_frame->samples, new_frame->sample_count)) {
+                fprintf(stderr, "Could not allocate frame.\n");
+                return false;
+            }
+        }
+        frame_unref(new_frame);
+        new_frame = NULL;
+        return true;
+    }
+
+    frame_unref(loop_frame);
+    loop_frame = new_frame;
+    new_frame = NULL;
+    return true;
+}
+
+
+/*
+Reader side. Queues count repetitions of the last frame for every board, 0
+meaning until more input arrives.
+*/
+static bool queue_loop(uint32_t count)
+{
+    struct block *block;
+    int i;
+
+    if (swap_frames) {
+        fprintf(stderr, "Frames play continuously with -F, they aren't looped\n");
+        return false;
+    }
+    if (loop_frame == NULL || new_frame != NULL) {
+        fprintf(stderr, "Frames must be defined before they are looped\n");
+        return false;
+    }
+    if (!queue_staged_samples()) {
+        return false;
+    }
 
-    if (current_sample_entry != 0) {
-        if (!send_samples(current_sample_entry)) {
+    for (i = 0; i < board_count; i++) {
+        block = claim_block(&boards[i]);
+        if (block == NULL) {
             return false;
         }
+
+        block->type = BLOCK_LOOP;
+        block->val = count;
+        block->frame = loop_frame;
+        atomic_fetch_add(&loop_frame->refs, 1);
+        spsc_ring_publish(boards[i].queue);
+    }
+    looping_forever = (count == 0);
+
+    return true;
+}
+
+
+static bool handle_loop(char* line, size_t len)
+{
+    uint32_t count = 0;
+
+    if (1 != sscanf(line, "l=%u", &count)) {
+        fprintf(stderr, "Received malformed loop command\n");
+        return false;
+    }
+
+    return queue_loop(count);
+}
+
+
+/*
+Waits for everything sent so far to be displayed. Rather than polling, each
+ringbuffer query is followed by a sleep lasting as long as the reported
+backlog takes to play out at the current ilda rate.
+*/
+static bool do_flush(struct board *b)
+{
+    int rc;
+    uint32_t empty_samples, queued_samples;
+    uint32_t queries = 0;
+    uint64_t start_us, drained_us, elapsed_us, sleep_us;
+
+    if (b->index == 0) {
+        printf("Flushing...\n");
+    }
+    start_us = time_portable_now_us();
+    if (!bulk_stream_wait_idle(b->bulk, &do_exit) && !do_exit) {
+        fprintf(stderr, "Error sending sample packet: %s\n", libusb_error_name(bulk_stream_error(b->bulk)));
+        return false;
     }
+    drained_us = time_portable_now_us();
 
-    current_sample_entry = 0;
-    printf("Flushing...\n");
     while (1) {
-        rc = get_ringbuffer_empty_sample_count(ls_devh, &empty_samples);
+        rc = ls_device_get_ringbuffer_empty_sample_count(b->dev, &empty_samples);
         if (rc != LASERSHARK_CMD_SUCCESS)
         {
             fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
             return false;
         }
+        queries++;
 
-        if (do_exit || empty_samples == lasershark_ringbuffer_sample_count) {
+        if (do_exit || empty_samples >= b->ringbuffer_sample_count) {
             break;
         }
 
-        // TODO: Use something better than sleep
-#ifdef _WIN32
-        Sleep(1000);
-#else
-        sleep(1);
-#endif
-        printf("still flushing...\n");
+        queued_samples = b->ringbuffer_sample_count - empty_samples;
+        if (b->ilda_rate) {
+            sleep_us = (uint64_t)queued_samples * 1000000 / b->ilda_rate + FLUSH_SLACK_US;
+        } else {
+            sleep_us = FLUSH_SLEEP_MAX_US;
+        }
+        if (sleep_us < FLUSH_SLEEP_MIN_US) {
+            sleep_us = FLUSH_SLEEP_MIN_US;
+        } else if (sleep_us > FLUSH_SLEEP_MAX_US) {
+            sleep_us = FLUSH_SLEEP_MAX_US;
+            printf("still flushing...\n");
+        }
+        time_portable_sleep_us(sleep_us);
     }
 
-    printf("Flush done\n");
+    if (!do_exit) {
+        // Nothing in flight and nothing in the ringbuffer.
+        occupancy_model_sync(&b->occupancy, 0, time_portable_now_us());
+    }
+
+    elapsed_us = time_portable_now_us() - start_us;
+    b->flush_count++;
+    b->flush_total_us += elapsed_us;
+    if (elapsed_us > b->flush_max_us) {
+        b->flush_max_us = elapsed_us;
+    }
+
+    if (board_count > 1) {
+        printf("Board %d: ", b->index);
+    }
+    printf("Flush done in %.1f ms (%.1f ms sending, %u ringbuffer queries)\n",
+           elapsed_us / 1000.0, (drained_us - start_us) / 1000.0, queries);
     return true;
 }
 
 
+static bool handle_flush(char* line, size_t len)
+{
+    return queue_flush();
+}
+
+
 static bool process_line(char* line, size_t len)
 {
     bool rc = true;
@@ -317,6 +796,13 @@ static bool process_line(char* line, size_t len)
         return false;
     }
 
+    if (new_frame != NULL && line[0] != 's' && line[0] != 'd' && line[0] != '#') {
+        fprintf(stderr, "Only samples can be given while defining a frame\n");
+        fprintf(stderr, "Error on line %" PRIu64 ": %s", line_number, line);
+        line_number++;
+        return false;
+    }
+
     switch(line[0]) {
     case 's':
         rc = handle_sample(line, len);
@@ -324,6 +810,15 @@ static bool process_line(char* line, size_t len)
     case 'f':
         rc = handle_flush(line, len);
         break;
+    case 'b':
+        rc = begin_frame();
+        break;
+    case 'd':
+        rc = end_frame();
+        break;
+    case 'l':
+        rc = handle_loop(line, len);
+        break;
     case 'r':
         rc = handle_set_ilda_rate(line, len);
         break;
@@ -333,6 +828,8 @@ static bool process_line(char* line, size_t len)
     case 'p':
         rc = handle_print(line, len);
         break;
+    case 'm': // Section marker, only lasershark_stdin_compile uses them
+        break;
     case '#': // Comment
         break;
     default:
@@ -350,135 +847,1000 @@ static bool process_line(char* line, size_t len)
 }
 
 
-static void print_lasersharks()
+/*
+Binary input format, selected with -b or by starting the stream with the
+BINARY_MAGIC bytes. The stream is a sequence of records, each a one byte
+type followed by its payload. All integers are little endian.
+
+    's' u16 count, count samples    Samples in the Lasershark packet layout
+                                    (8 bytes each, see struct lasershark_sample),
+                                    sent to every board. Not allowed with -R
+    'S' u8 board, u16 count,        Samples for one board, only with -R
+        count samples
+    'r' u32 rate                    Same as "r=rate"
+    'e' u8 enable                   Same as "e=enable"
+    'f'                             Same as "f=1"
+    'p' u16 len, len bytes          Same as "p=text"
+    'b'                             Same as "b=1"
+    'd'                             Same as "d=1"
+    'l' u32 count                   Same as "l=count"
+
+As with the text format the first record must set the ilda rate.
+*/
+#define BINARY_MAGIC "LSB1"
+#define BINARY_MAGIC_LEN 4
+
+static bool read_binary(void* buf, size_t len)
 {
-    int rc;
-    libusb_device **devs;
-    struct libusb_device_handle *devh;
-    struct libusb_device_descriptor desc;
-    ssize_t count;
-    ssize_t i;
-    unsigned char serial[lasershark_serialnum_len];
+    if (!blockreader_read(input, buf, len)) {
+        fprintf(stderr, "Unexpected end of binary input\n");
+        return false;
+    }
+    return true;
+}
 
-    count = libusb_get_device_list(NULL, &devs);
 
-    if (count < 0) {
-        fprintf(stderr, "Error encountered acquiring device list: %d\n", (int)count);
-        return;
+static bool read_binary_u16(uint16_t* val)
+{
+    uint8_t buf[2];
+    if (!read_binary(buf, sizeof(buf))) {
+        return false;
     }
-
+    *val = buf[0] | (buf[1] << 8);
+    return true;
+}
+
+
+static bool read_binary_u32(uint32_t* val)
+{
+    uint8_t buf[4];
+    if (!read_binary(buf, sizeof(buf))) {
+        return false;
+    }
+    *val = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+    return true;
+}
+
+
+// Samples are read straight into the bulk buffer, they are not inspected.
+static bool handle_binary_samples(struct board *b)
+{
+    uint16_t count;
+    uint32_t chunk;
+
+    if (!read_binary_u16(&count)) {
+        return false;
+    }
+
+    while (count) {
+        chunk = lasershark_bulk_packet_sample_count - b->current_sample_entry;
+        if (chunk > count) {
+            chunk = count;
+        }
+
+        if (!read_binary(&b->samples[b->current_sample_entry], chunk*sizeof(struct lasershark_sample))) {
+            return false;
+        }
+        b->current_sample_entry += chunk;
+        count -= chunk;
+
+        if (b->current_sample_entry == lasershark_bulk_packet_sample_count) {
+            b->current_sample_entry = 0;
+            if (!queue_samples(b, lasershark_bulk_packet_sample_count)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+static bool handle_binary_frame_samples()
+{
+    uint16_t count;
+    struct lasershark_sample *samples;
+
+    if (!read_binary_u16(&count) || NULL == (samples = frame_extend(new_frame, count))) {
+        return false;
+    }
+
+    return read_binary(samples, count*sizeof(struct lasershark_sample));
+}
+
+
+static bool handle_binary_routed_samples()
+{
+    uint8_t board;
+
+    if (!read_binary(&board, 1)) {
+        return false;
+    }
+    if (board >= board_count) {
+        fprintf(stderr, "Received samples for board %u of %d\n", board, board_count);
+        return false;
+    }
+
+    return handle_binary_samples(&boards[board]);
+}
+
+
+static bool handle_binary_print()
+{
+    uint16_t len;
+    char *text;
+
+    if (!read_binary_u16(&len) || NULL == (text = malloc(len + 2))) {
+        return false;
+    }
+    if (!read_binary(text, len)) {
+        free(text);
+        return false;
+    }
+    text[len] = '\n';
+    text[len+1] = '\0';
+    return queue_command(BLOCK_PRINT, 0, text);
+}
+
+
+static bool process_record(int type)
+{
+    bool rc;
+    uint32_t val;
+    uint8_t enable;
+
+    if (new_frame != NULL && type != 's' && type != 'd') {
+        fprintf(stderr, "Only samples can be given while defining a frame\n");
+        fprintf(stderr, "Error in record %" PRIu64 "\n", line_number);
+        line_number++;
+        return false;
+    }
+
+    switch(type) {
+    case 's':
+        if (new_frame != NULL) {
+            rc = handle_binary_frame_samples();
+        } else {
+            rc = !route_samples && samples_allowed() && handle_binary_samples(&boards[0]);
+        }
+        break;
+    case 'S':
+        rc = route_samples && handle_binary_routed_samples();
+        break;
+    case 'f':
+        rc = queue_flush();
+        break;
+    case 'r':
+        rc = read_binary_u32(&val) && queue_command(BLOCK_SET_ILDA_RATE, val, NULL);
+        break;
+    case 'e':
+        rc = read_binary(&enable, 1) && queue_command(BLOCK_SET_OUTPUT, enable, NULL);
+        break;
+    case 'p':
+        rc = handle_binary_print();
+        break;
+    case 'b':
+        rc = begin_frame();
+        break;
+    case 'd':
+        rc = end_frame();
+        break;
+    case 'l':
+        rc = read_binary_u32(&val) && queue_loop(val);
+        break;
+    default:
+        fprintf(stderr, "Unknown record type received: 0x%02x\n", type);
+        rc = false;
+    }
+
+    if (!rc && !do_exit) {
+        fprintf(stderr, "Error in record %" PRIu64 "\n", line_number);
+    }
+
+    line_number++;
+
+    return rc;
+}
+
+
+/*
+Sets found and consumes the binary magic if the stream starts with it, the
+stream is left untouched otherwise. Returns false on a mangled magic.
+*/
+static bool read_binary_magic(bool* found)
+{
+    char magic[BINARY_MAGIC_LEN];
+    char *data;
+
+    *found = false;
+    if (0 == blockreader_peek(input, &data)) {
+        return !blockreader_error(input);
+    }
+    if (data[0] != BINARY_MAGIC[0]) {
+        return true;
+    }
+
+    if (!blockreader_read(input, magic, BINARY_MAGIC_LEN) ||
+            memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_LEN)) {
+        fprintf(stderr, "Bad binary stream magic\n");
+        return false;
+    }
+
+    *found = true;
+    return true;
+}
+
+
+/*
+Parses stdin and feeds the input queue. Always ends the queue with a
+BLOCK_END so the writer knows to stop.
+*/
+static void *reader_thread(void *arg)
+{
+    ssize_t read;
+    bool forever;
+    char *line;
+    bool magic_found;
+    int c;
+
+    if (!read_binary_magic(&magic_found)) {
+        if (!do_exit) {
+            fprintf(stderr, "Could not read input. Quitting.\n");
+        }
+    } else if (magic_found || binary_input) {
+        printf("Reading binary input\n");
+        if (-1 == (c = blockreader_getc(input)) || c != 'r' || !process_record(c)) {
+            if (!do_exit) {
+                fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
+            }
+        } else {
+            while (!do_exit && -1 != (c = blockreader_getc(input)) && process_record(c)) {
+            }
+        }
+    } else if (-1 == (read = blockreader_getline(input, &line)) || read < 1 || line[0] != 'r' || !process_line(line, read)) {
+        if (!do_exit) {
+            fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
+        }
+    } else {
+        while (!do_exit && handle_sample_run() && -1 != (read = blockreader_getline(input, &line)) &&
+                process_line(line, read)) {
+        }
+    }
+
+    frame_unref(new_frame);
+    frame_unref(loop_frame);
+    new_frame = loop_frame = NULL;
+
+    // The boards keep looping their frame past the end of the input, so stay
+    // around to take the signal that stops them.
+    forever = looping_forever || (swap_frames && frame_swap_submitted(boards[0].swap));
+    queue_command(BLOCK_END, 0, NULL);
+    while (forever && !do_exit) {
+        queue_wait();
+    }
+    return NULL;
+}
+
+
+/*
+Corrects the occupancy estimate with the ringbuffer's actual state. Samples
+in bulk transfers that haven't completed count as queued too.
+*/
+static bool sync_occupancy(struct board *b)
+{
+    int rc;
+    uint32_t empty_samples, queued_samples;
+
+    rc = ls_device_get_ringbuffer_empty_sample_count(b->dev, &empty_samples);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+        return false;
+    }
+
+    queued_samples = bulk_stream_in_flight_bytes(b->bulk) / sizeof(struct lasershark_sample);
+    if (empty_samples < b->ringbuffer_sample_count) {
+        queued_samples += b->ringbuffer_sample_count - empty_samples;
+    }
+    occupancy_model_sync(&b->occupancy, queued_samples, time_portable_now_us());
+
+    return true;
+}
+
+
+/*
+Holds off until sample_count more samples fit under the target latency,
+handling USB completions meanwhile. At least one packet is always let through
+so tiny targets can't stall the output.
+*/
+static bool pace_samples(struct board *b, uint32_t sample_count)
+{
+    uint64_t now_us, wait_us;
+    double target;
+
+    if (target_latency_us == 0 || b->ilda_rate == 0) {
+        return true;
+    }
+
+    now_us = time_portable_now_us();
+    if (occupancy_model_sync_due(&b->occupancy, now_us)) {
+        if (!sync_occupancy(b)) {
+            return false;
+        }
+        now_us = time_portable_now_us();
+    }
+
+    target = occupancy_model_samples_for_us(&b->occupancy, target_latency_us);
+    target = target > sample_count ? target - sample_count : 0;
+
+    while (!do_exit && 0 != (wait_us = occupancy_model_time_until(&b->occupancy, target, now_us))) {
+        if (wait_us > PACE_WAIT_MAX_US) {
+            wait_us = PACE_WAIT_MAX_US;
+        }
+        bulk_stream_handle_events(b->bulk, wait_us);
+        now_us = time_portable_now_us();
+    }
+
+    return true;
+}
+
+
+/*
+Writer side. Submits the samples copied into the bulk buffer being filled,
+if any.
+*/
+static bool submit_coalesced(struct board *b)
+{
+    uint32_t count = b->coalesced_samples;
+
+    if (count == 0) {
+        return true;
+    }
+    if (!pace_samples(b, count)) {
+        return false;
+    }
+
+    b->coalesced_samples = 0;
+    if (!bulk_stream_submit(b->bulk, sizeof(struct lasershark_sample)*count)) {
+        fprintf(stderr, "Error sending sample packet: %s\n", libusb_error_name(bulk_stream_error(b->bulk)));
+        return false;
+    }
+    occupancy_model_add(&b->occupancy, count, time_portable_now_us());
+
+    return true;
+}
+
+
+/*
+Writer side. Copies up to a packet of samples into the bulk buffer being
+filled, which is submitted once it holds -c packets. USB splits a transfer
+into the device's packets again, so a short packet has to end its transfer
+and is submitted right away.
+*/
+static bool send_samples(struct board *b, const struct lasershark_sample *samples, uint32_t count)
+{
+    unsigned char *buf;
+
+    buf = bulk_stream_get_buffer(b->bulk, &do_exit);
+
+    if (buf == NULL) {
+        if (do_exit) {
+            return true;
+        }
+        fprintf(stderr, "Error sending sample packet: %s\n", libusb_error_name(bulk_stream_error(b->bulk)));
+        return false;
+    }
+
+    memcpy(buf + sizeof(struct lasershark_sample)*b->coalesced_samples, samples,
+           sizeof(struct lasershark_sample)*count);
+    b->coalesced_samples += count;
+
+    if (count < lasershark_bulk_packet_sample_count ||
+            b->coalesced_samples == lasershark_bulk_packet_sample_count*coalesce_packets) {
+        return submit_coalesced(b);
+    }
+    return true;
+}
+
+
+/*
+Writer side. Sends count samples that stay put until they're sent, a show
+file or a frame, without copying them. They go in transfers of -c of the
+device's packets, only the last one can be short.
+*/
+static bool send_in_place(struct board *b, const struct lasershark_sample *samples, uint64_t count)
+{
+    uint32_t transfer = lasershark_bulk_packet_sample_count*coalesce_packets;
+    uint32_t chunk;
+
+    while (count && !do_exit) {
+        chunk = count < transfer ? count : transfer;
+        if (!pace_samples(b, chunk)) {
+            return false;
+        }
+
+        if (!bulk_stream_submit_buffer(b->bulk, (const unsigned char*)samples,
+                                       sizeof(struct lasershark_sample)*chunk, &do_exit)) {
+            if (do_exit) {
+                return true;
+            }
+            fprintf(stderr, "Error sending sample packet: %s\n", libusb_error_name(bulk_stream_error(b->bulk)));
+            return false;
+        }
+        occupancy_model_add(&b->occupancy, chunk, time_portable_now_us());
+
+        samples += chunk;
+        count -= chunk;
+    }
+
+    return true;
+}
+
+
+/*
+Writer side. Drops the references to retired frames whose packets have all
+completed.
+*/
+static void reap_frames(struct board *b)
+{
+    uint64_t completed = bulk_stream_completed(b->bulk);
+    int i, kept = 0;
+
+    for (i = 0; i < b->retired_count; i++) {
+        if (b->retired_submitted[i] <= completed) {
+            frame_unref(b->retired_frames[i]);
+        } else {
+            b->retired_frames[kept] = b->retired_frames[i];
+            b->retired_submitted[kept] = b->retired_submitted[i];
+            kept++;
+        }
+    }
+    b->retired_count = kept;
+}
+
+
+/*
+Writer side. Takes over the reference to a frame that's done looping, to be
+dropped once USB is done with its samples.
+*/
+static void retire_frame(struct board *b, struct frame *frame)
+{
+    reap_frames(b);
+    if (b->retired_count == BULK_TRANSFERS_MAX) {
+        // Can't happen with a packet per transfer, but never free early.
+        bulk_stream_wait_idle(b->bulk, &do_exit);
+        reap_frames(b);
+    }
+    if (b->retired_count == BULK_TRANSFERS_MAX) {
+        return; // Leaked rather than freed under USB's feet
+    }
+
+    b->retired_frames[b->retired_count] = frame;
+    b->retired_submitted[b->retired_count] = bulk_stream_submitted(b->bulk);
+    b->retired_count++;
+}
+
+
+/*
+Writer side. Sends a frame block->val times. Looping forever gives way to
+any new input other than its end, always at a frame boundary, so a new
+frame replaces the old one without tearing it.
+*/
+static bool loop_frame_samples(struct board *b, struct block *block)
+{
+    struct block *next;
+    uint32_t loops = 0;
+    bool rc = true;
+
+    while (rc && !do_exit && (block->val == 0 || loops < block->val)) {
+        if (block->val == 0 && loops > 0) {
+            next = spsc_ring_peek_next(b->queue);
+            if (next != NULL && next->type != BLOCK_END) {
+                break;
+            }
+        }
+
+        rc = send_in_place(b, block->frame->samples, block->frame->sample_count);
+        reap_frames(b);
+        loops++;
+    }
+    b->frames_looped += loops;
+
+    retire_frame(b, block->frame);
+    return rc;
+}
+
+
+/*
+Writer side, with -F. Draws the front frame once, swapping in the newest
+frame first. The frame is copied into the bulk buffers, as its buffer is
+written again once the next frame is swapped in. Only the frame being drawn,
+the transfers in flight and the Lasershark's ringbuffer stand between a new
+frame and the output. *drawn is false if there is no frame yet.
+*/
+static bool draw_front_frame(struct board *b, bool *drawn)
+{
+    const struct lasershark_sample *samples;
+    uint32_t count, packet;
+
+    samples = frame_swap_front(b->swap, &count);
+    *drawn = samples != NULL;
+
+    while (count && !do_exit) {
+        packet = count < lasershark_bulk_packet_sample_count ? count : lasershark_bulk_packet_sample_count;
+        if (!send_samples(b, samples, packet)) {
+            return false;
+        }
+        samples += packet;
+        count -= packet;
+    }
+
+    return true;
+}
+
+
+/*
+Executes a board's queued blocks in order until the reader's BLOCK_END, a
+failure or a request to quit. USB completions are handled while waiting for
+input.
+*/
+static void *writer_thread(void *arg)
+{
+    struct board *b = arg;
+    struct block *block;
+    bool rc = true;
+    bool drawn = false;
+
+    while (rc && !do_exit) {
+        block = spsc_ring_peek(b->queue);
+        if (block == NULL) {
+            // Nothing to coalesce with, don't hold samples back waiting for more.
+            rc = submit_coalesced(b);
+            if (rc && b->swap != NULL) {
+                rc = draw_front_frame(b, &drawn);
+            }
+            if (!drawn) {
+                bulk_stream_handle_events(b->bulk, INPUT_QUEUE_POLL_US);
+            }
+            continue;
+        }
+
+        // Samples go out before anything that comes after them.
+        if (block->type != BLOCK_SAMPLES && !submit_coalesced(b)) {
+            break;
+        }
+
+        switch (block->type) {
+        case BLOCK_SAMPLES:
+            rc = send_samples(b, block->samples, block->val);
+            break;
+        case BLOCK_SET_ILDA_RATE:
+            rc = do_set_ilda_rate(b, block->val);
+            break;
+        case BLOCK_SET_OUTPUT:
+            rc = do_set_output(b, block->val);
+            break;
+        case BLOCK_FLUSH:
+            rc = do_flush(b);
+            break;
+        case BLOCK_PRINT:
+            printf("PRINT: %s", block->text);
+            free(block->text);
+            break;
+        case BLOCK_LOOP:
+            rc = loop_frame_samples(b, block);
+            break;
+        case BLOCK_END:
+            // With -F the last frame is drawn until a request to quit.
+            drawn = b->swap != NULL;
+            while (rc && drawn && !do_exit) {
+                rc = draw_front_frame(b, &drawn);
+            }
+            if (rc) {
+                spsc_ring_release(b->queue);
+                return NULL;
+            }
+            break;
+        }
+
+        if (!rc && !do_exit) {
+            if (board_count > 1) {
+                fprintf(stderr, "Board %d: ", b->index);
+            }
+            fprintf(stderr, "Error executing line %" PRIu64 "\n", block->line_number);
+        }
+
+        spsc_ring_release(b->queue);
+    }
+
+    // The reader and the other writers have to stop too. The reader's reads
+    // give up once do_exit is set.
+    do_exit = 1;
+
+    return NULL;
+}
+
+
+static bool run_show_command(struct board *b, const struct show_command *cmd)
+{
+    switch (cmd->type) {
+    case SHOW_CMD_SET_ILDA_RATE:
+        return do_set_ilda_rate(b, cmd->val);
+    case SHOW_CMD_SET_OUTPUT:
+        return do_set_output(b, cmd->val);
+    case SHOW_CMD_FLUSH:
+        return do_flush(b);
+    case SHOW_CMD_PRINT:
+        if (b->index == 0) {
+            printf("PRINT: %s", show->strings + cmd->val);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+Plays the show file on one board in place of writer_thread(). The samples
+between commands go to USB straight out of the mapped file.
+*/
+static void *show_thread(void *arg)
+{
+    struct board *b = arg;
+    const struct show_file_header *h = show->header;
+    const struct show_section *sec;
+    uint64_t pos = 0, cmd = 0, next;
+    bool rc = true;
+
+    if (show_section != -1) {
+        // Sections carry the state at their start, no need to replay to it.
+        // State not set yet is left alone, as when playing from the start.
+        sec = &show->sections[show_section];
+        pos = sec->sample_pos;
+        cmd = sec->command_index;
+        if (sec->flags & SHOW_SECTION_HAS_ILDA_RATE) {
+            rc = do_set_ilda_rate(b, sec->ilda_rate);
+        }
+        if (rc && (sec->flags & SHOW_SECTION_HAS_OUTPUT)) {
+            rc = do_set_output(b, sec->output);
+        }
+    }
+
+    while (rc && !do_exit) {
+        next = cmd < h->command_count ? show->commands[cmd].sample_pos : h->sample_count;
+        if (next > pos) {
+            rc = send_in_place(b, &show->samples[pos], next - pos);
+            pos = next;
+            continue;
+        }
+
+        if (cmd == h->command_count) {
+            break;
+        }
+        rc = run_show_command(b, &show->commands[cmd]);
+        if (!rc && !do_exit) {
+            if (board_count > 1) {
+                fprintf(stderr, "Board %d: ", b->index);
+            }
+            fprintf(stderr, "Error executing show command %" PRIu64 "\n", cmd);
+        }
+        cmd++;
+    }
+
+    if (!rc) {
+        do_exit = 1;
+    }
+
+    return NULL;
+}
+
+
+static void print_lasersharks()
+{
+    char serials[LIST_MAX_LASERSHARKS][LASERSHARK_SERIALNUM_LEN];
+    int count;
+    int i;
+
+    count = ls_discovery_list(serials, LIST_MAX_LASERSHARKS);
+    if (count < 0) {
+        return;
+    }
+
     printf("Connected LaserShark units:\n");
     for (i = 0; i < count; i++) {
-        rc = libusb_get_device_descriptor(devs[i], &desc);
-        if (rc < 0) {
-            fprintf(stderr, "Error obtaining device descriptor: %d\n", /*libusb_error_name(rc)*/rc);
-            break;
+        printf("\tiSerialNumber: %s\n", serials[i]);
+    }
+}
+
+
+void print_help(const char* prog_name, FILE* stream)
+{
+    fprintf(stream, "%s [OPTION]\n", prog_name);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-l");
+    fprintf(stream, "\tLists all connected LaserSharks\n");
+    fprintf(stream, "\t-s <LaserShark Serial Number>\n");
+    fprintf(stream, "\t\tConnect to a specific LaserShark. Repeat to drive up to %d boards\n", MAX_BOARDS);
+    fprintf(stream, "\t\tat once, numbered from 0 in the order given. Input is read once for all\n");
+    fprintf(stream, "\t\tboards, so the slowest board sets the pace for every board\n");
+    fprintf(stream, "\t-R");
+    fprintf(stream, "\tRoute each sample to one board instead of sending every sample to\n");
+    fprintf(stream, "\t\tevery board. Sample lines take a trailing board number,\n");
+    fprintf(stream, "\t\t\"s=x,y,a,b,c,intl_a,board\", binary input uses 'S' records. A board\n");
+    fprintf(stream, "\t\twhose queue is full still stalls the input for the others\n");
+    fprintf(stream, "\t-L <Latency in ms>\n");
+    fprintf(stream, "\t\tHold samples back to keep about this much output queued\n");
+    fprintf(stream, "\t\t(0-%d, default 0 sends as fast as USB allows)\n", TARGET_LATENCY_MAX_MS);
+    fprintf(stream, "\t-n");
+    fprintf(stream, "\tDrive simulated LaserSharks instead of real hardware, -s names them\n");
+    fprintf(stream, "\t-f <Show file>\n");
+    fprintf(stream, "\t\tPlay a show file made by lasershark_stdin_compile instead of reading stdin\n");
+    fprintf(stream, "\t-F");
+    fprintf(stream, "\tDraw the newest frame defined with \"b=1\" ... \"d=1\" over and over, swapping\n");
+    fprintf(stream, "\t\tin the next one as soon as the current pass ends\n");
+    fprintf(stream, "\t-S <Section>\n");
+    fprintf(stream, "\t\tStart the show file at the section with this name or number\n");
+    fprintf(stream, "\t-b");
+    fprintf(stream, "\tRead binary records instead of text commands from stdin\n");
+    fprintf(stream, "\t\t(implied when stdin starts with \"%s\")\n", BINARY_MAGIC);
+    fprintf(stream, "\t-q <Block count>\n");
+    fprintf(stream, "\t\tDepth of the queue between the input parser and each USB writer thread,\n");
+    fprintf(stream, "\t\tin packets and commands (1-%d, default %d)\n", INPUT_QUEUE_MAX, INPUT_QUEUE_DEFAULT);
+    fprintf(stream, "\t-c <Packet count>\n");
+    fprintf(stream, "\t\tSend up to this many device packets per bulk transfer (1-%d, default %d),\n",
+            COALESCE_PACKETS_MAX, COALESCE_PACKETS_DEFAULT);
+    fprintf(stream, "\t\tfewer transfers cost less CPU at high sample rates\n");
+    fprintf(stream, "\t-t <Transfer count>\n");
+    fprintf(stream, "\t\tNumber of bulk transfers to keep in flight per board (1-%d, default %d)\n",
+            BULK_TRANSFERS_MAX, BULK_TRANSFERS_DEFAULT);
+}
+
+
+/*
+Opens a board, checks it can do what we need and sets up its bulk stream,
+queue and staging buffer.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int open_board(struct board *b, bool simulated)
+{
+    int rc;
+    uint32_t temp;
+    uint32_t fw_major_version, fw_minor_version;
+    uint32_t bulk_packet_sample_count, dac_min_val, dac_max_val;
+
+    if (simulated) {
+        b->dev = ls_device_open_sim(b->requested_serial, LS_DATA_BULK);
+        if (b->dev == NULL) {
+            fprintf(stderr, "Error creating simulated LaserShark\n");
+            return LASERSHARK_CMD_FAIL;
         }
+    } else {
+        b->dev = ls_device_open_usb(b->requested_serial, LS_DATA_BULK);
+        if (b->dev == NULL)
+        {
+            fprintf(stderr, "Error finding/opening LaserShark\n");
+            return LASERSHARK_CMD_FAIL;
+        }
+    }
+    if (board_count > 1) {
+        printf("Board %d: %s\n", b->index, ls_device_serial(b->dev));
+    }
+
+    rc = ls_device_get_fw_major_version(b->dev, &fw_major_version);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting FW Major version failed.\n");
+        return rc;
+    }
+    printf("Getting FW Major version: %d\n", fw_major_version);
+
+    rc = ls_device_get_fw_minor_version(b->dev, &fw_minor_version);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting FW Minor version failed.\n");
+        return rc;
+    }
+    printf("Getting FW Minor version: %d\n", fw_minor_version);
+
+    if (fw_major_version != LASERSHARK_FW_MAJOR_VERSION ||
+            fw_minor_version != LASERSHARK_FW_MINOR_VERSION) {
+        fprintf(stderr, "Your FW is not capable of proper bulk transfers or clear commands. Please upgrade your firmware.\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    printf("Clearing ringbuffer\n");
+    rc = ls_device_clear_ringbuffer(b->dev);
+    if (rc != LASERSHARK_CMD_SUCCESS) {
+        fprintf(stderr, "Clearing ringbuffer buffer failed.\n");
+        return rc;
+    }
+
 
-        if (desc.idVendor == LASERSHARK_VID && desc.idProduct == LASERSHARK_PID) {
+    rc = ls_device_get_bulk_packet_sample_count(b->dev, &bulk_packet_sample_count);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting bulk packet sample count failed\n");
+        return rc;
+    }
+    printf("Getting bulk packet sample count: %d\n", bulk_packet_sample_count);
+    if (b->index == 0) {
+        lasershark_bulk_packet_sample_count = bulk_packet_sample_count;
+    } else if (bulk_packet_sample_count != lasershark_bulk_packet_sample_count) {
+        fprintf(stderr, "All boards must use the same bulk packet sample count\n");
+        return LASERSHARK_CMD_FAIL;
+    }
 
-            rc = libusb_open(devs[i], &devh);
-            if (rc < 0) {
-                fprintf(stderr, "Error opening USB device\n");
-                break;
-            }
+    b->bulk = bulk_stream_create(b->dev, LASERSHARK_BULK_ENDPOINT,
+                                 sizeof(struct lasershark_sample)*lasershark_bulk_packet_sample_count*coalesce_packets,
+                                 bulk_transfer_count);
+    if (b->bulk == NULL) {
+        fprintf(stderr, "Could not allocate bulk transfers.\n");
+        return LASERSHARK_CMD_FAIL;
+    }
 
-            memset(serial, 0, lasershark_serialnum_len);
-            rc = libusb_get_string_descriptor_ascii(devh, desc.iSerialNumber, serial, lasershark_serialnum_len);
-            if (rc < 0) {
-                fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
-                break;
-            }
-            printf("\tiSerialNumber: %s\n", serial);
+    printf("Keeping up to %d bulk transfers of %d packets in flight\n", bulk_transfer_count, coalesce_packets);
 
-            libusb_close(devh);
-        }
+    b->samples = malloc(sizeof(struct lasershark_sample)*lasershark_bulk_packet_sample_count);
+    if (b->samples == NULL) {
+        fprintf(stderr, "Could not allocate sample array.\n");
+        return LASERSHARK_CMD_FAIL;
     }
 
-    libusb_free_device_list(devs, 1); // Free the list and dereference all devices
-}
+    b->queue = spsc_ring_create(input_queue_depth,
+                                sizeof(struct block) + sizeof(struct lasershark_sample)*lasershark_bulk_packet_sample_count);
+    if (b->queue == NULL) {
+        fprintf(stderr, "Could not allocate input queue.\n");
+        return LASERSHARK_CMD_FAIL;
+    }
 
+    if (swap_frames) {
+        b->swap = frame_swap_create(FRAME_SAMPLES_MAX);
+        if (b->swap == NULL) {
+            fprintf(stderr, "Could not allocate frame swap.\n");
+            return LASERSHARK_CMD_FAIL;
+        }
+    }
 
-static bool open_lasershark(const char* serial)
-{
-    int rc;
-    libusb_device **devs = NULL;
-    struct libusb_device_handle *devh = NULL;
-    struct libusb_device_descriptor desc;
-    ssize_t count;
-    ssize_t i;
+    rc = ls_device_get_max_ilda_rate(b->dev, &b->max_ilda_rate);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting max ilda rate failed\n");
+        return rc;
+    }
+    printf("Getting max ilda rate: %u pps\n", b->max_ilda_rate);
 
-    count = libusb_get_device_list(NULL, &devs);
 
-    if (count < 0) {
-        fprintf(stderr, "Error encountered acquiring device list: %d\n", (int)count);
-        return false;
+    rc = ls_device_get_dac_min(b->dev, &dac_min_val);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting dac min failed\n");
+        return rc;
     }
+    printf("Getting dac min: %d\n", dac_min_val);
 
-    for (i = 0; i < count; i++) {
-        rc = libusb_get_device_descriptor(devs[i], &desc);
-        if (rc < 0) {
-            fprintf(stderr, "Error obtaining device descriptor: %d\n", /*libusb_error_name(rc)*/rc);
-            break;
-        }
 
-        if (desc.idVendor == LASERSHARK_VID && desc.idProduct == LASERSHARK_PID) {
+    rc = ls_device_get_dac_max(b->dev, &dac_max_val);
+    if (rc != LASERSHARK_CMD_SUCCESS) {
+        fprintf(stderr, "Getting dac max failed\n");
+        return rc;
+    }
+    printf("getting dac max: %d\n", dac_max_val);
+    if (b->index == 0) {
+        lasershark_dac_max_val = dac_max_val;
+    } else if (dac_max_val != lasershark_dac_max_val) {
+        fprintf(stderr, "All boards must have the same DAC range\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+
 
-            rc = libusb_open(devs[i], &devh);
-            if (rc < 0) {
-                fprintf(stderr, "Error opening USB device\n");
-                break;
-            }
+    rc = ls_device_get_ringbuffer_sample_count(b->dev, &b->ringbuffer_sample_count);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting ringbuffer sample count\n");
+        return rc;
+    }
+    printf("Getting ringbuffer sample count: %d\n", b->ringbuffer_sample_count);
+    occupancy_model_init(&b->occupancy, 0, time_portable_now_us());
+    if (target_latency_us) {
+        printf("Pacing output to %.1f ms of latency\n", target_latency_us / 1000.0);
+    }
 
-            memset(lasershark_serialnum, 0, lasershark_serialnum_len);
-            rc = libusb_get_string_descriptor_ascii(devh, desc.iSerialNumber, lasershark_serialnum, lasershark_serialnum_len);
-            if (rc < 0) {
-                fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
-                break;
-            }
-            if (NULL == serial || strncmp((const char*)lasershark_serialnum, serial, lasershark_serialnum_len)) {
-                printf("iSerialNumber: %s\n", lasershark_serialnum);
-                break;
-            }
 
-            libusb_close(devh);
-            memset(lasershark_serialnum, 0, lasershark_serialnum_len);
-            devh = NULL;
-        }
+    rc = ls_device_get_ringbuffer_empty_sample_count(b->dev, &temp);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
     }
+    printf("Getting ringbuffer empty sample count: %d\n", temp);
 
-    libusb_free_device_list(devs, 1); // Free the list and dereference all devices
 
-    if (devh) {
-        ls_devh = devh;
-        return true;
+    rc = ls_device_set_output(b->dev, LASERSHARK_CMD_OUTPUT_DISABLE);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Disable output failed\n");
+        return rc;
     }
+    printf("Disable output worked\n");
 
-    return false;
+    return LASERSHARK_CMD_SUCCESS;
 }
 
 
-void print_help(const char* prog_name, FILE* stream)
+/*
+Lets a board's queued packets land, turns its output off and reports
+anything that didn't get displayed.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int close_board(struct board *b)
 {
-    fprintf(stream, "%s [OPTION]\n", prog_name);
-    fprintf(stream, "\t-h");
-    fprintf(stream, "\tPrint this help text\n");
-    fprintf(stream, "\t-l");
-    fprintf(stream, "\tLists all connected LaserSharks\n");
-    fprintf(stream, "\t-s <LaserShark Serial Number>\n");
-    fprintf(stream, "\t\tConnect to a specific LaserShark\n");
+    int rc;
+    uint32_t temp;
+
+    // Let queued packets land before the output gets disabled.
+    if (!bulk_stream_wait_idle(b->bulk, &do_exit) && !do_exit) {
+        fprintf(stderr, "Error sending sample packet: %s\n", libusb_error_name(bulk_stream_error(b->bulk)));
+    }
+
+    rc = ls_device_set_output(b->dev, LASERSHARK_CMD_OUTPUT_DISABLE);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Disable output failed\n");
+        return rc;
+    }
+    printf("Disable output worked\n");
+
+    rc = ls_device_get_ringbuffer_empty_sample_count(b->dev, &temp);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+    }
+    if (b->ringbuffer_sample_count-temp>0 || b->current_sample_entry || bulk_stream_in_flight(b->bulk)) {
+        fprintf(stderr, "Warning, not all samples displayed. Consider flushing before quitting.\n");
+        fprintf(stderr, "\t%u not sent to Lasershark.\n", b->current_sample_entry);
+        fprintf(stderr, "\t%d bulk transfers still in flight.\n", bulk_stream_in_flight(b->bulk));
+        temp = b->ringbuffer_sample_count - temp;
+        fprintf(stderr, "\t%u-%u = %u still in Lasershark's buffer.\n", b->ringbuffer_sample_count, temp, b->ringbuffer_sample_count-temp);
+    }
+
+
+    printf("Clearing ringbuffer\n");
+    rc = ls_device_clear_ringbuffer(b->dev);
+    if (rc != LASERSHARK_CMD_SUCCESS) {
+        fprintf(stderr, "Clearing ringbuffer buffer failed.\n");
+        return rc;
+    }
+
+    return LASERSHARK_CMD_SUCCESS;
 }
 
 
 int main (int argc, char *argv[])
 {
-    int rc;
-    uint32_t temp;
+    int rc = 0;
+    int i, j;
+    struct board *b;
+    struct block *block;
 
+    int bflag = 0;
     int hflag = 0;
     int lflag = 0;
     int sflag = 0;
-    char* requested_serial = NULL;
+    int tflag = 0;
+    int qflag = 0;
+    int Lflag = 0;
+    int nflag = 0;
+    int Rflag = 0;
+    int fflag = 0;
+    int Sflag = 0;
+    int Fflag = 0;
+    int cflag = 0;
+    const char *show_path = NULL;
+    const char *section_name = NULL;
+    bool usb_initialized = false;
+    int target_latency_ms = 0;
+    int queue_depth = INPUT_QUEUE_DEFAULT;
     int c;
 
 #ifndef _WIN32
@@ -486,17 +1848,56 @@ int main (int argc, char *argv[])
 #endif
 
     opterr_portable = 1;
-    while (-1 != (c =getopt_portable(argc, argv, "hls:"))) {
+    while (-1 != (c =getopt_portable(argc, argv, "bc:f:FhlL:nq:Rs:S:t:"))) {
         switch(c) {
+        case 'b':
+            bflag++;
+            break;
+        case 'c':
+            cflag++;
+            coalesce_packets = atoi(optarg_portable);
+            break;
+        case 'f':
+            fflag++;
+            show_path = optarg_portable;
+            break;
+        case 'F':
+            Fflag++;
+            break;
         case 'h':
             hflag++;
             break;
         case 'l':
             lflag++;
             break;
+        case 'L':
+            Lflag++;
+            target_latency_ms = atoi(optarg_portable);
+            break;
+        case 'n':
+            nflag++;
+            break;
+        case 'q':
+            qflag++;
+            queue_depth = atoi(optarg_portable);
+            break;
+        case 'R':
+            Rflag++;
+            break;
         case 's':
+            // May be given once per board.
+            if (sflag < MAX_BOARDS) {
+                boards[sflag].requested_serial = optarg_portable;
+            }
             sflag++;
-            requested_serial = optarg_portable;
+            break;
+        case 'S':
+            Sflag++;
+            section_name = optarg_portable;
+            break;
+        case 't':
+            tflag++;
+            bulk_transfer_count = atoi(optarg_portable);
             break;
         default:
             print_help(argv[0], stderr);
@@ -510,237 +1911,264 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
-    if (lflag > 1 || sflag > 1 || hflag > 1) {
-        fprintf(stderr, "Cannot specify flags more than once.\n");
+    if (nflag && lflag) {
+        fprintf(stderr, "Cannot specify -n with the -l flag.\n");
         print_help(argv[0], stderr);
         exit(1);
     }
 
-    if (hflag) {
-        print_help(argv[0], stdout);
-        exit(0);
+    if (fflag && (bflag || Rflag)) {
+        fprintf(stderr, "Cannot specify -b or -R with the -f flag.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-#ifndef _WIN32
-    sigact.sa_handler = sig_hdlr;
-    sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
-    sigaction(SIGINT, &sigact, NULL);
-    sigaction(SIGUSR1, &sigact, NULL);
-#endif
-
-
-    rc = libusb_init(NULL);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error initializing libusb: %d\n", /*libusb_error_name(rc)*/rc);
+    if (Fflag && (fflag || Rflag)) {
+        fprintf(stderr, "Cannot specify -f or -R with the -F flag.\n");
+        print_help(argv[0], stderr);
         exit(1);
     }
 
-    libusb_set_debug(NULL, 3);
-
-    if (lflag) {
-        print_lasersharks();
-        goto out_post_release;
+    if (Sflag && !fflag) {
+        fprintf(stderr, "Cannot specify -S without the -f flag.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-    if(!open_lasershark(requested_serial) )
-    {
-        fprintf(stderr, "Error finding/opening LaserShark\n");
-        goto out_post_release;
+    if (lflag > 1 || hflag > 1 || tflag > 1 || bflag > 1 || qflag > 1 || Lflag > 1 || nflag > 1 || Rflag > 1 ||
+            fflag > 1 || Sflag > 1 || Fflag > 1 || cflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-
-
-    rc = libusb_claim_interface(ls_devh, 0);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error claiming control interface: %d\n", /*libusb_error_name(rc)*/rc);
-        goto out_post_release;
-    }
-    rc = libusb_claim_interface(ls_devh, 1);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error claiming data interface: %d\n", /*libusb_error_name(rc)*/rc);
-        libusb_release_interface(ls_devh, 0);
-        goto out_post_release;
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
     }
 
-    rc = libusb_set_interface_alt_setting(ls_devh, 1, 1);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error setting alternative (BULK) data interface: %d\n", /*libusb_error_name(rc)*/rc);
-        goto out;
+    if (sflag > MAX_BOARDS) {
+        fprintf(stderr, "Cannot drive more than %d boards\n", MAX_BOARDS);
+        print_help(argv[0], stderr);
+        exit(1);
     }
-
-    rc = get_fw_major_version(ls_devh, &lasershark_fw_major_version);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting FW Major version failed.\n");
-        goto out;
+    for (i = 0; i < sflag; i++) {
+        for (j = 0; j < i; j++) {
+            if (0 == strncmp(boards[i].requested_serial, boards[j].requested_serial, LASERSHARK_SERIALNUM_LEN)) {
+                fprintf(stderr, "Serial number %s given more than once\n", boards[i].requested_serial);
+                exit(1);
+            }
+        }
     }
-    printf("Getting FW Major version: %d\n", lasershark_fw_major_version);
-
-    rc = get_fw_minor_version(ls_devh, &lasershark_fw_minor_version);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting FW Minor version failed.\n");
-        goto out;
+    // Without -s the first board found is used.
+    board_count = sflag ? sflag : 1;
+    for (i = 0; i < board_count; i++) {
+        boards[i].index = i;
     }
-    printf("Getting FW Minor version: %d\n", lasershark_fw_minor_version);
+    route_samples = Rflag;
+    swap_frames = Fflag;
 
-    if (lasershark_fw_major_version != LASERSHARK_FW_MAJOR_VERSION ||
-            lasershark_fw_minor_version != LASERSHARK_FW_MINOR_VERSION) {
-        fprintf(stderr, "Your FW is not capable of proper bulk transfers or clear commands. Please upgrade your firmware.\n");
-        goto out;
+    if (bulk_transfer_count < 1 || bulk_transfer_count > BULK_TRANSFERS_MAX) {
+        fprintf(stderr, "Transfer count must be between 1 and %d\n", BULK_TRANSFERS_MAX);
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-    printf("Clearing ringbuffer\n");
-    rc = clear_ringbuffer(ls_devh);
-    if (rc != LASERSHARK_CMD_SUCCESS) {
-        fprintf(stderr, "Clearing ringbuffer buffer failed.\n");
-        goto out;
+    if (coalesce_packets < 1 || coalesce_packets > COALESCE_PACKETS_MAX) {
+        fprintf(stderr, "Packet count must be between 1 and %d\n", COALESCE_PACKETS_MAX);
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-
-    rc = get_bulk_packet_sample_count(ls_devh, &lasershark_bulk_packet_sample_count);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting bulk packet sample count failed\n");
-        goto out;
+    if (queue_depth < 1 || queue_depth > INPUT_QUEUE_MAX) {
+        fprintf(stderr, "Queue depth must be between 1 and %d\n", INPUT_QUEUE_MAX);
+        print_help(argv[0], stderr);
+        exit(1);
     }
-    printf("Getting bulk packet sample count: %d\n", lasershark_bulk_packet_sample_count);
+    input_queue_depth = queue_depth;
 
-    samples = malloc(sizeof(struct lasershark_sample)*lasershark_bulk_packet_sample_count);
-    if (samples == NULL) {
-        fprintf(stderr, "Could not allocate sample array.\n");
-        goto out;
+    if (target_latency_ms < 0 || target_latency_ms > TARGET_LATENCY_MAX_MS) {
+        fprintf(stderr, "Target latency must be between 0 and %d ms\n", TARGET_LATENCY_MAX_MS);
+        print_help(argv[0], stderr);
+        exit(1);
     }
+    target_latency_us = (uint64_t)target_latency_ms * 1000;
+    binary_input = bflag;
 
-    rc = get_max_ilda_rate(ls_devh, &lasershark_max_ilda_rate);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting max ilda rate failed\n");
-        goto out;
+    if (fflag) {
+        show = show_file_open(show_path);
+        if (show == NULL) {
+            exit(1);
+        }
+        if (Sflag && -1 == (show_section = show_file_find_section(show, section_name))) {
+            fprintf(stderr, "Show file has no section %s\n", section_name);
+            show_file_close(show);
+            exit(1);
+        }
+        printf("Playing %s: %" PRIu64 " samples, %" PRIu64 " sections\n", show_path,
+               show->header->sample_count, show->header->section_count);
     }
-    printf("Getting max ilda rate: %u pps\n", lasershark_max_ilda_rate);
 
-
-    rc = get_dac_min(ls_devh, &lasershark_dac_min_val);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting dac min failed\n");
-        goto out;
-    }
-    printf("Getting dac min: %d\n", lasershark_dac_min_val);
+#ifndef _WIN32
+    sigact.sa_handler = sig_hdlr;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = 0;
+    sigaction(SIGINT, &sigact, NULL);
+    sigaction(SIGUSR1, &sigact, NULL);
+#endif
 
 
-    rc = get_dac_max(ls_devh, &lasershark_dac_max_val);
-    if (rc != LASERSHARK_CMD_SUCCESS) {
-        fprintf(stderr, "Getting dac max failed\n");
-        goto out;
-    }
-    printf("getting dac max: %d\n", lasershark_dac_max_val);
+    if (!nflag) {
+        // One context for every board.
+        rc = libusb_init(NULL);
+        if (rc < 0)
+        {
+            fprintf(stderr, "Error initializing libusb: %d\n", /*libusb_error_name(rc)*/rc);
+            exit(1);
+        }
+        usb_initialized = true;
 
+        libusb_set_debug(NULL, 3);
+        ls_discovery_init();
 
-    rc = get_ringbuffer_sample_count(ls_devh, &lasershark_ringbuffer_sample_count);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting ringbuffer sample count\n");
-        goto out;
+        if (lflag) {
+            print_lasersharks();
+            goto out;
+        }
     }
-    printf("Getting ringbuffer sample count: %d\n", lasershark_ringbuffer_sample_count);
-
 
-    rc = get_ringbuffer_empty_sample_count(ls_devh, &temp);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+    for (i = 0; i < board_count; i++) {
+        rc = open_board(&boards[i], nflag);
+        if (rc != LASERSHARK_CMD_SUCCESS) {
+            goto out;
+        }
     }
-    printf("Getting ringbuffer empty sample count: %d\n", temp);
 
-    rc = set_output(ls_devh, LASERSHARK_CMD_OUTPUT_DISABLE);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Disable output failed\n");
+    if (show != NULL && show->header->dac_max > lasershark_dac_max_val) {
+        fprintf(stderr, "Show file uses values up to %u, the DAC only goes up to %u\n",
+                show->header->dac_max, lasershark_dac_max_val);
+        rc = LASERSHARK_CMD_FAIL;
         goto out;
     }
-    printf("Disable output worked\n");
-
-    ssize_t read;
-    size_t len = 256;
 
-    char *line = malloc(len+1);
-    if (line == NULL) {
+    input = blockreader_create(0, INPUT_BLOCK_SIZE);
+    if (input == NULL) {
         fprintf(stderr, "Buffer malloc failed\n");
         goto out;
     }
+    // Lets a failing writer stop the reader while it waits for input.
+    blockreader_set_stop(input, &do_exit);
 
 #ifdef _WIN32
     SetConsoleCtrlHandler(console_ctrl_handler, TRUE);
-#else
-    sigemptyset (&mask);
-    sigaddset (&mask, SIGUSR1);
-
-    sigprocmask (SIG_BLOCK, &mask, &oldmask);
+    _setmode(_fileno(stdin), _O_BINARY);
 #endif
 
     printf("===Running===\n");
 
-    if (-1 == (read = getline_portable(&line, &len, stdin)) || read < 1 || line[0] != 'r' || !process_line(line, read)) {
-        fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
-    } else {
-        while (!do_exit && -1 != (read = getline_portable(&line, &len, stdin)) && process_line(line, read)) {
-            //sigsuspend (&oldmask);
-            //printf("Looping... (Must have recieved a signal, don't panic).\n");
+    // A show file needs no reader, each board's thread plays it directly.
+    if (show == NULL) {
+        rc = pthread_create(&reader, NULL, reader_thread, NULL);
+        if (rc) {
+            fprintf(stderr, "Could not start reader thread: %d\n", rc);
+            goto out;
         }
-        //sigprocmask (SIG_UNBLOCK, &mask, NULL);
-    }
 
-    printf("===Ending===\n");
-    rc = set_output(ls_devh, LASERSHARK_CMD_OUTPUT_DISABLE);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Disable output failed\n");
-        goto out;
+#ifndef _WIN32
+        // Signals go to the reader so they interrupt its reads, the writers
+        // notice do_exit on their own. Blocked before the writers start so
+        // they inherit it.
+        sigemptyset (&mask);
+        sigaddset (&mask, SIGINT);
+        sigaddset (&mask, SIGUSR1);
+
+        sigprocmask (SIG_BLOCK, &mask, &oldmask);
+#endif
     }
-    printf("Disable output worked\n");
 
-    rc = get_ringbuffer_empty_sample_count(ls_devh, &temp);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+    for (i = 0; i < board_count; i++) {
+        rc = pthread_create(&boards[i].writer, NULL, show ? show_thread : writer_thread, &boards[i]);
+        if (rc) {
+            fprintf(stderr, "Could not start writer thread: %d\n", rc);
+            do_exit = 1;
+            break;
+        }
+        boards[i].writer_started = true;
     }
-    if (lasershark_ringbuffer_sample_count-temp>0 || current_sample_entry) {
-        fprintf(stderr, "Warning, not all samples displayed. Consider flushing before quitting.\n");
-        fprintf(stderr, "\t%u not sent to Lasershark.\n", current_sample_entry);
-        temp = lasershark_ringbuffer_sample_count - temp;
-        fprintf(stderr, "\t%u-%u = %u still in Lasershark's buffer.\n", lasershark_ringbuffer_sample_count, temp, lasershark_ringbuffer_sample_count-temp);
+    for (i = 0; i < board_count; i++) {
+        if (boards[i].writer_started) {
+            pthread_join(boards[i].writer, NULL);
+        }
+    }
+    if (show == NULL) {
+        pthread_join(reader, NULL);
     }
 
+    for (i = 0; i < board_count; i++) {
+        b = &boards[i];
+        if (board_count > 1) {
+            printf("Board %d:\n", i);
+        }
+        if (show == NULL) {
+            printf("Input queue high-water mark: %u of %u blocks\n",
+                   spsc_ring_high_water(b->queue), spsc_ring_depth(b->queue));
+        }
+        printf("Bulk transfers: %" PRIu64 "\n", bulk_stream_submitted(b->bulk));
+        if (b->frames_looped) {
+            printf("Frames looped: %" PRIu64 "\n", b->frames_looped);
+        }
+        if (b->swap != NULL) {
+            printf("Frames: %" PRIu64 " given, %" PRIu64 " drawn, %" PRIu64 " replaced before being drawn\n",
+                   frame_swap_submitted(b->swap), frame_swap_swapped(b->swap), frame_swap_dropped(b->swap));
+        }
+        if (b->flush_count) {
+            printf("Flushes: %u, %.1f ms total, %.1f ms average, %.1f ms longest\n", b->flush_count,
+                   b->flush_total_us / 1000.0, b->flush_total_us / 1000.0 / b->flush_count,
+                   b->flush_max_us / 1000.0);
+        }
+        if (target_latency_us) {
+            occupancy_model_print_stats(&b->occupancy);
+        }
+    }
 
-    printf("Clearing ringbuffer\n");
-    rc = clear_ringbuffer(ls_devh);
-    if (rc != LASERSHARK_CMD_SUCCESS) {
-        fprintf(stderr, "Clearing ringbuffer buffer failed.\n");
-        goto out;
+    printf("===Ending===\n");
+    for (i = 0; i < board_count; i++) {
+        rc = close_board(&boards[i]);
+        if (rc != LASERSHARK_CMD_SUCCESS) {
+            goto out;
+        }
     }
 
 
     printf("Quitting gracefully\n");
 
 out:
-    libusb_release_interface(ls_devh, 0);
-    libusb_release_interface(ls_devh, 1);
-
-out_post_release:
-    if (ls_devh)
-    {
-        libusb_close(ls_devh);
+    blockreader_destroy(input);
+    for (i = 0; i < board_count; i++) {
+        b = &boards[i];
+        frame_swap_destroy(b->swap);
+        free(b->samples);
+        bulk_stream_destroy(b->bulk);
+        // Their transfers are gone with the stream.
+        for (j = 0; j < b->retired_count; j++) {
+            frame_unref(b->retired_frames[j]);
+        }
+        // Blocks left behind by a writer that quit early.
+        while (b->queue != NULL && NULL != (block = spsc_ring_peek(b->queue))) {
+            free(block->text);
+            frame_unref(block->frame);
+            spsc_ring_release(b->queue);
+        }
+        spsc_ring_destroy(b->queue);
+        ls_device_close(b->dev);
+    }
+    // Only once nothing can be in flight from it.
+    show_file_close(show);
+    if (usb_initialized) {
+        ls_discovery_exit();
+        libusb_exit(NULL);
     }
-    libusb_exit(NULL);
 
 
     return rc;
 }
-
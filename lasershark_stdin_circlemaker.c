@@ -37,20 +37,18 @@ int main (int argc, char *argv[])
     printf("r=20000\n");
     printf("e=1\n");
 
-    x_f = 0;
-    y_f = 0;
-
-    while(1) {
+    // The circle is sent once as a frame, lasershark_stdin loops it from memory.
+    printf("b=1\n");
+    for (index = 0; index < 1000; index++) {
         x_f = sinf(index*step);
         y_f = cosf(index*step);
         printf("s=%u,%u,%u,%u,%u,%u\n",
                float_to_lasershark_xy(x_f),  float_to_lasershark_xy(y_f), 4095,4095,1,1); // x, y, a, b, c, intl_a
-        index++;
     }
+    printf("d=1\n");
+    printf("l=0\n");
+    fflush(stdout);
 
-    // These should really be stuck at the end of the output.. but this is just a demo.
-    //printf("f=1\n");
-    //printf("e=0\n");
     return 0;
 }
 
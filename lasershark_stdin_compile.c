@@ -0,0 +1,448 @@
+/*
+lasershark_stdin_compile.c - Compiles lasershark_stdin text input into a show
+file that lasershark_stdin -f plays without parsing.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "blockreader_portable.h"
+#include "getopt_portable.h"
+#include "sample_parse.h"
+#include "show_file.h"
+
+#define DAC_MAX_DEFAULT 4095
+// Samples gathered before each write to the output
+#define SAMPLE_BUFFER_COUNT 4096
+#define INPUT_BLOCK_SIZE (64*1024)
+
+FILE *out = NULL;
+uint64_t out_pos = 0;
+
+uint32_t dac_max = DAC_MAX_DEFAULT;
+uint32_t dac_max_seen = 0;
+
+struct lasershark_sample samples[SAMPLE_BUFFER_COUNT];
+uint32_t buffered_samples = 0;
+uint64_t sample_count = 0;
+
+struct show_command *commands = NULL;
+uint64_t command_count = 0, command_capacity = 0;
+
+struct show_section *sections = NULL;
+uint64_t section_count = 0, section_capacity = 0;
+
+char *strings = NULL;
+uint64_t string_size = 0, string_capacity = 0;
+
+// State at the current position, recorded into each section
+uint32_t ilda_rate = 0;
+uint32_t output = 0;
+// SHOW_SECTION_HAS_* for the states set so far
+uint32_t state_flags = 0;
+
+uint64_t line_number = 0;
+
+
+static bool write_out(const void *data, size_t len)
+{
+    if (len && 1 != fwrite(data, len, 1, out)) {
+        fprintf(stderr, "Writing show file failed\n");
+        return false;
+    }
+    out_pos += len;
+    return true;
+}
+
+
+// Pads the output with zeros up to a multiple of align.
+static bool pad_out(uint64_t align)
+{
+    static const char zeros[SHOW_FILE_SAMPLE_ALIGN];
+    size_t len = (align - out_pos % align) % align;
+
+    return write_out(zeros, len);
+}
+
+
+static bool flush_samples()
+{
+    bool rc = write_out(samples, sizeof(struct lasershark_sample)*buffered_samples);
+    buffered_samples = 0;
+    return rc;
+}
+
+
+/*
+Makes room for one more item in a growing table, doubling it as needed.
+*/
+static bool grow(void **table, uint64_t count, uint64_t *capacity, size_t size)
+{
+    void *grown;
+    uint64_t new_capacity;
+
+    if (count < *capacity) {
+        return true;
+    }
+
+    new_capacity = *capacity ? *capacity * 2 : 64;
+    grown = realloc(*table, new_capacity * size);
+    if (grown == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    *table = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+
+static bool add_command(enum show_command_type type, uint32_t val)
+{
+    struct show_command *cmd;
+
+    if (!grow((void**)&commands, command_count, &command_capacity, sizeof(struct show_command))) {
+        return false;
+    }
+
+    cmd = &commands[command_count++];
+    cmd->sample_pos = sample_count;
+    cmd->type = type;
+    cmd->val = val;
+    return true;
+}
+
+
+static bool handle_sample(char *line, size_t len)
+{
+    struct lasershark_sample *sample = &samples[buffered_samples];
+
+    if (!parse_sample_line(line, len, dac_max, sample)) {
+        fprintf(stderr, "Received bad sample command\n");
+        return false;
+    }
+
+    if (sample->x > dac_max_seen) dac_max_seen = sample->x;
+    if (sample->y > dac_max_seen) dac_max_seen = sample->y;
+    if (sample->a > dac_max_seen) dac_max_seen = sample->a;
+    if (sample->b > dac_max_seen) dac_max_seen = sample->b;
+
+    sample_count++;
+    if (++buffered_samples == SAMPLE_BUFFER_COUNT) {
+        return flush_samples();
+    }
+    return true;
+}
+
+
+static bool handle_set_ilda_rate(char *line, size_t len)
+{
+    if (1 != sscanf(line, "r=%u", &ilda_rate)) {
+        fprintf(stderr, "Received malformated ilda rate command\n");
+        return false;
+    }
+    if (ilda_rate == 0) {
+        fprintf(stderr, "Received ilda rate outside acceptable range\n");
+        return false;
+    }
+    state_flags |= SHOW_SECTION_HAS_ILDA_RATE;
+    return add_command(SHOW_CMD_SET_ILDA_RATE, ilda_rate);
+}
+
+
+static bool handle_set_output(char *line, size_t len)
+{
+    if (1 != sscanf(line, "e=%u", &output)) {
+        fprintf(stderr, "Received malfored enable command\n");
+        return false;
+    }
+    state_flags |= SHOW_SECTION_HAS_OUTPUT;
+    return add_command(SHOW_CMD_SET_OUTPUT, output);
+}
+
+
+static bool handle_print(char *line, size_t len)
+{
+    uint64_t offset = string_size;
+
+    if (len <= 2 || line[1] != '=' || offset > UINT32_MAX) {
+        return false;
+    }
+
+    // Texts keep their newline, lasershark_stdin prints them as they came.
+    len -= 2;
+    while (string_size + len + 1 > string_capacity) {
+        if (!grow((void**)&strings, string_capacity, &string_capacity, 1)) {
+            return false;
+        }
+    }
+    memcpy(strings + string_size, line + 2, len);
+    string_size += len;
+    strings[string_size++] = '\0';
+
+    return add_command(SHOW_CMD_PRINT, offset);
+}
+
+
+static bool handle_section(char *line, size_t len)
+{
+    struct show_section *sec;
+
+    // Drop the line ending
+    while (len > 2 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+        len--;
+    }
+    len -= 2;
+    if (len == 0 || len >= SHOW_FILE_SECTION_NAME_LEN) {
+        fprintf(stderr, "Section names must be 1 to %d characters long\n", SHOW_FILE_SECTION_NAME_LEN - 1);
+        return false;
+    }
+
+    if (!grow((void**)&sections, section_count, &section_capacity, sizeof(struct show_section))) {
+        return false;
+    }
+    sec = &sections[section_count++];
+    memset(sec, 0, sizeof(struct show_section));
+    sec->sample_pos = sample_count;
+    sec->command_index = command_count;
+    sec->ilda_rate = ilda_rate;
+    sec->output = output;
+    sec->flags = state_flags;
+    memcpy(sec->name, line + 2, len);
+
+    return true;
+}
+
+
+static bool process_line(char *line, size_t len)
+{
+    bool rc = true;
+
+    if (len < 2) { // Empty lines are not accepted
+        fprintf(stderr, "Empty line encountered on line %" PRIu64 "\n", line_number);
+        return false;
+    }
+
+    switch (line[0]) {
+    case 's':
+        rc = handle_sample(line, len);
+        break;
+    case 'f':
+        rc = add_command(SHOW_CMD_FLUSH, 0);
+        break;
+    case 'r':
+        rc = handle_set_ilda_rate(line, len);
+        break;
+    case 'e':
+        rc = handle_set_output(line, len);
+        break;
+    case 'p':
+        rc = handle_print(line, len);
+        break;
+    case 'm':
+        rc = handle_section(line, len);
+        break;
+    case '#': // Comment
+        break;
+    default:
+        fprintf(stderr, "Unknown command received\n");
+        rc = false;
+    }
+
+    if (!rc) {
+        fprintf(stderr, "Error on line %" PRIu64 ": %s", line_number, line);
+    }
+
+    line_number++;
+
+    return rc;
+}
+
+
+/*
+Writes the tables after the samples, then the header in front of them.
+*/
+static bool finish(void)
+{
+    struct show_file_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SHOW_FILE_MAGIC, SHOW_FILE_MAGIC_LEN);
+    header.version = SHOW_FILE_VERSION;
+    header.byte_order = SHOW_FILE_BYTE_ORDER;
+    header.dac_max = dac_max_seen;
+    header.sample_offset = SHOW_FILE_SAMPLE_ALIGN;
+    header.sample_count = sample_count;
+
+    if (!flush_samples() || !pad_out(sizeof(uint64_t))) {
+        return false;
+    }
+    header.command_offset = out_pos;
+    header.command_count = command_count;
+    if (!write_out(commands, sizeof(struct show_command)*command_count)) {
+        return false;
+    }
+    header.section_offset = out_pos;
+    header.section_count = section_count;
+    if (!write_out(sections, sizeof(struct show_section)*section_count)) {
+        return false;
+    }
+    header.string_offset = out_pos;
+    header.string_size = string_size;
+    if (!write_out(strings, string_size)) {
+        return false;
+    }
+
+    if (fseek(out, 0, SEEK_SET) || 1 != fwrite(&header, sizeof(header), 1, out)) {
+        fprintf(stderr, "Writing show file header failed\n");
+        return false;
+    }
+    return true;
+}
+
+
+void print_help(const char* prog_name, FILE* stream)
+{
+    fprintf(stream, "%s [OPTIONS] -o <show file> - Compiles lasershark_stdin input from stdin\n", prog_name);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-o <show file>\n");
+    fprintf(stream, "\t\tFile to write, for playing with lasershark_stdin -f\n");
+    fprintf(stream, "\t-d <DAC max>\n");
+    fprintf(stream, "\t\tLargest x, y, a and b value allowed (default %d)\n", DAC_MAX_DEFAULT);
+}
+
+
+int main (int argc, char *argv[])
+{
+    int ret = 1;
+    int c;
+    ssize_t read;
+    char *line;
+    struct blockreader *input = NULL;
+    struct show_file_header header_space;
+
+    int hflag = 0;
+    int oflag = 0;
+    int dflag = 0;
+    const char *out_path = NULL;
+
+    opterr_portable = 1;
+    while (-1 != (c = getopt_portable(argc, argv, "hd:o:"))) {
+        switch(c) {
+        case 'h':
+            hflag++;
+            break;
+        case 'd':
+            dflag++;
+            dac_max = atoi(optarg_portable);
+            break;
+        case 'o':
+            oflag++;
+            out_path = optarg_portable;
+            break;
+        default:
+            print_help(argv[0], stderr);
+            exit(1);
+        }
+    }
+
+    if (hflag > 1 || dflag > 1 || oflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
+    }
+
+    // The header is written last, so the output has to be a real file.
+    if (!oflag) {
+        fprintf(stderr, "An output file must be given with -o\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (dac_max < 1 || dac_max > 0xffff) {
+        fprintf(stderr, "DAC max must be between 1 and 65535\n");
+        exit(1);
+    }
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+    input = blockreader_create(0, INPUT_BLOCK_SIZE);
+    out = fopen(out_path, "wb");
+    if (input == NULL || out == NULL) {
+        fprintf(stderr, "Could not open %s\n", out_path);
+        goto out;
+    }
+
+    // Room for the header, which is filled in at the end. Samples follow on
+    // the next page.
+    memset(&header_space, 0, sizeof(header_space));
+    if (!write_out(&header_space, sizeof(header_space)) || !pad_out(SHOW_FILE_SAMPLE_ALIGN)) {
+        goto out;
+    }
+
+    if (-1 == (read = blockreader_getline(input, &line)) || read < 1 || line[0] != 'r' || !process_line(line, read)) {
+        fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
+        goto out;
+    }
+    while (-1 != (read = blockreader_getline(input, &line))) {
+        if (!process_line(line, read)) {
+            goto out;
+        }
+    }
+    if (blockreader_error(input)) {
+        fprintf(stderr, "Could not read input\n");
+        goto out;
+    }
+
+    if (!finish()) {
+        goto out;
+    }
+
+    printf("Compiled %" PRIu64 " samples, %" PRIu64 " commands and %" PRIu64 " sections\n",
+           sample_count, command_count, section_count);
+    ret = 0;
+
+out:
+    if (out != NULL && fclose(out)) {
+        fprintf(stderr, "Writing show file failed\n");
+        ret = 1;
+    }
+    if (ret && out != NULL) {
+        remove(out_path);
+    }
+    blockreader_destroy(input);
+    free(commands);
+    free(sections);
+    free(strings);
+
+    return ret;
+}
@@ -21,6 +21,14 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "getopt_portable.h"
 #include "lodepng/lodepng.h"
 
@@ -31,6 +39,55 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #define MAX_WIDTH 4096
 #define MAX_HEIGHT 4096
 
+// Rows converted together by one thread
+#define BAND_ROWS 16
+// Bands converted ahead of the output, per thread
+#define BANDS_AHEAD_PER_THREAD 2
+#define MAX_THREADS 64
+// Longest sample line, "s=4095,4095,4095,4095,1,1\n"
+#define SAMPLE_LINE_MAX 32
+
+enum image_mode
+{
+    MODE_MONO,
+    MODE_GREY,
+    MODE_RGB
+};
+
+struct band
+{
+    char *text;
+    size_t len;
+    bool done;
+};
+
+/*
+The image is converted in bands of rows on a pool of threads, each band into
+its own buffer, while the main thread writes the finished bands out in
+order. Workers stay at most a few bands ahead of the output so memory stays
+bounded for any image size.
+*/
+struct conversion
+{
+    const uint16_t *image;
+    unsigned int w, h;
+    unsigned int w_off, h_off;
+    enum image_mode mode;
+    unsigned int a_min, a_max;
+    unsigned int b_min, b_max;
+
+    struct band *bands;
+    unsigned int band_count;
+    unsigned int bands_ahead;
+
+    pthread_mutex_t lock;
+    pthread_cond_t band_done;
+    pthread_cond_t band_written;
+    unsigned int next_band;
+    unsigned int written_bands;
+    bool abort;
+};
+
 void print_help(const char* prog_name, FILE* stream)
 {
     fprintf(stream, "%s [OPTIONS] - Displays an image via LaserShark\n", prog_name);
@@ -54,6 +111,157 @@ void print_help(const char* prog_name, FILE* stream)
     fprintf(stream, "\tPNG to print. Must be less than or equal to 4096x4096 in size\n");
     fprintf(stream, "\t-r\n");
     fprintf(stream, "\tRate to display samples at. Must be between 1 and 30,000\n");
+    fprintf(stream, "\t-j\n");
+    fprintf(stream, "\tThreads to convert the image with, 1 to %d. Defaults to the number of CPUs\n", MAX_THREADS);
+}
+
+
+static int cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? count : 1;
+#endif
+}
+
+
+/*
+Appends the sample for pixel x, y to text, returning its length.
+*/
+static int convert_pixel(const struct conversion *conv, unsigned int x, unsigned int y, char *text)
+{
+    const uint16_t *pixel = &conv->image[(y*conv->w + x)*3];
+    unsigned int a_val, b_val, c_val;
+
+    if (conv->mode == MODE_MONO) {
+        a_val = (((pixel[0] +
+                   pixel[1] +
+                   pixel[2])/3 >> 4) > MID_VAL) ? MAX_VAL : MIN_VAL;
+        b_val = 0;
+        c_val = 0;
+        a_val = (((a_val - MIN_VAL) * (conv->a_max - conv->a_min)) / (MAX_VAL - MIN_VAL)) + conv->a_min;
+    } else if (conv->mode == MODE_GREY) {
+        a_val = (pixel[0] +
+                 pixel[1] +
+                 pixel[2])/3 >> 4;
+        b_val = 0;
+        c_val = 0;
+        a_val = (((a_val - MIN_VAL) * (conv->a_max - conv->a_min)) / (MAX_VAL - MIN_VAL)) + conv->a_min;
+    } else {
+        a_val = pixel[0] >> 4;
+        b_val = pixel[1] >> 4;
+        c_val = ((pixel[2] >> 4) > MID_VAL) ? 1 : 0;
+        a_val = (((a_val - MIN_VAL) * (conv->a_max - conv->a_min)) / (MAX_VAL - MIN_VAL)) + conv->a_min;
+        b_val = (((b_val - MIN_VAL) * (conv->b_max - conv->b_min)) / (MAX_VAL - MIN_VAL)) + conv->b_min;
+    }
+
+    return sprintf(text, "s=%u,%u,%u,%u,%u,%u\n",
+                   x + conv->w_off,  y + conv->h_off, a_val, b_val, c_val,1); // x, y, a, b, c, intl_a
+}
+
+
+/*
+Converts a band's rows, even rows left to right and odd rows right to left
+so the galvos sweep back and forth.
+*/
+static bool convert_band(const struct conversion *conv, unsigned int index, struct band *band)
+{
+    unsigned int first_row = index * BAND_ROWS;
+    unsigned int last_row = first_row + BAND_ROWS < conv->h ? first_row + BAND_ROWS : conv->h;
+    unsigned int x, y;
+    size_t len = 0;
+
+    band->text = malloc((size_t)(last_row - first_row) * conv->w * SAMPLE_LINE_MAX);
+    if (band->text == NULL) {
+        return false;
+    }
+
+    for (y = first_row; y < last_row; y++) {
+        if (y & 1) { // Odd row
+            for (x = conv->w; x-- > 0;) {
+                len += convert_pixel(conv, x, y, band->text + len);
+            }
+        } else { // Even row
+            for (x = 0; x < conv->w; x++) {
+                len += convert_pixel(conv, x, y, band->text + len);
+            }
+        }
+    }
+
+    band->len = len;
+    return true;
+}
+
+
+static void *convert_thread(void *arg)
+{
+    struct conversion *conv = arg;
+    unsigned int index;
+    bool rc;
+
+    pthread_mutex_lock(&conv->lock);
+    while (!conv->abort && conv->next_band < conv->band_count) {
+        if (conv->next_band >= conv->written_bands + conv->bands_ahead) {
+            pthread_cond_wait(&conv->band_written, &conv->lock);
+            continue;
+        }
+        index = conv->next_band++;
+        pthread_mutex_unlock(&conv->lock);
+
+        rc = convert_band(conv, index, &conv->bands[index]);
+
+        pthread_mutex_lock(&conv->lock);
+        if (!rc) {
+            conv->abort = true;
+        }
+        conv->bands[index].done = true;
+        pthread_cond_broadcast(&conv->band_done);
+    }
+    pthread_mutex_unlock(&conv->lock);
+
+    return NULL;
+}
+
+
+/*
+Writes the finished bands to stdout in order. Returns false if a band could
+not be converted.
+*/
+static bool write_bands(struct conversion *conv)
+{
+    struct band *band;
+    unsigned int i;
+
+    for (i = 0; i < conv->band_count; i++) {
+        band = &conv->bands[i];
+
+        pthread_mutex_lock(&conv->lock);
+        while (!band->done && !conv->abort) {
+            pthread_cond_wait(&conv->band_done, &conv->lock);
+        }
+        pthread_mutex_unlock(&conv->lock);
+        if (!band->done || band->text == NULL) {
+            fprintf(stderr, "Out of memory converting the image\n");
+            return false;
+        }
+
+        fwrite(band->text, 1, band->len, stdout);
+        free(band->text);
+        band->text = NULL;
+
+        pthread_mutex_lock(&conv->lock);
+        conv->written_bands++;
+        pthread_cond_broadcast(&conv->band_written);
+        pthread_mutex_unlock(&conv->lock);
+    }
+
+    return true;
 }
 
 
@@ -62,21 +270,19 @@ int main (int argc, char *argv[])
     int rc;
     int ret = 1;
     int c;
+    unsigned int i;
     unsigned int w, h;
-    unsigned int w_off, h_off;
-    uint16_t *image;
+    uint16_t *image = NULL;
 
-    int sample_count;
-    int count = 0;
-    int tmp_pos;
-    unsigned int curr_x_pos = 0, curr_y_pos = 0;
     unsigned int a_min = MIN_VAL;
     unsigned int a_max = MAX_VAL;
     unsigned int b_min = MIN_VAL;
     unsigned int b_max = MAX_VAL;
-    unsigned int a_val;
-    unsigned int b_val;
-    unsigned int c_val;
+
+    struct conversion conv;
+    pthread_t threads[MAX_THREADS];
+    int thread_count = 0;
+    int threads_started = 0;
 
     int aflag = 0;
     int Aflag = 0;
@@ -90,10 +296,11 @@ int main (int argc, char *argv[])
     char* path = NULL;
     int rflag = 0;
     int rate = 20000;
+    int jflag = 0;
 
 
     opterr_portable = 1;
-    while (-1 != (c =getopt_portable(argc, argv, "a:A:b:B:hmgxp:r:"))) {
+    while (-1 != (c =getopt_portable(argc, argv, "a:A:b:B:hj:mgxp:r:"))) {
         switch(c) {
         case 'a':
             aflag++;
@@ -131,6 +338,10 @@ int main (int argc, char *argv[])
             rflag++;
             rate = atoi(optarg_portable);
             break;
+        case 'j':
+            jflag++;
+            thread_count = atoi(optarg_portable);
+            break;
         default:
             print_help(argv[0], stderr);
             exit(1);
@@ -140,7 +351,7 @@ int main (int argc, char *argv[])
 
     if (aflag > 1 || Aflag > 1 || bflag > 1 || Bflag > 1 ||
             hflag > 1 ||
-            mflag > 1 || gflag > 1 || xflag > 1 || xflag > 1 || rflag > 1 || pflag > 1) {
+            mflag > 1 || gflag > 1 || xflag > 1 || xflag > 1 || rflag > 1 || pflag > 1 || jflag > 1) {
         fprintf(stderr, "Cannot specify flags more than once.\n");
         print_help(argv[0], stderr);
         goto out_post;
@@ -194,12 +405,24 @@ int main (int argc, char *argv[])
         goto out_post;
     }
 
+    if (!jflag) {
+        thread_count = cpu_count();
+        if (thread_count > MAX_THREADS) {
+            thread_count = MAX_THREADS;
+        }
+    } else if (thread_count < 1 || thread_count > MAX_THREADS) {
+        fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+        print_help(argv[0], stderr);
+        goto out_post;
+    }
+
     if (hflag) {
         print_help(argv[0], stdout);
         goto out_post;
     }
 
 
+    memset(&conv, 0, sizeof(conv));
     rc = lodepng_decode_file((unsigned char**)&image, &w, &h, path, LCT_RGB, 16);
     if (rc) {
         fprintf(stderr, "Error opening image: %s\n", lodepng_error_text(rc));
@@ -208,70 +431,69 @@ int main (int argc, char *argv[])
 
     if (w > MAX_WIDTH || h > MAX_HEIGHT) {
         fprintf(stderr, "Image cannot be larger than 4096 pixels in width or height\n");
-        goto out_post;
+        goto out;
     }
 
-    w_off = (MAX_WIDTH - w) / 2;
-    h_off = (MAX_HEIGHT - h) / 2;
-    sample_count = w * h;
+    conv.image = image;
+    conv.w = w;
+    conv.h = h;
+    conv.w_off = (MAX_WIDTH - w) / 2;
+    conv.h_off = (MAX_HEIGHT - h) / 2;
+    conv.mode = mflag ? MODE_MONO : gflag ? MODE_GREY : MODE_RGB;
+    conv.a_min = a_min;
+    conv.a_max = a_max;
+    conv.b_min = b_min;
+    conv.b_max = b_max;
+    conv.band_count = (h + BAND_ROWS - 1) / BAND_ROWS;
+    conv.bands_ahead = thread_count * BANDS_AHEAD_PER_THREAD;
+    conv.bands = calloc(conv.band_count, sizeof(struct band));
+    if (conv.bands == NULL) {
+        fprintf(stderr, "Out of memory converting the image\n");
+        goto out;
+    }
+    pthread_mutex_init(&conv.lock, NULL);
+    pthread_cond_init(&conv.band_done, NULL);
+    pthread_cond_init(&conv.band_written, NULL);
 
     printf("r=%d\n", rate);
     printf("e=1\n");
     printf("p=Image dimensions: %d x %d\n", w, h);
 
-    while (count < sample_count) {
-        tmp_pos = (curr_y_pos*w + curr_x_pos)*3;
-        if (mflag) {
-            a_val = (((image[tmp_pos] +
-                       image[tmp_pos + 1] +
-                       image[tmp_pos + 2])/3 >> 4) > MID_VAL) ? MAX_VAL : MIN_VAL;
-            b_val = 0;
-            c_val = 0;
-            a_val = (((a_val - MIN_VAL) * (a_max - a_min)) / (MAX_VAL - MIN_VAL)) + a_min;
-        } else if (gflag) {
-            a_val = (image[tmp_pos] +
-                     image[tmp_pos + 1] +
-                     image[tmp_pos + 2])/3 >> 4;
-            b_val = 0;
-            c_val = 0;
-            a_val = (((a_val - MIN_VAL) * (a_max - a_min)) / (MAX_VAL - MIN_VAL)) + a_min;
-        } else {
-            a_val = image[tmp_pos] >> 4;
-            b_val = image[tmp_pos+1] >> 4;
-            c_val = ((image[tmp_pos+2] >> 4) > MID_VAL) ? 1 : 0;
-            a_val = (((a_val - MIN_VAL) * (a_max - a_min)) / (MAX_VAL - MIN_VAL)) + a_min;
-            b_val = (((b_val - MIN_VAL) * (b_max - b_min)) / (MAX_VAL - MIN_VAL)) + b_min;
-        }
-
-        printf("s=%u,%u,%u,%u,%u,%u\n",
-               curr_x_pos + w_off,  curr_y_pos + h_off, a_val, b_val, c_val,1); // x, y, a, b, c, intl_a
-
-        count++;
-
-        //printf("\tx:\t%d\ty:\t%d\t= %d\n", curr_y_pos, curr_x_pos, val);
-
-        if (curr_y_pos & 1) { // Odd row
-            if (curr_x_pos == 0) {
-                curr_y_pos++;
-            } else {
-                curr_x_pos--;
-            }
-        } else { // Even row
-            if (curr_x_pos == w-1) {
-                curr_y_pos++;
-            } else {
-                curr_x_pos++;
-            }
+    for (threads_started = 0; threads_started < thread_count; threads_started++) {
+        rc = pthread_create(&threads[threads_started], NULL, convert_thread, &conv);
+        if (rc) {
+            fprintf(stderr, "Could not start conversion thread: %d\n", rc);
+            break;
         }
     }
-
-
-    free(image);
+    // Any thread started gets through the whole image.
+    if (threads_started == 0 || !write_bands(&conv)) {
+        goto out;
+    }
 
     printf("f=1\n");
     printf("e=0\n");
 
     ret = 0;
+out:
+    if (conv.bands != NULL) {
+        // Workers may be waiting for the output to catch up.
+        pthread_mutex_lock(&conv.lock);
+        conv.abort = true;
+        pthread_cond_broadcast(&conv.band_written);
+        pthread_mutex_unlock(&conv.lock);
+        for (i = 0; i < (unsigned int)threads_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (i = 0; i < conv.band_count; i++) {
+            free(conv.bands[i].text);
+        }
+        free(conv.bands);
+        pthread_mutex_destroy(&conv.lock);
+        pthread_cond_destroy(&conv.band_done);
+        pthread_cond_destroy(&conv.band_written);
+    }
+    free(image);
 out_post:
     return ret;
 }
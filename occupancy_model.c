@@ -0,0 +1,126 @@
+/*
+occupancy_model.c - Host side estimate of how many samples are queued ahead
+of a Lasershark's output.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "occupancy_model.h"
+
+
+/*
+Drains the estimate at the current rate up to now_us.
+*/
+static void advance(struct occupancy_model *m, uint64_t now_us)
+{
+    double played;
+
+    if (now_us <= m->last_us) {
+        return;
+    }
+
+    played = (double)(now_us - m->last_us) * m->rate / 1000000.0;
+    m->level -= played;
+    if (m->level < 0) {
+        m->level = 0;
+    }
+    m->last_us = now_us;
+}
+
+
+void occupancy_model_init(struct occupancy_model *m, uint32_t rate, uint64_t now_us)
+{
+    memset(m, 0, sizeof(struct occupancy_model));
+    m->rate = rate;
+    m->last_us = now_us;
+    m->last_sync_us = now_us;
+}
+
+
+void occupancy_model_set_rate(struct occupancy_model *m, uint32_t rate, uint64_t now_us)
+{
+    advance(m, now_us);
+    m->rate = rate;
+}
+
+
+void occupancy_model_add(struct occupancy_model *m, uint32_t samples, uint64_t now_us)
+{
+    advance(m, now_us);
+    m->level += samples;
+}
+
+
+double occupancy_model_level(struct occupancy_model *m, uint64_t now_us)
+{
+    advance(m, now_us);
+    return m->level;
+}
+
+
+void occupancy_model_sync(struct occupancy_model *m, uint32_t queued_samples, uint64_t now_us)
+{
+    double error;
+
+    advance(m, now_us);
+
+    error = fabs(m->level - queued_samples);
+    m->syncs++;
+    m->sync_error_total += error;
+    if (error > m->sync_error_max) {
+        m->sync_error_max = error;
+    }
+
+    m->level = queued_samples;
+    m->last_sync_us = now_us;
+}
+
+
+bool occupancy_model_sync_due(struct occupancy_model *m, uint64_t now_us)
+{
+    return now_us - m->last_sync_us >= OCCUPANCY_SYNC_INTERVAL_US;
+}
+
+
+uint64_t occupancy_model_time_until(struct occupancy_model *m, double level, uint64_t now_us)
+{
+    advance(m, now_us);
+
+    if (m->level <= level) {
+        return 0;
+    }
+    if (m->rate == 0) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)ceil((m->level - level) * 1000000.0 / m->rate);
+}
+
+
+uint32_t occupancy_model_samples_for_us(struct occupancy_model *m, uint64_t us)
+{
+    return (uint32_t)(us * m->rate / 1000000);
+}
+
+
+void occupancy_model_print_stats(struct occupancy_model *m)
+{
+    printf("Occupancy model: %u syncs, %.1f samples average error, %.0f samples largest error\n",
+           m->syncs, m->syncs ? m->sync_error_total / m->syncs : 0.0, m->sync_error_max);
+}
@@ -0,0 +1,94 @@
+/*
+occupancy_model.h - Host side estimate of how many samples are queued ahead
+of a Lasershark's output.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCCUPANCY_MODEL_H
+#define OCCUPANCY_MODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How often the estimate should be checked against the device, in us.
+#define OCCUPANCY_SYNC_INTERVAL_US 100000
+
+/*
+The model counts samples sent to the device and drains them at the ilda rate.
+The count includes samples still in flight on the bus, so it reflects the
+latency between sending a sample and it being displayed. That is why the
+estimate isn't capped at the device's ringbuffer size: samples the device
+can't take yet wait on the bus and still add to the latency. Time is always
+passed in by the caller, in us, which lets the model run on any clock, see
+occupancy_model_driver.c.
+*/
+struct occupancy_model
+{
+    uint32_t rate;
+    // Estimated samples queued as of last_us.
+    double level;
+    uint64_t last_us;
+    uint64_t last_sync_us;
+
+    // Statistics
+    uint32_t syncs;
+    double sync_error_total;
+    double sync_error_max;
+};
+
+void occupancy_model_init(struct occupancy_model *m, uint32_t rate, uint64_t now_us);
+
+/*
+Switches to a new ilda rate, draining at the old rate up to now first.
+*/
+void occupancy_model_set_rate(struct occupancy_model *m, uint32_t rate, uint64_t now_us);
+
+/*
+Accounts for samples just handed to USB.
+*/
+void occupancy_model_add(struct occupancy_model *m, uint32_t samples, uint64_t now_us);
+
+/*
+Returns the estimated number of samples queued at now_us.
+*/
+double occupancy_model_level(struct occupancy_model *m, uint64_t now_us);
+
+/*
+Replaces the estimate with a measured one: the samples the device reports in
+its ringbuffer plus those the caller knows to be in flight.
+*/
+void occupancy_model_sync(struct occupancy_model *m, uint32_t queued_samples, uint64_t now_us);
+
+/*
+Returns true once OCCUPANCY_SYNC_INTERVAL_US has passed since the last sync.
+*/
+bool occupancy_model_sync_due(struct occupancy_model *m, uint64_t now_us);
+
+/*
+Returns how long until at most level samples are queued, 0 if that is
+already the case. Returns UINT64_MAX if the queue isn't draining.
+*/
+uint64_t occupancy_model_time_until(struct occupancy_model *m, double level, uint64_t now_us);
+
+/*
+Converts a latency in us to a sample count at the current rate.
+*/
+uint32_t occupancy_model_samples_for_us(struct occupancy_model *m, uint64_t us);
+
+void occupancy_model_print_stats(struct occupancy_model *m);
+
+#endif
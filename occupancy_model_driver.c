@@ -0,0 +1,180 @@
+/*
+occupancy_model_driver.c - Runs the occupancy model against a simulated
+Lasershark on a fake clock and checks that pacing by it holds the latency.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <math.h>
+#include "getopt_portable.h"
+#include "occupancy_model.h"
+
+#define PACKET_SAMPLES 64
+#define RUN_US 20000000ULL
+// The rate changes half way through, like an "r=" command would.
+#define FIRST_RATE 20000
+#define SECOND_RATE 30000
+#define TARGET_LATENCY_US 50000
+// Longest step of the fake clock, in us.
+#define STEP_MAX_US 1000
+#define DRIFT_PPM_DEFAULT 2000
+
+
+/*
+The simulated device. It plays samples at its own clock, which runs drift_ppm
+off from the host's, so only the syncs can keep the model honest.
+*/
+struct device
+{
+    uint32_t rate;
+    double drift;
+    double level;
+    uint64_t last_us;
+    uint32_t underruns;
+};
+
+
+static void device_advance(struct device *d, uint64_t now_us)
+{
+    d->level -= (double)(now_us - d->last_us) * d->rate * d->drift / 1000000.0;
+    if (d->level < 0) {
+        d->level = 0;
+        d->underruns++;
+    }
+    d->last_us = now_us;
+}
+
+
+void print_help(const char* prog_name, FILE* stream)
+{
+    fprintf(stream, "%s [OPTIONS] - Checks the occupancy model against a simulated device clock\n", prog_name);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-d <Drift in ppm>\n");
+    fprintf(stream, "\t\tHow much faster the device clock runs than the host's (default %d)\n",
+            DRIFT_PPM_DEFAULT);
+}
+
+
+int main (int argc, char *argv[])
+{
+    int c;
+    struct occupancy_model model;
+    struct device dev = {0};
+    uint64_t now_us = 0, wait_us;
+    double target, error, error_max = 0, sync_bound;
+    uint64_t packets = 0;
+    bool waited = false;
+
+    int hflag = 0;
+    int dflag = 0;
+    int drift_ppm = DRIFT_PPM_DEFAULT;
+
+    opterr_portable = 1;
+    while (-1 != (c = getopt_portable(argc, argv, "hd:"))) {
+        switch(c) {
+        case 'h':
+            hflag++;
+            break;
+        case 'd':
+            dflag++;
+            drift_ppm = atoi(optarg_portable);
+            break;
+        default:
+            print_help(argv[0], stderr);
+            exit(1);
+        }
+    }
+
+    if (hflag > 1 || dflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
+    }
+
+    if (drift_ppm < -100000 || drift_ppm > 100000) {
+        fprintf(stderr, "Drift must be between -100000 and 100000 ppm\n");
+        exit(1);
+    }
+
+    dev.rate = FIRST_RATE;
+    dev.drift = 1.0 + drift_ppm / 1000000.0;
+    occupancy_model_init(&model, FIRST_RATE, now_us);
+
+    while (now_us < RUN_US) {
+        if (now_us >= RUN_US / 2 && dev.rate != SECOND_RATE) {
+            device_advance(&dev, now_us);
+            dev.rate = SECOND_RATE;
+            occupancy_model_set_rate(&model, SECOND_RATE, now_us);
+            waited = false;
+        }
+
+        device_advance(&dev, now_us);
+        if (occupancy_model_sync_due(&model, now_us)) {
+            occupancy_model_sync(&model, (uint32_t)dev.level, now_us);
+        }
+
+        // Paced the way lasershark_stdin -L paces its packets.
+        target = occupancy_model_samples_for_us(&model, TARGET_LATENCY_US);
+        target = target > PACKET_SAMPLES ? target - PACKET_SAMPLES : 0;
+        wait_us = occupancy_model_time_until(&model, target, now_us);
+        if (wait_us == 0) {
+            dev.level += PACKET_SAMPLES;
+            occupancy_model_add(&model, PACKET_SAMPLES, now_us);
+            packets++;
+
+            // Once the queue is filled up to the target, after startup and
+            // after the rate change, each packet should top it up to the
+            // target again.
+            if (waited) {
+                error = fabs(dev.level - (target + PACKET_SAMPLES));
+                if (error > error_max) {
+                    error_max = error;
+                }
+            }
+            waited = false;
+            continue;
+        }
+
+        now_us += wait_us < STEP_MAX_US ? wait_us : STEP_MAX_US;
+        waited = true;
+    }
+
+    occupancy_model_print_stats(&model);
+    printf("%" PRIu64 " packets, %u underruns, %.1f samples largest distance from the target\n",
+           packets, dev.underruns, error_max);
+
+    // Between syncs the model can only be off by what the drift adds up to,
+    // plus the rounding of the device's count. A sync can come up to a clock
+    // step late.
+    sync_bound = fabs(drift_ppm / 1000000.0) * SECOND_RATE * (OCCUPANCY_SYNC_INTERVAL_US + STEP_MAX_US) / 1000000.0 + 2;
+    if (dev.underruns || model.sync_error_max > sync_bound || error_max > sync_bound + PACKET_SAMPLES) {
+        printf("FAILED, errors must stay within %.1f samples\n", sync_bound);
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
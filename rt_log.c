@@ -0,0 +1,171 @@
+/*
+rt_log.c - Counters and messages that realtime threads can post without
+blocking, printed later from a thread that is allowed to block.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "rt_log.h"
+#include "spsc_ring.h"
+#include "time_portable.h"
+
+// Messages only carry numbers, formatting waits until they are drained.
+struct rt_log_msg
+{
+    uint64_t time_us;
+    int type;
+    int board;
+    int32_t a;
+    int32_t b;
+};
+
+struct rt_log
+{
+    const struct rt_log_event_type *types;
+    int type_count;
+    atomic_ullong *counters;
+
+    int sources;
+    struct spsc_ring **rings;
+    atomic_ullong dropped;
+
+    uint64_t start_us;
+};
+
+
+struct rt_log *rt_log_create(const struct rt_log_event_type *types, int type_count,
+                             int sources, uint32_t depth)
+{
+    struct rt_log *log;
+    int i;
+
+    if (type_count < 1 || sources < 1) {
+        return NULL;
+    }
+
+    log = calloc(1, sizeof(struct rt_log));
+    if (log == NULL) {
+        return NULL;
+    }
+    log->types = types;
+    log->type_count = type_count;
+    log->sources = sources;
+    log->start_us = time_portable_now_us();
+    atomic_init(&log->dropped, 0);
+
+    log->counters = calloc(type_count, sizeof(atomic_ullong));
+    log->rings = calloc(sources, sizeof(struct spsc_ring *));
+    if (log->counters == NULL || log->rings == NULL) {
+        goto fail;
+    }
+    for (i = 0; i < type_count; i++) {
+        atomic_init(&log->counters[i], 0);
+    }
+    for (i = 0; i < sources; i++) {
+        log->rings[i] = spsc_ring_create(depth, sizeof(struct rt_log_msg));
+        if (log->rings[i] == NULL) {
+            goto fail;
+        }
+    }
+
+    return log;
+
+fail:
+    rt_log_destroy(log);
+    return NULL;
+}
+
+
+void rt_log_destroy(struct rt_log *log)
+{
+    int i;
+
+    if (log == NULL) {
+        return;
+    }
+
+    if (log->rings) {
+        for (i = 0; i < log->sources; i++) {
+            spsc_ring_destroy(log->rings[i]);
+        }
+    }
+    free(log->rings);
+    free(log->counters);
+    free(log);
+}
+
+
+void rt_log_count(struct rt_log *log, int type, uint64_t n)
+{
+    atomic_fetch_add_explicit(&log->counters[type], n, memory_order_relaxed);
+}
+
+
+void rt_log_post(struct rt_log *log, int source, int type, int board, int32_t a, int32_t b)
+{
+    struct rt_log_msg *msg;
+
+    atomic_fetch_add_explicit(&log->counters[type], 1, memory_order_relaxed);
+    if (log->types[type].format == NULL) {
+        return;
+    }
+
+    msg = spsc_ring_claim(log->rings[source]);
+    if (msg == NULL) {
+        atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    msg->time_us = time_portable_now_us();
+    msg->type = type;
+    msg->board = board;
+    msg->a = a;
+    msg->b = b;
+    spsc_ring_publish(log->rings[source]);
+}
+
+
+int rt_log_drain(struct rt_log *log, FILE *stream)
+{
+    struct rt_log_msg *msg;
+    int i, count = 0;
+
+    for (i = 0; i < log->sources; i++) {
+        while ((msg = spsc_ring_peek(log->rings[i])) != NULL) {
+            fprintf(stream, "[%.3f] ", (msg->time_us - log->start_us) / 1000000.0);
+            fprintf(stream, log->types[msg->type].format, msg->board, msg->a, msg->b);
+            fputc('\n', stream);
+            spsc_ring_release(log->rings[i]);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+void rt_log_print_counters(struct rt_log *log, FILE *stream)
+{
+    int i;
+
+    for (i = 0; i < log->type_count; i++) {
+        fprintf(stream, "%s: %llu\n", log->types[i].name,
+                (unsigned long long)atomic_load_explicit(&log->counters[i], memory_order_relaxed));
+    }
+    fprintf(stream, "Log messages dropped: %llu\n",
+            (unsigned long long)atomic_load_explicit(&log->dropped, memory_order_relaxed));
+}
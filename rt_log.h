@@ -0,0 +1,73 @@
+/*
+rt_log.h - Counters and messages that realtime threads can post without
+blocking, printed later from a thread that is allowed to block.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RT_LOG_H
+#define RT_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct rt_log;
+
+/*
+Describes one kind of event. Each kind has a counter shown as name. format,
+if not NULL, prints a posted message and is given its board, a and b as
+three ints.
+*/
+struct rt_log_event_type
+{
+    const char *name;
+    const char *format;
+};
+
+/*
+Creates a log for type_count kinds of event. Every source gets its own
+message ring of depth entries, so each source must only ever be posted to
+by one thread at a time. Returns NULL on failure.
+*/
+struct rt_log *rt_log_create(const struct rt_log_event_type *types, int type_count,
+                             int sources, uint32_t depth);
+
+void rt_log_destroy(struct rt_log *log);
+
+/*
+Adds n to a counter without queueing a message. Wait-free.
+*/
+void rt_log_count(struct rt_log *log, int type, uint64_t n);
+
+/*
+Counts an event and queues its message on source's ring. Messages that
+don't fit are counted as dropped rather than waited on. Wait-free.
+*/
+void rt_log_post(struct rt_log *log, int source, int type, int board, int32_t a, int32_t b);
+
+/*
+Prints and removes every queued message, one source after another, so
+messages are only in order within a source. Must only be called from one
+thread at a time. Returns the number printed.
+*/
+int rt_log_drain(struct rt_log *log, FILE *stream);
+
+/*
+Prints every counter and how many messages were dropped.
+*/
+void rt_log_print_counters(struct rt_log *log, FILE *stream);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+sample_parse.c - Parsers for lasershark_stdin's "s=x,y,a,b,c,intl_a" sample
+lines.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "sample_parse.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SAMPLE_PARSE_SSE2 1
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SAMPLE_PARSE_SWAR 1
+#endif
+
+// Shortest possible sample line, "s=0,0,0,0,0,0\n"
+#define SAMPLE_LINE_MIN_LEN 14
+
+// Bytes looked at in one go by the vectorized line parser.
+#define SAMPLE_WINDOW_LEN 32
+
+// Widest field the fast paths convert, wider ones (leading zeros) go the slow way.
+#define SAMPLE_FIELD_MAX_DIGITS 8
+
+
+static inline void set_sample(struct lasershark_sample *sample, unsigned int x, unsigned int y,
+                              unsigned int a, unsigned int b, unsigned int c, unsigned int intl_a)
+{
+    sample->x = x;
+    sample->y = y;
+    sample->a = a;
+    sample->pad = 0;
+    sample->b = b;
+    sample->c = c;
+    sample->intl_a = intl_a;
+}
+
+
+// Sample integers are parsed this way vs scanf/etc for speed reasons.
+static inline bool parse_sample_integer(const char* line, size_t len, unsigned int *pos, unsigned int *val, uint32_t dac_max)
+{
+    unsigned int orig_pos = *pos;
+    *val = 0;
+    while (*pos < len && line[*pos] >= '0' && line[*pos] <= '9') {
+        *val = 10*(*val) + line[*pos]-'0';
+        (*pos)++;
+        if (*val > dac_max) {
+            return false;
+        }
+    }
+
+    return orig_pos != *pos;
+}
+
+
+/*
+Parses the fields of a sample line, leaving pos just past intl_a.
+*/
+static bool parse_sample_fields(const char *line, size_t len, uint32_t dac_max, struct lasershark_sample *sample,
+                                unsigned int *end_pos)
+{
+    unsigned int x, y, a, b, c, intl_a;
+    unsigned int pos;
+
+    // Lets make a giant if statement for fun
+    if (
+        len < SAMPLE_LINE_MIN_LEN ||
+        (pos = 0, line[pos] != 's') || (pos++, line[pos] != '=') ||
+        (pos++, !parse_sample_integer(line, len, &pos, &x, dac_max)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, !parse_sample_integer(line, len, &pos, &y, dac_max)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, !parse_sample_integer(line, len, &pos, &a, dac_max)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, !parse_sample_integer(line, len, &pos, &b, dac_max)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, pos >= len) || (c=line[pos]-'0', c > 1) ||
+        (pos++, pos >= len) || line[pos] !=',' ||
+        (pos++, pos >= len) || (intl_a=line[pos]-'0', intl_a > 1)
+    ) {
+        return false;
+    }
+
+    set_sample(sample, x, y, a, b, c, intl_a);
+    *end_pos = pos + 1;
+    return true;
+}
+
+
+bool parse_sample_line(const char *line, size_t len, uint32_t dac_max, struct lasershark_sample *sample)
+{
+    unsigned int pos;
+
+    return parse_sample_fields(line, len, dac_max, sample, &pos);
+}
+
+
+bool parse_routed_sample_line(const char *line, size_t len, uint32_t dac_max, uint32_t board_count,
+                              struct lasershark_sample *sample, uint32_t *board)
+{
+    unsigned int pos, val;
+
+    if (!parse_sample_fields(line, len, dac_max, sample, &pos) ||
+            pos >= len || line[pos] != ',' ||
+            (pos++, !parse_sample_integer(line, len, &pos, &val, board_count - 1))) {
+        return false;
+    }
+
+    *board = val;
+    return true;
+}
+
+
+/*
+Converts the n (1 to SAMPLE_FIELD_MAX_DIGITS) ASCII digits at p to an
+integer. 8 bytes must be readable at p.
+*/
+static inline uint32_t parse_digits(const char *p, unsigned int n)
+{
+#ifdef SAMPLE_PARSE_SWAR
+    // Turn the digits into their values, shift them up so the ones digit is
+    // the top byte (which also drops whatever followed them) and combine all
+    // eight bytes at once: pairs, then quads, then the two quads.
+    uint64_t chunk;
+
+    memcpy(&chunk, p, sizeof(chunk));
+    chunk -= 0x3030303030303030ULL;
+    chunk <<= 8*(8 - n);
+    chunk = (chunk * 10) + (chunk >> 8);
+    chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+             (((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t)chunk;
+#else
+    uint32_t val = 0;
+    while (n--) {
+        val = 10*val + (*p++ - '0');
+    }
+    return val;
+#endif
+}
+
+
+#ifdef SAMPLE_PARSE_SSE2
+/*
+Parses one sample line using a SAMPLE_WINDOW_LEN byte window that must be
+readable past line. Digit and comma positions for the whole window are found
+with two vector compares each; the fields between the commas are then
+validated against the digit mask and converted without a per character loop.
+On success returns the line length including its newline, 0 if the line
+needs the scalar path (malformed, too long or cut off).
+*/
+static inline size_t parse_sample_window(const char *line, const char *end, uint32_t dac_max,
+                                         struct lasershark_sample *sample)
+{
+    const __m128i zero_char = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i comma = _mm_set1_epi8(',');
+    __m128i lo = _mm_loadu_si128((const __m128i*)line);
+    __m128i hi = _mm_loadu_si128((const __m128i*)(line + 16));
+    __m128i lo_digit = _mm_sub_epi8(lo, zero_char);
+    __m128i hi_digit = _mm_sub_epi8(hi, zero_char);
+    // Copy of the window with slack so parse_digits() can read 8 bytes anywhere in it.
+    char window[SAMPLE_WINDOW_LEN + 8];
+    uint32_t digits, commas, field_mask, span;
+    unsigned int vals[4];
+    unsigned int pos = 2, next, n, i, c, intl_a;
+    const char *nl;
+
+    if (line[0] != 's' || line[1] != '=') {
+        return 0;
+    }
+
+    _mm_storeu_si128((__m128i*)window, lo);
+    _mm_storeu_si128((__m128i*)(window + 16), hi);
+    memset(window + SAMPLE_WINDOW_LEN, 0, 8);
+
+    // Unsigned (byte - '0') <= 9 picks out the digits.
+    digits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(lo_digit, nine), nine)) |
+             ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(hi_digit, nine), nine)) << 16);
+    commas = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, comma)) |
+             ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, comma)) << 16);
+
+    for (i = 0; i < 4; i++) {
+        if (pos >= SAMPLE_WINDOW_LEN) {
+            return 0;
+        }
+        field_mask = commas & ~((1U << pos) - 1);
+        if (!field_mask) {
+            return 0;
+        }
+        next = __builtin_ctz(field_mask);
+        n = next - pos;
+        if (n == 0 || n > SAMPLE_FIELD_MAX_DIGITS) {
+            return 0;
+        }
+        span = ((1U << n) - 1) << pos;
+        if ((digits & span) != span) {
+            return 0;
+        }
+        vals[i] = parse_digits(window + pos, n);
+        if (vals[i] > dac_max) {
+            return 0;
+        }
+        pos = next + 1;
+    }
+
+    // c, comma, intl_a and at least the newline must sit inside the window.
+    if (pos + 3 >= SAMPLE_WINDOW_LEN) {
+        return 0;
+    }
+    c = line[pos] - '0';
+    intl_a = line[pos + 2] - '0';
+    if (c > 1 || line[pos + 1] != ',' || intl_a > 1) {
+        return 0;
+    }
+
+    pos += 3;
+    if (line[pos] != '\n') {
+        // Trailing comment or whitespace, skip to the end of the line.
+        nl = memchr(line + pos, '\n', end - (line + pos));
+        if (nl == NULL) {
+            return 0;
+        }
+        pos = nl - line;
+    }
+
+    set_sample(sample, vals[0], vals[1], vals[2], vals[3], c, intl_a);
+    return pos + 1;
+}
+#endif
+
+
+size_t parse_sample_lines(const char *buf, size_t len, uint32_t dac_max,
+                          struct lasershark_sample *out, uint32_t max_samples, uint32_t *count)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *nl;
+    size_t line_len;
+    uint32_t n = 0;
+
+    while (n < max_samples && end - p >= SAMPLE_LINE_MIN_LEN && p[0] == 's') {
+#ifdef SAMPLE_PARSE_SSE2
+        if (end - p >= SAMPLE_WINDOW_LEN) {
+            line_len = parse_sample_window(p, end, dac_max, &out[n]);
+            if (line_len) {
+                p += line_len;
+                n++;
+                continue;
+            }
+        }
+#endif
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            break;
+        }
+        line_len = nl + 1 - p;
+        if (!parse_sample_line(p, line_len, dac_max, &out[n])) {
+            break;
+        }
+        p += line_len;
+        n++;
+    }
+
+    *count = n;
+    return p - buf;
+}
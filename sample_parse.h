@@ -0,0 +1,54 @@
+/*
+sample_parse.h - Parsers for lasershark_stdin's "s=x,y,a,b,c,intl_a" sample
+lines.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAMPLE_PARSE_H
+#define SAMPLE_PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "lasershark_sample.h"
+
+/*
+Parses a single sample line of len bytes. x, y, a and b must not exceed
+dac_max. Returns false if the line is malformed.
+*/
+bool parse_sample_line(const char *line, size_t len, uint32_t dac_max, struct lasershark_sample *sample);
+
+/*
+Parses a sample line with a trailing board field, "s=x,y,a,b,c,intl_a,board",
+storing the board in *board. board must be below board_count. Returns false
+if the line is malformed.
+*/
+bool parse_routed_sample_line(const char *line, size_t len, uint32_t dac_max, uint32_t board_count,
+                              struct lasershark_sample *sample, uint32_t *board);
+
+/*
+Parses the run of complete, newline terminated sample lines at the start of
+buf into out, stopping after max_samples lines, at the first line that isn't
+a well formed sample or at a line that is cut off by the end of buf.
+Lines it stops at are left for parse_sample_line() so they get reported the
+usual way. Sets *count to the number of samples parsed and returns the
+number of bytes they took up.
+*/
+size_t parse_sample_lines(const char *buf, size_t len, uint32_t dac_max,
+                          struct lasershark_sample *out, uint32_t max_samples, uint32_t *count);
+
+#endif
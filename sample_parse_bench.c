@@ -0,0 +1,216 @@
+/*
+sample_parse_bench.c - Times parsing generated "s=" lines one at a time with
+parse_sample_line() against in runs with parse_sample_lines(), and checks
+that both give the same samples.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "getopt_portable.h"
+#include "sample_parse.h"
+#include "time_portable.h"
+
+#define DAC_MAX 4095
+#define SAMPLE_COUNT_DEFAULT 1000000
+#define ROUNDS_DEFAULT 5
+// Samples parsed per parse_sample_lines() call, a Lasershark bulk packet
+#define RUN_SAMPLES 64
+
+
+void print_help(const char* prog_name, FILE* stream)
+{
+    fprintf(stream, "%s [OPTIONS] - Benchmarks the lasershark_stdin sample parsers\n", prog_name);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-n <Sample count>\n");
+    fprintf(stream, "\t\tSample lines to generate (default %d)\n", SAMPLE_COUNT_DEFAULT);
+    fprintf(stream, "\t-r <Rounds>\n");
+    fprintf(stream, "\t\tTimes to parse them with each parser, the fastest round counts (default %d)\n",
+            ROUNDS_DEFAULT);
+}
+
+
+/*
+Generates count sample lines with pseudo random values. Returns the text,
+its length in *len.
+*/
+static char *generate_lines(uint32_t count, size_t *len)
+{
+    char *text, *pos;
+    uint32_t i, seed = 1;
+
+    text = malloc((size_t)count * 32 + 1);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    pos = text;
+    for (i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        pos += sprintf(pos, "s=%u,%u,%u,%u,%u,%u\n", (seed >> 4) & DAC_MAX, (seed >> 8) & DAC_MAX,
+                       (seed >> 12) & DAC_MAX, (seed >> 16) & DAC_MAX, (seed >> 20) & 1, (seed >> 21) & 1);
+    }
+
+    *len = pos - text;
+    return text;
+}
+
+
+// Parses every line on its own, as lasershark_stdin did before runs.
+static bool parse_single(const char *text, size_t len, struct lasershark_sample *out, uint32_t *count)
+{
+    const char *line = text, *end;
+
+    *count = 0;
+    while (line < text + len) {
+        end = memchr(line, '\n', text + len - line);
+        if (end == NULL || !parse_sample_line(line, end - line + 1, DAC_MAX, &out[*count])) {
+            return false;
+        }
+        (*count)++;
+        line = end + 1;
+    }
+    return true;
+}
+
+
+static bool parse_runs(const char *text, size_t len, struct lasershark_sample *out, uint32_t *count)
+{
+    size_t pos = 0, used;
+    uint32_t parsed;
+
+    *count = 0;
+    while (pos < len) {
+        used = parse_sample_lines(text + pos, len - pos, DAC_MAX, &out[*count], RUN_SAMPLES, &parsed);
+        if (parsed == 0) {
+            return false;
+        }
+        pos += used;
+        *count += parsed;
+    }
+    return true;
+}
+
+
+int main (int argc, char *argv[])
+{
+    int ret = 1;
+    int c;
+    int i;
+    char *text = NULL;
+    size_t len;
+    struct lasershark_sample *single = NULL, *runs = NULL;
+    uint32_t single_count, runs_count;
+    uint64_t start_us, single_us = UINT64_MAX, runs_us = UINT64_MAX;
+
+    int hflag = 0;
+    int nflag = 0;
+    int rflag = 0;
+    long sample_count = SAMPLE_COUNT_DEFAULT;
+    int rounds = ROUNDS_DEFAULT;
+
+    opterr_portable = 1;
+    while (-1 != (c = getopt_portable(argc, argv, "hn:r:"))) {
+        switch(c) {
+        case 'h':
+            hflag++;
+            break;
+        case 'n':
+            nflag++;
+            sample_count = atol(optarg_portable);
+            break;
+        case 'r':
+            rflag++;
+            rounds = atoi(optarg_portable);
+            break;
+        default:
+            print_help(argv[0], stderr);
+            exit(1);
+        }
+    }
+
+    if (hflag > 1 || nflag > 1 || rflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
+    }
+
+    if (sample_count < 1 || sample_count > 100000000 || rounds < 1) {
+        fprintf(stderr, "Sample count must be between 1 and 100000000, rounds at least 1\n");
+        exit(1);
+    }
+
+    text = generate_lines(sample_count, &len);
+    single = malloc(sizeof(struct lasershark_sample)*sample_count);
+    runs = malloc(sizeof(struct lasershark_sample)*sample_count);
+    if (text == NULL || single == NULL || runs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < rounds; i++) {
+        start_us = time_portable_now_us();
+        if (!parse_single(text, len, single, &single_count)) {
+            fprintf(stderr, "parse_sample_line() rejected a generated line\n");
+            goto out;
+        }
+        start_us = time_portable_now_us() - start_us;
+        if (start_us < single_us) {
+            single_us = start_us;
+        }
+
+        start_us = time_portable_now_us();
+        if (!parse_runs(text, len, runs, &runs_count)) {
+            fprintf(stderr, "parse_sample_lines() rejected a generated line\n");
+            goto out;
+        }
+        start_us = time_portable_now_us() - start_us;
+        if (start_us < runs_us) {
+            runs_us = start_us;
+        }
+    }
+
+    if (single_count != sample_count || runs_count != sample_count ||
+            memcmp(single, runs, sizeof(struct lasershark_sample)*sample_count)) {
+        fprintf(stderr, "The parsers disagree\n");
+        goto out;
+    }
+
+    if (single_us == 0) single_us = 1;
+    if (runs_us == 0) runs_us = 1;
+    printf("%ld samples, %zu bytes, fastest of %d rounds\n", sample_count, len, rounds);
+    printf("parse_sample_line():  %8.1f ms, %6.1f Msamples/s\n", single_us / 1000.0,
+           (double)sample_count / single_us);
+    printf("parse_sample_lines(): %8.1f ms, %6.1f Msamples/s\n", runs_us / 1000.0,
+           (double)sample_count / runs_us);
+    printf("Speedup: %.2fx\n", (double)single_us / runs_us);
+    ret = 0;
+
+out:
+    free(text);
+    free(single);
+    free(runs);
+
+    return ret;
+}
@@ -0,0 +1,247 @@
+/*
+show_file.c - Precompiled lasershark_stdin shows, laid out so samples can be
+sent straight from a memory mapping of the file.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "show_file.h"
+
+
+#ifdef _WIN32
+static bool map_file(struct show_file *show, const char *path)
+{
+    LARGE_INTEGER size;
+
+    show->file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, NULL);
+    if (show->file_handle == INVALID_HANDLE_VALUE) {
+        show->file_handle = NULL;
+        return false;
+    }
+    if (!GetFileSizeEx(show->file_handle, &size) || size.QuadPart == 0 ||
+            (unsigned long long)size.QuadPart > (size_t)-1) {
+        return false;
+    }
+    show->map_len = (size_t)size.QuadPart;
+
+    show->map_handle = CreateFileMappingA(show->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (show->map_handle == NULL) {
+        return false;
+    }
+    show->map = MapViewOfFile(show->map_handle, FILE_MAP_READ, 0, 0, 0);
+    return show->map != NULL;
+}
+
+
+static void unmap_file(struct show_file *show)
+{
+    if (show->map) {
+        UnmapViewOfFile(show->map);
+    }
+    if (show->map_handle) {
+        CloseHandle(show->map_handle);
+    }
+    if (show->file_handle) {
+        CloseHandle(show->file_handle);
+    }
+}
+#else
+static bool map_file(struct show_file *show, const char *path)
+{
+    int fd;
+    struct stat st;
+    void *map;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) || st.st_size <= 0 || (unsigned long long)st.st_size > (size_t)-1) {
+        close(fd);
+        return false;
+    }
+    show->map_len = st.st_size;
+
+    map = mmap(NULL, show->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file referenced.
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    show->map = map;
+
+    // Playback runs through the samples front to back.
+    madvise(show->map, show->map_len, MADV_SEQUENTIAL);
+    return true;
+}
+
+
+static void unmap_file(struct show_file *show)
+{
+    if (show->map) {
+        munmap(show->map, show->map_len);
+    }
+}
+#endif
+
+
+// Checks that count items of size bytes at offset lie within the file.
+static bool region_fits(const struct show_file *show, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset <= show->map_len && count <= (show->map_len - offset) / size;
+}
+
+
+static bool check_tables(const struct show_file *show)
+{
+    const struct show_file_header *h = show->header;
+    uint64_t i;
+
+    if (!region_fits(show, h->sample_offset, h->sample_count, sizeof(struct lasershark_sample)) ||
+            !region_fits(show, h->command_offset, h->command_count, sizeof(struct show_command)) ||
+            !region_fits(show, h->section_offset, h->section_count, sizeof(struct show_section)) ||
+            !region_fits(show, h->string_offset, h->string_size, 1)) {
+        return false;
+    }
+    if (h->sample_offset % SHOW_FILE_SAMPLE_ALIGN || h->command_offset % sizeof(uint64_t) ||
+            h->section_offset % sizeof(uint64_t)) {
+        return false;
+    }
+    if (h->string_size && ((const char*)show->map)[h->string_offset + h->string_size - 1] != '\0') {
+        return false;
+    }
+
+    // Playback trusts these, so a bad file fails here rather than mid show.
+    for (i = 0; i < h->command_count; i++) {
+        const struct show_command *cmd = &show->commands[i];
+
+        if (cmd->sample_pos > h->sample_count || (i && cmd->sample_pos < show->commands[i-1].sample_pos) ||
+                (cmd->type == SHOW_CMD_PRINT && cmd->val >= h->string_size) ||
+                cmd->type < SHOW_CMD_SET_ILDA_RATE || cmd->type > SHOW_CMD_PRINT) {
+            return false;
+        }
+    }
+    for (i = 0; i < h->section_count; i++) {
+        const struct show_section *sec = &show->sections[i];
+
+        if (sec->sample_pos > h->sample_count || sec->command_index > h->command_count ||
+                ((sec->flags & SHOW_SECTION_HAS_ILDA_RATE) && sec->ilda_rate == 0) ||
+                sec->name[SHOW_FILE_SECTION_NAME_LEN - 1] != '\0') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+struct show_file *show_file_open(const char *path)
+{
+    struct show_file *show;
+    const char *base;
+
+    show = calloc(1, sizeof(struct show_file));
+    if (show == NULL) {
+        return NULL;
+    }
+
+    if (!map_file(show, path)) {
+        fprintf(stderr, "Could not map show file %s\n", path);
+        goto fail;
+    }
+
+    base = show->map;
+    show->header = (const struct show_file_header*)base;
+    if (show->map_len < sizeof(struct show_file_header) ||
+            memcmp(show->header->magic, SHOW_FILE_MAGIC, SHOW_FILE_MAGIC_LEN)) {
+        fprintf(stderr, "%s is not a show file\n", path);
+        goto fail;
+    }
+    if (show->header->byte_order == SHOW_FILE_BYTE_ORDER_SWAPPED) {
+        fprintf(stderr, "Show file %s was compiled on a machine with a different byte order, "
+                "recompile it on this one\n", path);
+        goto fail;
+    }
+    if (show->header->version != SHOW_FILE_VERSION) {
+        fprintf(stderr, "Show file %s is version %u, only version %d is supported\n", path,
+                show->header->version, SHOW_FILE_VERSION);
+        goto fail;
+    }
+    if (show->header->byte_order != SHOW_FILE_BYTE_ORDER) {
+        fprintf(stderr, "Show file %s is corrupt\n", path);
+        goto fail;
+    }
+
+    show->samples = (const struct lasershark_sample*)(base + show->header->sample_offset);
+    show->commands = (const struct show_command*)(base + show->header->command_offset);
+    show->sections = (const struct show_section*)(base + show->header->section_offset);
+    show->strings = base + show->header->string_offset;
+    if (!check_tables(show)) {
+        fprintf(stderr, "Show file %s is corrupt\n", path);
+        goto fail;
+    }
+
+    return show;
+
+fail:
+    show_file_close(show);
+    return NULL;
+}
+
+
+void show_file_close(struct show_file *show)
+{
+    if (show == NULL) {
+        return;
+    }
+    unmap_file(show);
+    free(show);
+}
+
+
+long show_file_find_section(const struct show_file *show, const char *name)
+{
+    const char *c;
+    uint64_t i;
+
+    for (c = name; isdigit((unsigned char)*c); c++) {
+    }
+    if (*name && !*c) {
+        i = strtoull(name, NULL, 10);
+        return i < show->header->section_count ? (long)i : -1;
+    }
+
+    for (i = 0; i < show->header->section_count; i++) {
+        if (0 == strcmp(show->sections[i].name, name)) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
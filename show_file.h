@@ -0,0 +1,142 @@
+/*
+show_file.h - Precompiled lasershark_stdin shows, laid out so samples can be
+sent straight from a memory mapping of the file.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHOW_FILE_H
+#define SHOW_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lasershark_sample.h"
+
+/*
+A show file is written by lasershark_stdin_compile and played with
+lasershark_stdin -f. Everything is stored in the host byte order and
+struct layout of the machine that compiled it, so the samples can be sent
+in place. The header's byte_order marker lets lasershark_stdin reject a file
+compiled on a machine with the other byte order; recompile it from the text
+show there instead.
+
+    header                          struct show_file_header, at offset 0
+    samples                         sample_count samples in the Lasershark
+                                    packet layout, at a page aligned offset
+    commands                        command_count struct show_command, in
+                                    sample_pos order
+    sections                        section_count struct show_section, in
+                                    sample_pos order
+    strings                         NUL terminated texts of print commands
+
+Commands take effect right before the sample at their sample_pos. Each
+section records the ilda rate and output state in effect at its start, so
+playback can begin at any section without replaying what came before it.
+*/
+#define SHOW_FILE_MAGIC "LSSHOW01"
+#define SHOW_FILE_MAGIC_LEN 8
+#define SHOW_FILE_VERSION 3
+// Read back as SHOW_FILE_BYTE_ORDER_SWAPPED on a machine with the other byte order
+#define SHOW_FILE_BYTE_ORDER 0x01020304
+#define SHOW_FILE_BYTE_ORDER_SWAPPED 0x04030201
+// Samples start on a page boundary so they can be handed to USB in place.
+#define SHOW_FILE_SAMPLE_ALIGN 4096
+#define SHOW_FILE_SECTION_NAME_LEN 48
+
+enum show_command_type
+{
+    SHOW_CMD_SET_ILDA_RATE = 1,
+    SHOW_CMD_SET_OUTPUT,
+    SHOW_CMD_FLUSH,
+    // val is the text's offset into the strings
+    SHOW_CMD_PRINT
+};
+
+struct show_file_header
+{
+    char magic[SHOW_FILE_MAGIC_LEN];
+    uint32_t version;
+    uint32_t byte_order;
+    // Largest x, y, a or b value in the show, checked against the DAC's
+    uint32_t dac_max;
+    uint32_t reserved;
+    uint64_t sample_offset;
+    uint64_t sample_count;
+    uint64_t command_offset;
+    uint64_t command_count;
+    uint64_t section_offset;
+    uint64_t section_count;
+    uint64_t string_offset;
+    uint64_t string_size;
+};
+
+struct show_command
+{
+    uint64_t sample_pos;
+    uint32_t type;
+    uint32_t val;
+};
+
+// Section flags, which of the section's states were set before its start
+#define SHOW_SECTION_HAS_ILDA_RATE 1
+#define SHOW_SECTION_HAS_OUTPUT 2
+
+struct show_section
+{
+    uint64_t sample_pos;
+    // First command at or after sample_pos
+    uint64_t command_index;
+    uint32_t ilda_rate;
+    uint32_t output;
+    uint32_t flags;
+    uint32_t reserved;
+    char name[SHOW_FILE_SECTION_NAME_LEN];
+};
+
+/*
+A show file mapped into memory. The pointers point into the mapping.
+*/
+struct show_file
+{
+    const struct show_file_header *header;
+    const struct lasershark_sample *samples;
+    const struct show_command *commands;
+    const struct show_section *sections;
+    const char *strings;
+
+    void *map;
+    size_t map_len;
+#ifdef _WIN32
+    void *file_handle;
+    void *map_handle;
+#endif
+};
+
+/*
+Maps the show file at path and checks that its tables lie within it.
+Returns NULL on failure, having reported why.
+*/
+struct show_file *show_file_open(const char *path);
+
+void show_file_close(struct show_file *show);
+
+/*
+Finds a section by name, or by number if name is all digits. Returns -1 if
+there is no such section.
+*/
+long show_file_find_section(const struct show_file *show, const char *name);
+
+#endif
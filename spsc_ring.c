@@ -0,0 +1,162 @@
+/*
+spsc_ring.c - Lock-free single producer, single consumer ring of fixed size
+slots.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "spsc_ring.h"
+
+// Keeps the producer and consumer indexes (and slots) on separate cache lines.
+#define SPSC_RING_ALIGN 64
+
+struct spsc_ring
+{
+    // Written by the producer only.
+    _Alignas(SPSC_RING_ALIGN) atomic_uint_fast32_t head;
+    uint32_t high_water;
+    // Written by the consumer only.
+    _Alignas(SPSC_RING_ALIGN) atomic_uint_fast32_t tail;
+
+    _Alignas(SPSC_RING_ALIGN) uint32_t depth;
+    uint32_t mask;
+    size_t slot_size;
+    unsigned char *slots;
+};
+
+
+struct spsc_ring *spsc_ring_create(uint32_t depth, size_t slot_size)
+{
+    struct spsc_ring *ring;
+
+    if (depth == 0 || depth > (1U << 31) || slot_size == 0) {
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(struct spsc_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    // Rounded up to a power of two so indexes can run freely and wrap.
+    ring->depth = 1;
+    while (ring->depth < depth) {
+        ring->depth <<= 1;
+    }
+    ring->mask = ring->depth - 1;
+    ring->slot_size = (slot_size + SPSC_RING_ALIGN - 1) & ~(size_t)(SPSC_RING_ALIGN - 1);
+    ring->slots = malloc(ring->slot_size * ring->depth);
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return ring;
+}
+
+
+void spsc_ring_destroy(struct spsc_ring *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    free(ring->slots);
+    free(ring);
+}
+
+
+static inline void *slot_at(struct spsc_ring *ring, uint32_t index)
+{
+    return ring->slots + (size_t)(index & ring->mask) * ring->slot_size;
+}
+
+
+void *spsc_ring_claim(struct spsc_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if ((uint32_t)(head - tail) >= ring->depth) {
+        return NULL;
+    }
+
+    return slot_at(ring, head);
+}
+
+
+void spsc_ring_publish(struct spsc_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+    uint32_t used = head - (uint32_t)atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (used > ring->high_water) {
+        ring->high_water = used;
+    }
+
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+
+void *spsc_ring_peek(struct spsc_ring *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return slot_at(ring, tail);
+}
+
+
+void *spsc_ring_peek_next(struct spsc_ring *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if ((uint32_t)(head - tail) < 2) {
+        return NULL;
+    }
+
+    return slot_at(ring, tail + 1);
+}
+
+
+void spsc_ring_release(struct spsc_ring *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+
+uint32_t spsc_ring_depth(struct spsc_ring *ring)
+{
+    return ring->depth;
+}
+
+
+uint32_t spsc_ring_high_water(struct spsc_ring *ring)
+{
+    return ring->high_water;
+}
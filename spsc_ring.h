@@ -0,0 +1,73 @@
+/*
+spsc_ring.h - Lock-free single producer, single consumer ring of fixed size
+slots.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct spsc_ring;
+
+/*
+Creates a ring of slot_size byte slots. depth is rounded up to a power of two.
+Returns NULL on failure.
+*/
+struct spsc_ring *spsc_ring_create(uint32_t depth, size_t slot_size);
+
+void spsc_ring_destroy(struct spsc_ring *ring);
+
+/*
+Producer side. Returns the next free slot, or NULL if the ring is full.
+Calling it again before spsc_ring_publish() returns the same slot.
+*/
+void *spsc_ring_claim(struct spsc_ring *ring);
+
+/*
+Producer side. Hands the claimed slot to the consumer.
+*/
+void spsc_ring_publish(struct spsc_ring *ring);
+
+/*
+Consumer side. Returns the oldest published slot, or NULL if the ring is
+empty. Calling it again before spsc_ring_release() returns the same slot.
+*/
+void *spsc_ring_peek(struct spsc_ring *ring);
+
+/*
+Consumer side. Returns the published slot after the one spsc_ring_peek()
+returns, or NULL if there is none yet. Lets the consumer see what's coming
+without giving up the current slot.
+*/
+void *spsc_ring_peek_next(struct spsc_ring *ring);
+
+/*
+Consumer side. Gives the peeked slot back to the producer.
+*/
+void spsc_ring_release(struct spsc_ring *ring);
+
+uint32_t spsc_ring_depth(struct spsc_ring *ring);
+
+/*
+Returns the most slots that were ever published but not yet released.
+*/
+uint32_t spsc_ring_high_water(struct spsc_ring *ring);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+time_portable.h - Monotonic clock and precise sleeps.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIME_PORTABLE_H
+#define TIME_PORTABLE_H
+
+#include <stdint.h>
+
+/*
+Returns microseconds on a monotonic clock with an arbitrary epoch.
+*/
+uint64_t time_portable_now_us(void);
+
+/*
+Sleeps for us microseconds, resuming after signal interruptions.
+*/
+void time_portable_sleep_us(uint64_t us);
+
+#endif